@@ -3,13 +3,38 @@
 // license that can be found in the LICENSE file.
 
 #include "cache.h"
+#include "shard_policy.h"
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LRU_CACHE_HAVE_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#define LRU_CACHE_HAVE_NUMA
+#include <sched.h>
+#endif
 
 // The LRU_CACHE_FALLTHROUGH_INTENDED macro can be used to annotate implicit fall-through
 // between switch labels. The real definition should be provided externally.
@@ -18,349 +43,4393 @@
 #define LRU_CACHE_FALLTHROUGH_INTENDED do { } while (0)
 #endif
 
+// Hint that the cache line holding "addr" will be read soon.
+#ifndef LRU_CACHE_PREFETCH
+#if defined(__GNUC__) || defined(__clang__)
+#define LRU_CACHE_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define LRU_CACHE_PREFETCH(addr) do { } while (0)
+#endif
+#endif
+
 namespace {
 
+static uint64_t NowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The clock TTL deadlines are kept in.
+static uint64_t NowMillis() {
+    return NowNanos() / 1000000;
+}
+
+// Timings of a mutex, kept when LRUCacheOptions::instrument_locks is set.
+// Only updated with the mutex held.
+struct LockStats {
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_nanos;
+    uint64_t hold_nanos;
+    
+    LockStats(): acquisitions(0), contended(0), wait_nanos(0), hold_nanos(0) { }
+};
+
 struct MutexLock {
     std::mutex* l;
-    MutexLock(std::mutex *l): l(l) { l->lock(); }
-    ~MutexLock() { l->unlock(); }
+    LockStats* stats;
+    uint64_t locked_at;
+    
+    MutexLock(std::mutex *l, LockStats* stats = NULL): l(l), stats(stats) {
+        if (stats == NULL) {
+            l->lock();
+            return;
+        }
+        if (l->try_lock()) {
+            locked_at = NowNanos();
+        } else {
+            const uint64_t start = NowNanos();
+            l->lock();
+            locked_at = NowNanos();
+            stats->contended++;
+            stats->wait_nanos += locked_at - start;
+        }
+        stats->acquisitions++;
+    }
+    ~MutexLock() {
+        if (stats != NULL) {
+            stats->hold_nanos += NowNanos() - locked_at;
+        }
+        l->unlock();
+    }
 };
 
-uint32_t Hash(const char* data, size_t n, uint32_t seed) {
-    // Similar to murmur hash
-    const uint32_t m = 0xc6a4a793;
-    const uint32_t r = 24;
+static inline uint64_t Rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t Load64(const char* p) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static inline uint32_t Load32(const char* p) {
+    uint32_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static const uint64_t kPrime1 = 0x9e3779b185ebca87ULL;
+static const uint64_t kPrime2 = 0xc2b2ae3d27d4eb4fULL;
+static const uint64_t kPrime3 = 0x165667b19e3779f9ULL;
+static const uint64_t kPrime4 = 0x85ebca77c2b2ae63ULL;
+static const uint64_t kPrime5 = 0x27d4eb2f165667c5ULL;
+
+static inline uint64_t HashRound(uint64_t acc, uint64_t input) {
+    acc += input * kPrime2;
+    acc = Rotl64(acc, 31);
+    return acc * kPrime1;
+}
+
+static inline uint64_t HashMerge(uint64_t acc, uint64_t lane) {
+    acc ^= HashRound(0, lane);
+    return acc * kPrime1 + kPrime4;
+}
+
+// xxHash64.  Long keys are consumed 32 bytes at a time by four
+// independent lanes, so the multiplies overlap instead of forming one
+// dependency chain, and the final avalanche leaves every output bit,
+// including the high ones Shard() uses, dependent on every input bit.
+uint64_t Hash(const char* data, size_t n, uint64_t seed) {
     const char* limit = data + n;
-    uint32_t h = seed ^ (n * m);
+    uint64_t h;
     
-    // Pick up four bytes at a time
-    while (data + 4 <= limit) {
-        uint32_t w = 0;
-        memcpy(&w, data, sizeof(uint32_t)); // DecodeFixed32
-        
+    if (n >= 32) {
+        uint64_t v1 = seed + kPrime1 + kPrime2;
+        uint64_t v2 = seed + kPrime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - kPrime1;
+        do {
+            v1 = HashRound(v1, Load64(data));
+            v2 = HashRound(v2, Load64(data + 8));
+            v3 = HashRound(v3, Load64(data + 16));
+            v4 = HashRound(v4, Load64(data + 24));
+            data += 32;
+        } while (data + 32 <= limit);
+        h = Rotl64(v1, 1) + Rotl64(v2, 7) + Rotl64(v3, 12) + Rotl64(v4, 18);
+        h = HashMerge(h, v1);
+        h = HashMerge(h, v2);
+        h = HashMerge(h, v3);
+        h = HashMerge(h, v4);
+    } else {
+        h = seed + kPrime5;
+    }
+    h += n;
+    
+    // Pick up the remaining bytes
+    for (; data + 8 <= limit; data += 8) {
+        h ^= HashRound(0, Load64(data));
+        h = Rotl64(h, 27) * kPrime1 + kPrime4;
+    }
+    if (data + 4 <= limit) {
+        h ^= Load32(data) * kPrime1;
+        h = Rotl64(h, 23) * kPrime2 + kPrime3;
         data += 4;
-        h += w;
-        h *= m;
-        h ^= (h >> 16);
-    }
-
-    // Pick up remaining bytes
-    switch (limit - data) {
-    case 3:
-        h += data[2] << 16;
-        LRU_CACHE_FALLTHROUGH_INTENDED;
-    case 2:
-        h += data[1] << 8;
-        LRU_CACHE_FALLTHROUGH_INTENDED;
-    case 1:
-        h += data[0];
-        h *= m;
-        h ^= (h >> r);
-        break;
     }
+    for (; data < limit; data++) {
+        h ^= static_cast<unsigned char>(*data) * kPrime5;
+        h = Rotl64(h, 11) * kPrime1;
+    }
+    
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
     return h;
 }
 
+// Epoch based reclamation for the lock-free lookup path.
+//
+// Readers that walk a HandleTable without holding the shard mutex
+// announce themselves in a per-thread slot for the duration of the walk.
+// Memory unlinked by a writer is retired together with the global epoch
+// at that time, and only released once every reader that might still
+// see it has left its read section.
+
+struct EpochSlot {
+    std::atomic<uint64_t> epoch;    // 0 while the owner is not reading
+    std::atomic<bool> in_use;
+    EpochSlot* next;
+    char padding[48];               // Keep slots on separate cache lines
+};
+
+std::atomic<uint64_t> global_epoch(1);
+std::atomic<EpochSlot*> epoch_slots(NULL);
+
+// Slots are never freed; a thread returns its slot on exit so that a
+// later thread may reuse it.
+EpochSlot* AcquireEpochSlot() {
+    for (EpochSlot* s = epoch_slots.load(std::memory_order_acquire); s != NULL; s = s->next) {
+        bool expected = false;
+        if (!s->in_use.load(std::memory_order_relaxed) &&
+            s->in_use.compare_exchange_strong(expected, true)) {
+            return s;
+        }
+    }
+    EpochSlot* s = new EpochSlot;
+    s->epoch.store(0, std::memory_order_relaxed);
+    s->in_use.store(true, std::memory_order_relaxed);
+    s->next = epoch_slots.load(std::memory_order_relaxed);
+    while (!epoch_slots.compare_exchange_weak(s->next, s)) {
+    }
+    return s;
+}
+
+struct EpochSlotOwner {
+    EpochSlot* slot;
+    EpochSlotOwner(): slot(AcquireEpochSlot()) { }
+    ~EpochSlotOwner() { slot->in_use.store(false, std::memory_order_release); }
+};
+
+EpochSlot* ThreadEpochSlot() {
+    static thread_local EpochSlotOwner owner;
+    return owner.slot;
+}
+
+// Marks the current thread as reading for the guard's lifetime.
+struct EpochGuard {
+    EpochSlot* slot;
+    EpochGuard(): slot(ThreadEpochSlot()) {
+        slot->epoch.store(global_epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+    ~EpochGuard() { slot->epoch.store(0, std::memory_order_release); }
+};
+
+// Oldest epoch any reader may still be working in.
+uint64_t MinActiveEpoch() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t min = UINT64_MAX;
+    for (EpochSlot* s = epoch_slots.load(std::memory_order_acquire); s != NULL; s = s->next) {
+        uint64_t e = s->epoch.load(std::memory_order_acquire);
+        if (e != 0 && e < min) {
+            min = e;
+        }
+    }
+    return min;
+}
+
+// Holds retired memory until it is safe to release.  The owner
+// provides the synchronization (all calls are made under a shard mutex).
+class EpochReclaimer {
+public:
+    EpochReclaimer() : collect_at_(kCollectBatch) { }
+    ~EpochReclaimer() {
+        // No reader can reach the owner's memory any more.
+        for (size_t i = 0; i < retired_.size(); i++) {
+            (*retired_[i].release)(retired_[i].arg, retired_[i].ptr);
+        }
+    }
+    
+    // Calls (*release)(arg, ptr) once no reader can see ptr any more.
+    void Retire(void* ptr, void (*release)(void* arg, void* ptr), void* arg) {
+        Retired r;
+        r.ptr = ptr;
+        r.release = release;
+        r.arg = arg;
+        r.epoch = global_epoch.fetch_add(1);
+        retired_.push_back(r);
+        if (retired_.size() >= collect_at_) {
+            Collect();
+        }
+    }
+    
+    // Release what no reader can see any more.  Retire() calls this every
+    // kCollectBatch retirements.
+    void Collect() {
+        const uint64_t min = MinActiveEpoch();
+        size_t n = 0;
+        for (size_t i = 0; i < retired_.size(); i++) {
+            if (retired_[i].epoch < min) {
+                (*retired_[i].release)(retired_[i].arg, retired_[i].ptr);
+            } else {
+                retired_[n++] = retired_[i];
+            }
+        }
+        retired_.resize(n);
+        collect_at_ = n + kCollectBatch;
+    }
+    
+private:
+    static const size_t kCollectBatch = 64;
+    
+    struct Retired {
+        void* ptr;
+        void (*release)(void* arg, void* ptr);
+        void* arg;
+        uint64_t epoch;
+    };
+    
+    std::vector<Retired> retired_;
+    size_t collect_at_;
+};
+
 // LRU cache implementation
 
+typedef void (*EntryDeleter)(const char* key, void* value);
+
 // An entry is a variable length heap-allocated structure.  Entries
-// are kept in a circular doubly linked list ordered by access time.
+// are kept in a circular doubly linked list ordered by access time
+// (for kClockPolicy, by insertion time and last sweep).
+//
+// refs, referenced and next_hash are atomic because lock-free lookups
+// read them without the shard mutex.  Lock-free lookups and Release()
+// also read fields that are set before the entry is published and never
+// change (key, hash, charge, has_ttl, replica); everything else is only
+// touched under the mutex or through a handle the caller owns.
 struct LRUHandle {
-    void* value;
-    void (*deleter)(const char*, void* value);
-    LRUHandle* next_hash;
+    void* value;        // For inline values, points just past the key
+    EntryDeleter deleter;   // May be NULL for inline values
+    std::atomic<LRUHandle*> next_hash;
     LRUHandle* next;
     LRUHandle* prev;
-    size_t charge;      // TODO(opt): Only allow uint32_t?
-    size_t key_length;
-    uint32_t refs;
-    uint32_t hash;      // Hash of key(); used for fast sharding and comparisons
-    char key_data[1];   // Beginning of key
+    uint64_t hash;      // Hash of key(); used for fast sharding and comparisons
+    size_t charge;
+    uint32_t key_length;
+    uint32_t value_size;    // Bytes of inline value, 0 if "value" is the client's
+    std::atomic<uint32_t> refs;     // Count, plus kInUse while on the in-use list
+    uint32_t tick;      // GlobalBudget::clock when last made newest, if global
+    std::atomic<bool> referenced;   // Hit without promotion since last sweep
+    bool in_cache;      // Whether entry is in the cache
+    bool in_protected;  // Whether entry is in the protected segment
+    bool low_priority;  // Inserted with kLowPriority and not hit since
+    bool has_ttl;       // Whether ExpiryLinks precede the entry
+    bool spill;         // Evicted, to be copied to the secondary cache
+    unsigned char replica;  // Index of the NUMA replica that owns the entry
+    char key_data[1];   // Beginning of key, followed by a NUL
+    
+    // Set in refs while a cached entry is on its shard's in-use list, and
+    // on an entry that left the cache while clients still held it, which
+    // keeps the cache's reference.  The shard sets and clears it under
+    // its mutex; keeping it in refs lets Release() see it and the count
+    // in one atomic operation, and take the mutex for the last client.
+    static const uint32_t kInUse = 1u << 31;
     
     const char* key() const {
         return &key_data[0];
     }
+    
+    // Inline values start at the first 8-byte boundary after the key's NUL.
+    static size_t InlineValueOffset(size_t key_len) {
+        return (offsetof(LRUHandle, key_data) + key_len + 1 + 7) & ~size_t(7);
+    }
+    
+    bool Matches(const char* k, size_t len, uint64_t h) const {
+        return hash == h && key_length == len && memcmp(key_data, k, len) == 0;
+    }
+    
+    // Record a hit for the next eviction sweep.  Skips the store when the
+    // bit is already set to keep the cache line clean.
+    void SetReferenced() {
+        if (!referenced.load(std::memory_order_relaxed)) {
+            referenced.store(true, std::memory_order_relaxed);
+        }
+    }
+    
+    // Set kInUse if anyone besides the cache holds a reference.
+    bool MarkInUse() {
+        uint32_t r = refs.load(std::memory_order_relaxed);
+        while (r > 1) {
+            if (refs.compare_exchange_weak(r, r | kInUse, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Take a reference unless the entry is already dead.  Returns the
+    // previous count, 0 if it failed.
+    uint32_t TryRef() {
+        uint32_t r = refs.load(std::memory_order_relaxed);
+        while (r != 0) {
+            if (refs.compare_exchange_weak(r, r + 1, std::memory_order_acquire)) {
+                return r;
+            }
+        }
+        return 0;
+    }
+    
+    inline bool Expired(uint64_t now) const;
+};
+
+// Allocated just before an entry inserted with a TTL, so that entries
+// without one do not pay for it.  Links the entry into its shard's timer
+// wheel, in the slot of its deadline.
+struct ExpiryLinks {
+    ExpiryLinks* next;
+    ExpiryLinks* prev;
+    uint64_t deadline;  // NowMillis() from which the entry is expired
+    
+    LRUHandle* entry() {
+        return reinterpret_cast<LRUHandle*>(this + 1);
+    }
+    static ExpiryLinks* Of(const LRUHandle* e) {
+        return reinterpret_cast<ExpiryLinks*>(const_cast<LRUHandle*>(e)) - 1;
+    }
 };
 
+bool LRUHandle::Expired(uint64_t now) const {
+    return has_ttl && ExpiryLinks::Of(this)->deadline <= now;
+}
+
 // We provide our own simple hash table since it removes a whole bunch
 // of porting hacks and is also faster than some of the built-in hash
 // table implementations in some of the compiler/runtime combinations
 // we have tested.  E.g., readrandom speeds up by ~5% over the g++
 // 4.4.3's builtin hashtable.
+//
+// The table grows and shrinks incrementally: a resize allocates the new
+// bucket array and then every Lookup(), Insert() and Remove() migrates a
+// few buckets of the old one, so no single operation rehashes the whole
+// table.  While a migration is in progress, an old bucket that has not
+// been migrated yet still holds its entries, and no shrink is started.
+//
+// All mutations happen under the owning shard's mutex.  Once a
+// reclaimer is set, LookupLockFree() may be called concurrently with
+// them; replaced bucket arrays are then retired instead of freed.
 class HandleTable {
 public:
-    HandleTable() : length_(0), elems_(0), list_(NULL) { Resize(); }
-    ~HandleTable() { delete[] list_; }
+    HandleTable()
+        : elems_(0), list_(NewBuckets(kMinLength)), old_list_(NULL), migrate_pos_(0),
+          migrate_step_(kMigrateBuckets), reclaimer_(NULL), seq_(0), resizes_(0),
+          min_length_(kMinLength) { }
+    ~HandleTable() {
+        free(list_.load(std::memory_order_relaxed));
+        free(old_list_.load(std::memory_order_relaxed));
+    }
+    
+    void SetReclaimer(EpochReclaimer* reclaimer) { reclaimer_ = reclaimer; }
+    
+    uint32_t Size() const { return elems_; }
+    
+    // Buckets of the current array, and resizes started so far.
+    uint32_t Slots() const { return list_.load(std::memory_order_relaxed)->length; }
+    uint64_t Resizes() const { return resizes_; }
+    
+    void Prefetch(uint64_t hash) const {
+        Buckets* b = list_.load(std::memory_order_relaxed);
+        LRU_CACHE_PREFETCH(&b->list[hash & (b->length - 1)]);
+    }
+    
+    LRUHandle* Lookup(const char* key, size_t key_len, uint64_t hash) {
+        MigrateSome();
+        return FindPointer(key, key_len, hash)->load(std::memory_order_relaxed);
+    }
     
-    LRUHandle* Lookup(const char* key, uint32_t hash) {
-        return *FindPointer(key, hash);
+    // Lookup without the shard mutex; the caller must be inside an
+    // EpochGuard.  Returns false if the result is not conclusive (a
+    // migration step was in progress) and the caller should retry under
+    // the mutex.  On success, *result is the matching entry, not yet
+    // referenced and possibly already dead, or NULL if there is no
+    // mapping.
+    bool LookupLockFree(const char* key, size_t key_len, uint64_t hash, LRUHandle** result) {
+        const uint32_t seq = seq_.load(std::memory_order_acquire);
+        if (seq & 1) {
+            return false;
+        }
+        // Entries only move between the two arrays inside a migration
+        // step, so outside of one every entry is in exactly one of them.
+        Buckets* lists[2];
+        lists[0] = list_.load(std::memory_order_acquire);
+        lists[1] = old_list_.load(std::memory_order_acquire);
+        for (int i = 0; i < 2 && lists[i] != NULL; i++) {
+            Buckets* b = lists[i];
+            LRUHandle* e = b->list[hash & (b->length - 1)].load(std::memory_order_acquire);
+            while (e != NULL) {
+                if (e->Matches(key, key_len, hash)) {
+                    *result = e;
+                    return true;
+                }
+                e = e->next_hash.load(std::memory_order_acquire);
+            }
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        *result = NULL;
+        return seq_.load(std::memory_order_relaxed) == seq;
     }
     
     LRUHandle* Insert(LRUHandle* h) {
-        LRUHandle** ptr = FindPointer(h->key(), h->hash);
-        LRUHandle* old = *ptr;
-        h->next_hash = (old == NULL ? NULL : old->next_hash);
-        *ptr = h;
+        MigrateSome();
+        std::atomic<LRUHandle*>* ptr = FindPointer(h->key(), h->key_length, h->hash);
+        LRUHandle* old = ptr->load(std::memory_order_relaxed);
+        h->next_hash.store(old == NULL ? NULL : old->next_hash.load(std::memory_order_relaxed),
+                           std::memory_order_relaxed);
+        ptr->store(h, std::memory_order_release);
         if (old == NULL) {
             ++elems_;
-            if (elems_ > length_) {
+            const uint32_t length = list_.load(std::memory_order_relaxed)->length;
+            if (elems_ > length) {
                 // Since each cache entry is fairly large, we aim for a small
                 // average linked list length (<= 1).
-                Resize();
+                StartResize(length * 2);
             }
         }
         return old;
     }
+    
+    // Size the table for "n" more entries now rather than by doubling as
+    // they are inserted.
+    void Reserve(uint32_t n) {
+        uint32_t length = list_.load(std::memory_order_relaxed)->length;
+        if (elems_ + n <= length) {
+            return;
+        }
+        while (length < elems_ + n) {
+            length *= 2;
+        }
+        StartResize(length);
+    }
+    
+    // Reserve() room for "n" entries, and never shrink below it.
+    void SetMinSize(uint32_t n) {
+        Reserve(n);
+        min_length_ = list_.load(std::memory_order_relaxed)->length;
+    }
 
-    LRUHandle* Remove(const char* key, uint32_t hash) {
-        LRUHandle** ptr = FindPointer(key, hash);
-        LRUHandle* result = *ptr;
+    LRUHandle* Remove(const char* key, size_t key_len, uint64_t hash) {
+        MigrateSome();
+        std::atomic<LRUHandle*>* ptr = FindPointer(key, key_len, hash);
+        LRUHandle* result = ptr->load(std::memory_order_relaxed);
         if (result != NULL) {
-            *ptr = result->next_hash;
+            ptr->store(result->next_hash.load(std::memory_order_relaxed), std::memory_order_release);
             --elems_;
+            // Give memory back once the table is mostly empty; the gap to
+            // the growth threshold keeps a steady size from thrashing.
+            // Waiting for the last migration to drain keeps a run of
+            // removals from forcing the rest of it into one call.
+            const uint32_t length = list_.load(std::memory_order_relaxed)->length;
+            if (elems_ < length / 4 && length > min_length_ && old_list_.load(std::memory_order_relaxed) == NULL) {
+                StartResize(length / 2);
+            }
         }
         return result;
     }
     
 private:
+    static const uint32_t kMinLength = 4;
+    
+    // Least number of old buckets moved per Lookup(), Insert() or
+    // Remove(); see StartResize().
+    static const uint32_t kMigrateBuckets = 4;
+    
     // The table consists of an array of buckets where each bucket is
-    // a linked list of cache entries that hash into the bucket.
-    uint32_t length_;
+    // a linked list of cache entries that hash into the bucket.  The
+    // length is kept with the array so that lock-free readers always
+    // see a matching pair.
+    struct Buckets {
+        uint32_t length;
+        std::atomic<LRUHandle*> list[1];
+    };
+    
     uint32_t elems_;
-    LRUHandle** list_;
+    std::atomic<Buckets*> list_;
+    
+    // Array being migrated into list_, or NULL.  Its buckets below
+    // migrate_pos_ are empty.
+    std::atomic<Buckets*> old_list_;
+    uint32_t migrate_pos_;
+    uint32_t migrate_step_;     // Old buckets moved per operation
+    
+    EpochReclaimer* reclaimer_;
+    
+    // Odd while a migration step relinks entries, which can divert a
+    // concurrent reader into the wrong chain.
+    std::atomic<uint32_t> seq_;
+    
+    uint64_t resizes_;
+    uint32_t min_length_;
 
     // Return a pointer to slot that points to a cache entry that
     // matches key/hash.  If there is no such cache entry, return a
     // pointer to the trailing slot in the corresponding linked list.
-    LRUHandle** FindPointer(const char* key, uint32_t hash) {
-        LRUHandle** ptr = &list_[hash & (length_ - 1)];
-        while (*ptr != NULL && ((*ptr)->hash != hash || strcmp(key, (*ptr)->key()) != 0)) {
-            ptr = &(*ptr)->next_hash;
+    std::atomic<LRUHandle*>* FindPointer(const char* key, size_t key_len, uint64_t hash) {
+        Buckets* b = old_list_.load(std::memory_order_relaxed);
+        if (b == NULL || (hash & (b->length - 1)) < migrate_pos_) {
+            b = list_.load(std::memory_order_relaxed);
+        }
+        std::atomic<LRUHandle*>* ptr = &b->list[hash & (b->length - 1)];
+        LRUHandle* e;
+        while ((e = ptr->load(std::memory_order_relaxed)) != NULL && !e->Matches(key, key_len, hash)) {
+            ptr = &e->next_hash;
         }
         return ptr;
     }
     
-    void Resize() {
-        uint32_t new_length = 4;
-        while (new_length < elems_) {
-            new_length *= 2;
+    static Buckets* NewBuckets(uint32_t length) {
+        const size_t bytes = sizeof(Buckets) + sizeof(std::atomic<LRUHandle*>) * (length - 1);
+        Buckets* b = reinterpret_cast<Buckets*>(malloc(bytes));
+        b->length = length;
+        for (uint32_t i = 0; i < length; i++) {
+            new (&b->list[i]) std::atomic<LRUHandle*>(NULL);
+        }
+        return b;
+    }
+    
+    static void FreeBuckets(void* /*arg*/, void* b) {
+        free(b);
+    }
+    
+    void StartResize(uint32_t new_length) {
+        // Only a Reserve() can get here before the last migration is done.
+        if (old_list_.load(std::memory_order_relaxed) != NULL) {
+            MigrateSome(UINT32_MAX);
+        }
+        // Finish the migration within half the inserts that would start
+        // the next growth; shrinks wait for it anyway.
+        const uint32_t old_length = list_.load(std::memory_order_relaxed)->length;
+        const uint32_t room = (new_length > elems_) ? new_length - elems_ : 1;
+        migrate_step_ = static_cast<uint32_t>(2 * uint64_t(old_length) / room + 1);
+        if (migrate_step_ < kMigrateBuckets) {
+            migrate_step_ = kMigrateBuckets;
+        }
+        // Publish the old array before the new one, so that a reader that
+        // sees the new array also finds the entries not migrated yet.
+        ++resizes_;
+        migrate_pos_ = 0;
+        old_list_.store(list_.load(std::memory_order_relaxed), std::memory_order_release);
+        list_.store(NewBuckets(new_length), std::memory_order_release);
+    }
+    
+    void MigrateSome(uint32_t count = 0) {
+        Buckets* old_list = old_list_.load(std::memory_order_relaxed);
+        if (old_list == NULL) {
+            return;
         }
-        LRUHandle** new_list = new LRUHandle*[new_length];
-        memset(new_list, 0, sizeof(new_list[0]) * new_length);
-        uint32_t count = 0;
-        for (uint32_t i = 0; i < length_; i++) {
-            LRUHandle* h = list_[i];
+        if (count == 0) {
+            count = migrate_step_;
+        }
+        Buckets* new_list = list_.load(std::memory_order_relaxed);
+        const uint32_t new_length = new_list->length;
+        
+        const uint32_t seq = seq_.load(std::memory_order_relaxed);
+        seq_.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (; count > 0 && migrate_pos_ < old_list->length; count--, migrate_pos_++) {
+            LRUHandle* h = old_list->list[migrate_pos_].load(std::memory_order_relaxed);
             while (h != NULL) {
-                LRUHandle* next = h->next_hash;
-                uint32_t hash = h->hash;
-                LRUHandle** ptr = &new_list[hash & (new_length - 1)];
-                h->next_hash = *ptr;
-                *ptr = h;
+                LRUHandle* next = h->next_hash.load(std::memory_order_relaxed);
+                uint64_t hash = h->hash;
+                std::atomic<LRUHandle*>* ptr = &new_list->list[hash & (new_length - 1)];
+                h->next_hash.store(ptr->load(std::memory_order_relaxed), std::memory_order_relaxed);
+                ptr->store(h, std::memory_order_release);
                 h = next;
-                count++;
             }
+            old_list->list[migrate_pos_].store(NULL, std::memory_order_relaxed);
+        }
+        seq_.store(seq + 2, std::memory_order_release);
+        
+        if (migrate_pos_ < old_list->length) {
+            return;
+        }
+        old_list_.store(NULL, std::memory_order_release);
+        if (reclaimer_ != NULL) {
+            reclaimer_->Retire(old_list, &FreeBuckets, NULL);
+        } else {
+            free(old_list);
         }
-        assert(elems_ == count);
-        delete[] list_;
-        list_ = new_list;
-        length_ = new_length;
     }
 };
 
-// A single shard of sharded cache.
-class LRUCacheImpl {
+// Index of the lowest set bit; x must be non-zero.
+static inline int CountTrailingZeros64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while ((x & 1) == 0) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+// An open-addressing alternative to HandleTable, laid out like a Swiss
+// table: slots are probed in groups of eight, and each group has one
+// 64-bit control word holding a byte per slot, either a 7-bit tag taken
+// from the hash or a marker for an empty or deleted slot.  A probe
+// compares all eight tags at once with word-wide (SWAR) arithmetic, so a
+// miss is usually settled by a single control word, and a handle is only
+// dereferenced when its tag matches.  Keeping the control words as
+// atomics makes them safe for LookupLockFree() to read without relying
+// on platform-specific vector loads.
+//
+// It offers the same interface and guarantees as HandleTable, including
+// incremental resizing: while a migration is in progress, lookups search
+// the new array and then the old one, and migrated slots of the old array
+// are marked deleted so that its probe sequences stay intact.
+class FlatHandleTable {
 public:
-    LRUCacheImpl();
-    ~LRUCacheImpl();
+    FlatHandleTable()
+        : elems_(0), list_(NewArray(1)), old_list_(NULL), migrate_pos_(0), migrate_step_(kMigrateGroups),
+          deferred_groups_(0), reclaimer_(NULL), seq_(0), resizes_(0), min_groups_(1) { }
+    ~FlatHandleTable() {
+        free(list_.load(std::memory_order_relaxed));
+        free(old_list_.load(std::memory_order_relaxed));
+    }
     
-    // Separate from constructor so caller can easily make an array of LRUCache
-    void SetCapacity(size_t capacity) { capacity_ = capacity; }
+    void SetReclaimer(EpochReclaimer* reclaimer) { reclaimer_ = reclaimer; }
     
-    // Like Cache methods, but with an extra "hash" parameter.
-    LRUCache::Handle* Insert(
-        const char* key, uint32_t hash, void* value, size_t charge,
-        void (*deleter)(const char* key, void* value)
-    );
-    LRUCache::Handle* Lookup(const char* key, uint32_t hash);
-    void Release(LRUCache::Handle* handle);
-    void Erase(const char* key, uint32_t hash);
+    uint32_t Size() const { return elems_; }
     
-private:
-    void LRU_Remove(LRUHandle* e);
-    void LRU_Append(LRUHandle* e);
-    void Unref(LRUHandle* e);
+    uint32_t Slots() const { return list_.load(std::memory_order_relaxed)->groups * kGroupWidth; }
+    uint64_t Resizes() const { return resizes_; }
     
-    // Initialized before use.
-    size_t capacity_;
+    void Prefetch(uint64_t hash) const {
+        Array* a = list_.load(std::memory_order_relaxed);
+        const uint32_t g = StartGroup(a, hash);
+        LRU_CACHE_PREFETCH(&a->ctrl[g]);
+        LRU_CACHE_PREFETCH(&a->slots[g * kGroupWidth]);
+    }
     
-    // mutex_ protects the following state.
-    std::mutex mutex_;
-    size_t usage_;
+    LRUHandle* Lookup(const char* key, size_t key_len, uint64_t hash) {
+        LRUHandle* e = NULL;
+        if (FindSlot(list_.load(std::memory_order_relaxed), key, key_len, hash, &e) == kNotFound) {
+            Array* old_list = old_list_.load(std::memory_order_relaxed);
+            if (old_list != NULL) {
+                FindSlot(old_list, key, key_len, hash, &e);
+            }
+        }
+        return e;
+    }
     
-    // Dummy head of LRU list.
-    // lru.prev is newest entry, lru.next is oldest entry.
-    LRUHandle lru_;
+    // Same contract as HandleTable::LookupLockFree().
+    bool LookupLockFree(const char* key, size_t key_len, uint64_t hash, LRUHandle** result) {
+        const uint32_t seq = seq_.load(std::memory_order_acquire);
+        if (seq & 1) {
+            return false;
+        }
+        Array* lists[2];
+        lists[0] = list_.load(std::memory_order_acquire);
+        lists[1] = old_list_.load(std::memory_order_acquire);
+        for (int i = 0; i < 2 && lists[i] != NULL; i++) {
+            // Use the handle FindSlot() matched: by now the slot may hold
+            // another key.
+            LRUHandle* e;
+            if (FindSlot(lists[i], key, key_len, hash, &e) != kNotFound) {
+                *result = e;
+                return true;
+            }
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        *result = NULL;
+        return seq_.load(std::memory_order_relaxed) == seq;
+    }
     
-    HandleTable table_;
-};
-
-LRUCacheImpl::LRUCacheImpl(): usage_(0) {
-    // Make empty circular linked list
-    lru_.next = &lru_;
-    lru_.prev = &lru_;
-}
-
-LRUCacheImpl::~LRUCacheImpl() {
-    for (LRUHandle* e = lru_.next; e != &lru_; ) {
-        LRUHandle* next = e->next;
-        assert(e->refs == 1);  // Error if caller has an unreleased handle
-        Unref(e);
-        e = next;
+    LRUHandle* Insert(LRUHandle* h) {
+        MigrateSome();
+        Array* lists[2];
+        lists[0] = list_.load(std::memory_order_relaxed);
+        lists[1] = old_list_.load(std::memory_order_relaxed);
+        for (int i = 0; i < 2 && lists[i] != NULL; i++) {
+            LRUHandle* old;
+            const uint32_t slot = FindSlot(lists[i], h->key(), h->key_length, h->hash, &old);
+            if (slot != kNotFound) {
+                lists[i]->slots[slot].store(h, std::memory_order_release);
+                return old;
+            }
+        }
+        if (lists[0]->used >= MaxLoad(lists[0]->groups)) {
+            // Never during a migration: see StartResize().
+            assert(lists[1] == NULL);
+            StartResize(GroupsFor(elems_ + 1));
+        }
+        Place(list_.load(std::memory_order_relaxed), h);
+        ++elems_;
+        return NULL;
     }
-}
-
-void LRUCacheImpl::Unref(LRUHandle* e) {
-    assert(e->refs > 0);
-    e->refs--;
-    if (e->refs <= 0) {
-        usage_ -= e->charge;
-        (*e->deleter)(e->key(), e->value);
-        free(e);
+    
+    // Same as HandleTable::Reserve().
+    void Reserve(uint32_t n) {
+        const uint32_t groups = GroupsFor(elems_ + n);
+        if (groups > list_.load(std::memory_order_relaxed)->groups) {
+            StartResize(groups);
+        }
     }
-}
-
-void LRUCacheImpl::LRU_Remove(LRUHandle* e) {
-    e->next->prev = e->prev;
-    e->prev->next = e->next;
-}
-
-void LRUCacheImpl::LRU_Append(LRUHandle* e) {
-    // Make "e" newest entry by inserting just before lru_
-    e->next = &lru_;
-    e->prev = lru_.prev;
-    e->prev->next = e;
-    e->next->prev = e;
-}
-
-LRUCache::Handle* LRUCacheImpl::Lookup(const char* key, uint32_t hash) {
-    MutexLock l(&mutex_);
-    LRUHandle* e = table_.Lookup(key, hash);
-    if (e != NULL) {
-        e->refs++;
-        LRU_Remove(e);
-        LRU_Append(e);
+    void SetMinSize(uint32_t n) {
+        Reserve(n);
+        min_groups_ = list_.load(std::memory_order_relaxed)->groups;
     }
-    return reinterpret_cast<LRUCache::Handle*>(e);
-}
-
-void LRUCacheImpl::Release(LRUCache::Handle* handle) {
-    MutexLock l(&mutex_);
-    Unref(reinterpret_cast<LRUHandle*>(handle));
-}
-
-LRUCache::Handle* LRUCacheImpl::Insert(
-    const char* key, uint32_t hash, void* value, size_t charge,
-    void (*deleter)(const char* key, void* value)
-) {
-    MutexLock l(&mutex_);
-    
-    int keyLen = strlen(key);
-    LRUHandle* e = reinterpret_cast<LRUHandle*>(malloc(sizeof(LRUHandle) + keyLen));
-    e->value = value;
-    e->deleter = deleter;
-    e->charge = charge;
-    e->key_length = keyLen;
-    e->hash = hash;
-    e->refs = 2;  // One from LRUCache, one for the returned handle
-    strcpy(e->key_data, key);
-    LRU_Append(e);
-    usage_ += charge;
     
-    LRUHandle* old = table_.Insert(e);
-    if (old != NULL) {
-        LRU_Remove(old);
-        Unref(old);
+    LRUHandle* Remove(const char* key, size_t key_len, uint64_t hash) {
+        MigrateSome();
+        Array* lists[2];
+        lists[0] = list_.load(std::memory_order_relaxed);
+        lists[1] = old_list_.load(std::memory_order_relaxed);
+        for (int i = 0; i < 2 && lists[i] != NULL; i++) {
+            LRUHandle* result;
+            const uint32_t slot = FindSlot(lists[i], key, key_len, hash, &result);
+            if (slot == kNotFound) {
+                continue;
+            }
+            Clear(lists[i], slot);
+            --elems_;
+            // Same hysteresis as HandleTable: shrink well below the
+            // growth threshold.
+            if (lists[1] == NULL && lists[0]->groups > min_groups_ && elems_ < MaxLoad(lists[0]->groups) / 8) {
+                StartResize(GroupsFor(elems_));
+            }
+            return result;
+        }
+        return NULL;
     }
     
-    while (usage_ > capacity_ && lru_.next != &lru_) {
-        LRUHandle* old = lru_.next;
-        LRU_Remove(old);
-        table_.Remove(old->key(), old->hash);
-        Unref(old);
+private:
+    static const uint32_t kGroupWidth = 8;
+    static const uint32_t kNotFound = UINT32_MAX;
+    
+    // Least old groups moved per Insert() or Remove().
+    static const uint32_t kMigrateGroups = 2;
+    
+    // Control bytes.  Full slots hold the low seven bits of the hash.
+    static const uint8_t kEmpty = 0x80;
+    static const uint8_t kDeleted = 0xfe;
+    static const uint64_t kLsbs = 0x0101010101010101ULL;
+    static const uint64_t kMsbs = 0x8080808080808080ULL;
+    
+    // A power-of-two number of groups.  "used" counts full and deleted
+    // slots, which both lengthen probe sequences.
+    struct Array {
+        uint32_t groups;
+        uint32_t used;
+        std::atomic<uint64_t>* ctrl;
+        std::atomic<LRUHandle*>* slots;
+    };
+    
+    uint32_t elems_;
+    std::atomic<Array*> list_;
+    
+    // Array being migrated into list_, or NULL.  Its groups below
+    // migrate_pos_ only hold deleted slots.
+    std::atomic<Array*> old_list_;
+    uint32_t migrate_pos_;
+    uint32_t migrate_step_;     // Old groups moved per Insert() or Remove()
+    uint32_t deferred_groups_;  // Size a Reserve() asked for mid-migration, or 0
+    
+    EpochReclaimer* reclaimer_;
+    
+    // Odd while a migration step moves entries between the arrays.
+    std::atomic<uint32_t> seq_;
+    
+    uint64_t resizes_;
+    uint32_t min_groups_;
+    
+    // Probing gets slow near full; keep at least one slot in eight free.
+    static uint32_t MaxLoad(uint32_t groups) {
+        return groups * (kGroupWidth - 1);
     }
     
-    return reinterpret_cast<LRUCache::Handle*>(e);
-}
-
-void LRUCacheImpl::Erase(const char* key, uint32_t hash) {
-    MutexLock l(&mutex_);
-    LRUHandle* e = table_.Remove(key, hash);
-    if (e != NULL) {
-        LRU_Remove(e);
-        Unref(e);
+    // Groups for "n" entries at about half the maximum load.
+    static uint32_t GroupsFor(uint32_t n) {
+        uint32_t groups = 1;
+        while (MaxLoad(groups) < 2 * n) {
+            groups *= 2;
+        }
+        return groups;
     }
-}
-
-static const int kNumShardBits = 4;
-static const int kNumShards = 1 << kNumShardBits;
-
-class ShardedLRUCache: public LRUCache {
-private:
-    LRUCacheImpl shard_[kNumShards];
-    std::mutex id_mutex_;
-    uint64_t last_id_;
     
-    static inline uint32_t HashSlice(const char* s) {        
-        return Hash(s, strlen(s), 0);
+    // Bit 7 of each byte of the result is set where the byte equals "b".
+    // May report false positives next to a true match, which the callers
+    // weed out by comparing keys.
+    static uint64_t MatchByte(uint64_t word, uint64_t b) {
+        const uint64_t x = word ^ (kLsbs * b);
+        return (x - kLsbs) & ~x & kMsbs;
+    }
+    static uint64_t MatchEmpty(uint64_t word) {
+        // kEmpty is the only marker with bit 1 clear.
+        return word & ~(word << 6) & kMsbs;
+    }
+    static uint64_t MatchEmptyOrDeleted(uint64_t word) {
+        return word & kMsbs;
     }
     
-    static uint32_t Shard(uint32_t hash) {
-        return hash >> (32 - kNumShardBits);
+    // The tag and the group come from the low bits of the hash, well
+    // clear of the high ones Shard() picks the shard by.
+    static uint32_t StartGroup(const Array* a, uint64_t hash) {
+        return static_cast<uint32_t>(hash >> 7) & (a->groups - 1);
+    }
+    static uint64_t Tag(uint64_t hash) {
+        return hash & 0x7f;
     }
     
-public:
-    explicit ShardedLRUCache(size_t capacity): last_id_(0) {
-        const size_t per_shard = (capacity + (kNumShards - 1)) / kNumShards;
-        for (int s = 0; s < kNumShards; s++) {
-            shard_[s].SetCapacity(per_shard);
+    // Returns the slot holding "key" and stores its handle in *e, or
+    // returns kNotFound.
+    static uint32_t FindSlot(const Array* a, const char* key, size_t key_len, uint64_t hash,
+                             LRUHandle** e) {
+        const uint32_t mask = a->groups - 1;
+        uint32_t g = StartGroup(a, hash);
+        for (uint32_t step = 1; step <= a->groups; step++) {
+            const uint64_t word = a->ctrl[g].load(std::memory_order_acquire);
+            for (uint64_t m = MatchByte(word, Tag(hash)); m != 0; m &= m - 1) {
+                const uint32_t slot = g * kGroupWidth + (CountTrailingZeros64(m) >> 3);
+                LRUHandle* h = a->slots[slot].load(std::memory_order_acquire);
+                if (h != NULL && h->Matches(key, key_len, hash)) {
+                    *e = h;
+                    return slot;
+                }
+            }
+            if (MatchEmpty(word) != 0) {
+                break;
+            }
+            // Triangular probing visits every group of a power-of-two table.
+            g = (g + step) & mask;
         }
+        return kNotFound;
     }
-    virtual ~ShardedLRUCache() { }
     
-    virtual void Delete() {
-        delete this;
+    static void SetCtrl(Array* a, uint32_t slot, uint64_t b) {
+        std::atomic<uint64_t>* word = &a->ctrl[slot / kGroupWidth];
+        const int shift = (slot % kGroupWidth) * 8;
+        uint64_t w = word->load(std::memory_order_relaxed);
+        w = (w & ~(uint64_t(0xff) << shift)) | (b << shift);
+        word->store(w, std::memory_order_release);
     }
     
-    virtual Handle* Insert(
-        const char* key, void* value, size_t charge,
-        void (*deleter)(const char* key, void* value)
-    ) {
-        const uint32_t hash = HashSlice(key);
-        return shard_[Shard(hash)].Insert(key, hash, value, charge, deleter);
+    // Put "h", whose key is not in "a", into the first free slot of its
+    // probe sequence.  The handle is published before its tag.
+    static void Place(Array* a, LRUHandle* h) {
+        const uint32_t mask = a->groups - 1;
+        uint32_t g = StartGroup(a, h->hash);
+        for (uint32_t step = 1; ; step++) {
+            const uint64_t word = a->ctrl[g].load(std::memory_order_relaxed);
+            const uint64_t m = MatchEmptyOrDeleted(word);
+            if (m != 0) {
+                const int byte = CountTrailingZeros64(m) >> 3;
+                const uint32_t slot = g * kGroupWidth + byte;
+                if (((word >> (byte * 8)) & 0xff) == kEmpty) {
+                    a->used++;
+                }
+                a->slots[slot].store(h, std::memory_order_release);
+                SetCtrl(a, slot, Tag(h->hash));
+                return;
+            }
+            assert(step <= a->groups);
+            g = (g + step) & mask;
+        }
     }
-    virtual Handle* Lookup(const char* key) {
-        const uint32_t hash = HashSlice(key);
-        return shard_[Shard(hash)].Lookup(key, hash);
+    
+    // The tag goes first, so that a reader that still sees it may find a
+    // NULL slot but never a handle the writer considers gone.
+    static void Clear(Array* a, uint32_t slot) {
+        SetCtrl(a, slot, kDeleted);
+        a->slots[slot].store(NULL, std::memory_order_relaxed);
     }
-    virtual void Release(Handle* handle) {
-        LRUHandle* h = reinterpret_cast<LRUHandle*>(handle);
-        shard_[Shard(h->hash)].Release(handle);
+    
+    static Array* NewArray(uint32_t groups) {
+        const size_t bytes = sizeof(Array) + groups * sizeof(std::atomic<uint64_t>) +
+                             groups * kGroupWidth * sizeof(std::atomic<LRUHandle*>);
+        char* mem = reinterpret_cast<char*>(malloc(bytes));
+        Array* a = reinterpret_cast<Array*>(mem);
+        a->groups = groups;
+        a->used = 0;
+        a->ctrl = reinterpret_cast<std::atomic<uint64_t>*>(mem + sizeof(Array));
+        a->slots = reinterpret_cast<std::atomic<LRUHandle*>*>(a->ctrl + groups);
+        for (uint32_t g = 0; g < groups; g++) {
+            new (&a->ctrl[g]) std::atomic<uint64_t>(kEmpty * kLsbs);
+        }
+        for (uint32_t i = 0; i < groups * kGroupWidth; i++) {
+            new (&a->slots[i]) std::atomic<LRUHandle*>(NULL);
+        }
+        return a;
+    }
+    
+    static void FreeArray(void* /*arg*/, void* a) {
+        free(a);
+    }
+    
+    // Moving migrate_step_ groups per call ends each migration before
+    // list_ fills: a call adds at most one slot to list_ besides the
+    // entries it moves, so the step is set for the calls to run out of
+    // old groups before they run out of the room left for new entries.
+    // A resize can then only be asked for by Reserve() while a migration
+    // is in progress, and it waits for the migration to end.
+    void StartResize(uint32_t groups) {
+        if (old_list_.load(std::memory_order_relaxed) != NULL) {
+            deferred_groups_ = std::max(deferred_groups_, groups);
+            return;
+        }
+        ++resizes_;
+        Array* old_list = list_.load(std::memory_order_relaxed);
+        assert(MaxLoad(groups) > elems_);
+        const uint32_t room = MaxLoad(groups) - elems_;
+        const uint32_t step = (old_list->groups + room - 1) / room;
+        migrate_step_ = step > kMigrateGroups ? step : kMigrateGroups;
+        migrate_pos_ = 0;
+        old_list_.store(old_list, std::memory_order_release);
+        list_.store(NewArray(groups), std::memory_order_release);
+    }
+    
+    void MigrateSome() {
+        Array* old_list = old_list_.load(std::memory_order_relaxed);
+        if (old_list == NULL) {
+            return;
+        }
+        Array* new_list = list_.load(std::memory_order_relaxed);
+        
+        const uint32_t seq = seq_.load(std::memory_order_relaxed);
+        seq_.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (uint32_t count = migrate_step_; count > 0 && migrate_pos_ < old_list->groups;
+             count--, migrate_pos_++) {
+            const uint64_t word = old_list->ctrl[migrate_pos_].load(std::memory_order_relaxed);
+            for (uint32_t i = 0; i < kGroupWidth; i++) {
+                const uint32_t slot = migrate_pos_ * kGroupWidth + i;
+                if (((word >> (i * 8)) & 0x80) == 0) {
+                    Place(new_list, old_list->slots[slot].load(std::memory_order_relaxed));
+                    Clear(old_list, slot);
+                }
+            }
+        }
+        seq_.store(seq + 2, std::memory_order_release);
+        
+        if (migrate_pos_ < old_list->groups) {
+            return;
+        }
+        old_list_.store(NULL, std::memory_order_release);
+        if (reclaimer_ != NULL) {
+            reclaimer_->Retire(old_list, &FreeArray, NULL);
+        } else {
+            free(old_list);
+        }
+        if (deferred_groups_ != 0) {
+            const uint32_t groups = deferred_groups_;
+            deferred_groups_ = 0;
+            if (groups > new_list->groups) {
+                StartResize(groups);
+            }
+        }
+    }
+};
+
+// The shard's index: the chained HandleTable by default, or the
+// FlatHandleTable.  Chosen once per cache, so the branch is perfectly
+// predictable.
+class HandleIndex {
+public:
+    HandleIndex(): flat_(false), ready_(false) { }
+    ~HandleIndex() {
+        if (!ready_) {
+            return;
+        }
+        if (flat_) {
+            flat_table_.~FlatHandleTable();
+        } else {
+            chained_.~HandleTable();
+        }
+    }
+    
+    // Construct the table to use.  Must be called once, before any other
+    // method.
+    void Init(bool open_addressing) {
+        assert(!ready_);
+        flat_ = open_addressing;
+        ready_ = true;
+        if (flat_) {
+            new (&flat_table_) FlatHandleTable;
+        } else {
+            new (&chained_) HandleTable;
+        }
+    }
+    
+    void SetReclaimer(EpochReclaimer* reclaimer) {
+        if (flat_) {
+            flat_table_.SetReclaimer(reclaimer);
+        } else {
+            chained_.SetReclaimer(reclaimer);
+        }
+    }
+    
+    uint32_t Size() const {
+        return flat_ ? flat_table_.Size() : chained_.Size();
+    }
+    uint32_t Slots() const {
+        return flat_ ? flat_table_.Slots() : chained_.Slots();
+    }
+    uint64_t Resizes() const {
+        return flat_ ? flat_table_.Resizes() : chained_.Resizes();
+    }
+    void Prefetch(uint64_t hash) const {
+        if (flat_) {
+            flat_table_.Prefetch(hash);
+        } else {
+            chained_.Prefetch(hash);
+        }
+    }
+    LRUHandle* Lookup(const char* key, size_t key_len, uint64_t hash) {
+        return flat_ ? flat_table_.Lookup(key, key_len, hash) : chained_.Lookup(key, key_len, hash);
+    }
+    bool LookupLockFree(const char* key, size_t key_len, uint64_t hash, LRUHandle** result) {
+        return flat_ ? flat_table_.LookupLockFree(key, key_len, hash, result)
+                     : chained_.LookupLockFree(key, key_len, hash, result);
+    }
+    LRUHandle* Insert(LRUHandle* h) {
+        return flat_ ? flat_table_.Insert(h) : chained_.Insert(h);
+    }
+    void Reserve(uint32_t n) {
+        if (flat_) {
+            flat_table_.Reserve(n);
+        } else {
+            chained_.Reserve(n);
+        }
+    }
+    void SetMinSize(uint32_t n) {
+        if (flat_) {
+            flat_table_.SetMinSize(n);
+        } else {
+            chained_.SetMinSize(n);
+        }
+    }
+    LRUHandle* Remove(const char* key, size_t key_len, uint64_t hash) {
+        return flat_ ? flat_table_.Remove(key, key_len, hash) : chained_.Remove(key, key_len, hash);
+    }
+    
+private:
+    bool flat_;
+    bool ready_;
+    union {                 // Only the one flat_ selects is constructed
+        HandleTable chained_;
+        FlatHandleTable flat_table_;
+    };
+};
+
+// Size-class allocator for the LRUHandles of one shard.  Handles are
+// carved out of chunks that are only returned to the system with the
+// shard, and freed handles are recycled through per-class free lists,
+// so a steady stream of inserts and evictions never reaches malloc.
+// Handles too large for any class fall through to malloc.
+//
+// Not thread-safe; the shard mutex protects it.
+class HandleSlab {
+public:
+    // Classes are 64 byte steps from 128 to 512 bytes, which covers keys
+    // up to a few hundred bytes and keeps objects cache-line sized.
+    static const int kNumClasses = 7;
+    
+    HandleSlab() : bytes_(0) {
+        for (int i = 0; i < kNumClasses; i++) {
+            free_[i] = NULL;
+            next_[i] = NULL;
+            limit_[i] = NULL;
+            chunk_objects_[i] = kMinChunkObjects;
+        }
+    }
+    ~HandleSlab() {
+        for (size_t i = 0; i < chunks_.size(); i++) {
+            free(chunks_[i].base);
+        }
+    }
+    
+    // Bytes of chunks held, in use or free.
+    size_t Bytes() const { return bytes_; }
+    
+    void* Allocate(size_t size) {
+        const int c = SizeClass(size);
+        if (c >= kNumClasses) {
+            return malloc(size);
+        }
+        if (free_[c] != NULL) {
+            FreeObject* obj = free_[c];
+            free_[c] = obj->next;
+            return obj;
+        }
+        if (next_[c] == limit_[c]) {
+            NewChunk(c);
+        }
+        void* result = next_[c];
+        next_[c] += ClassSize(c);
+        return result;
+    }
+    
+    void Deallocate(void* ptr, size_t size) {
+        const int c = SizeClass(size);
+        if (c >= kNumClasses) {
+            free(ptr);
+            return;
+        }
+        FreeObject* obj = reinterpret_cast<FreeObject*>(ptr);
+        obj->next = free_[c];
+        free_[c] = obj;
+    }
+    
+    // Free the chunks of class "c" none of whose objects are in use, and
+    // drop their objects from the free list.  Takes time linear in the
+    // class's free objects, so it is for after a shrink, not for every
+    // Deallocate().
+    void Trim(int c) {
+        std::vector<Chunk*> chunks;
+        for (size_t i = 0; i < chunks_.size(); i++) {
+            if (chunks_[i].c == c) {
+                chunks.push_back(&chunks_[i]);
+            }
+        }
+        std::sort(chunks.begin(), chunks.end(), [](const Chunk* a, const Chunk* b) { return a->base < b->base; });
+        
+        // Count free objects per chunk.  The unused tail of the newest
+        // chunk is free too.
+        for (size_t i = 0; i < chunks.size(); i++) {
+            chunks[i]->free = 0;
+        }
+        Chunk* newest = NULL;
+        if (next_[c] != limit_[c]) {
+            newest = FindChunk(chunks, next_[c]);
+            newest->free += (limit_[c] - next_[c]) / ClassSize(c);
+        }
+        for (FreeObject* obj = free_[c]; obj != NULL; obj = obj->next) {
+            FindChunk(chunks, obj)->free++;
+        }
+        
+        size_t released = 0;
+        for (size_t i = 0; i < chunks.size(); i++) {
+            if (chunks[i]->free == chunks[i]->bytes / ClassSize(c)) {
+                chunks[i]->free = kReleased;
+                released++;
+            }
+        }
+        if (released == 0) {
+            return;
+        }
+        FreeObject** ptr = &free_[c];
+        while (*ptr != NULL) {
+            if (FindChunk(chunks, *ptr)->free == kReleased) {
+                *ptr = (*ptr)->next;
+            } else {
+                ptr = &(*ptr)->next;
+            }
+        }
+        if (newest != NULL && newest->free == kReleased) {
+            next_[c] = limit_[c] = NULL;
+        }
+        size_t n = 0;
+        for (size_t i = 0; i < chunks_.size(); i++) {
+            if (chunks_[i].c == c && chunks_[i].free == kReleased) {
+                free(chunks_[i].base);
+                bytes_ -= chunks_[i].bytes;
+            } else {
+                chunks_[n++] = chunks_[i];
+            }
+        }
+        chunks_.resize(n);
+    }
+    
+private:
+    static const size_t kClassStep = 64;
+    static const size_t kMinChunkObjects = 4;
+    static const size_t kMaxChunkObjects = 256;
+    
+    struct FreeObject {
+        FreeObject* next;
+    };
+    
+    struct Chunk {
+        char* base;
+        size_t bytes;
+        size_t free;    // Free objects, only counted by Trim()
+        int c;
+    };
+    static const size_t kReleased = SIZE_MAX;
+    
+    // The chunk of "chunks", sorted by address, that holds "p".
+    static Chunk* FindChunk(const std::vector<Chunk*>& chunks, const void* p) {
+        const char* ptr = reinterpret_cast<const char*>(p);
+        std::vector<Chunk*>::const_iterator it = std::upper_bound(
+            chunks.begin(), chunks.end(), ptr, [](const char* q, const Chunk* chunk) { return q < chunk->base; });
+        assert(it != chunks.begin());
+        Chunk* chunk = *(it - 1);
+        assert(ptr < chunk->base + chunk->bytes);
+        return chunk;
+    }
+    
+    static int SizeClass(size_t size) {
+        const size_t steps = (size - 1) / kClassStep;
+        return steps < 2 ? 0 : static_cast<int>(steps - 1);
+    }
+    static size_t ClassSize(int c) {
+        return (c + 2) * kClassStep;
+    }
+    
+    // Chunks start small so that many-shard caches stay cheap, and
+    // double per class up to kMaxChunkObjects.
+    void NewChunk(int c) {
+        const size_t bytes = ClassSize(c) * chunk_objects_[c];
+        Chunk chunk;
+        chunk.base = reinterpret_cast<char*>(malloc(bytes));
+        chunk.bytes = bytes;
+        chunk.free = 0;
+        chunk.c = c;
+        chunks_.push_back(chunk);
+        bytes_ += bytes;
+        next_[c] = chunk.base;
+        limit_[c] = chunk.base + bytes;
+        if (chunk_objects_[c] < kMaxChunkObjects) {
+            chunk_objects_[c] *= 2;
+        }
+    }
+    
+    FreeObject* free_[kNumClasses];
+    char* next_[kNumClasses];       // Unused tail of the newest chunk
+    char* limit_[kNumClasses];
+    size_t chunk_objects_[kNumClasses];
+    std::vector<Chunk> chunks_;
+    size_t bytes_;
+};
+
+// The capacity shared by all shards of a cache created with
+// LRUCacheOptions::global_capacity.  Each shard reserves usage from
+// "reserved" in chunks of "slack", so that most inserts and frees do not
+// touch it.
+struct GlobalBudget {
+    std::atomic<size_t> capacity;
+    std::atomic<size_t> slack;
+    std::atomic<size_t> reserved;
+    
+    // Counts inserts.  Entries are stamped with it when they become the
+    // newest of their list, giving an LRU order comparable across shards.
+    std::atomic<uint32_t> clock;
+    
+    GlobalBudget(): capacity(0), slack(0), reserved(0), clock(0) { }
+    
+    // Reservations may run past capacity by the shards' slack.
+    bool Over(size_t num_shards) const {
+        return reserved.load(std::memory_order_relaxed) >
+            capacity.load(std::memory_order_relaxed) + slack.load(std::memory_order_relaxed) * num_shards;
+    }
+};
+
+// Recent access frequencies for LRUCacheOptions::admission_filter, after
+// TinyLFU.  A count-min sketch keeps sixteen 4-bit counters per word,
+// and a key counts in one counter of each of four words; Estimate() is
+// the smallest of them.  The first sighting of a key only sets its bits
+// in the doorkeeper, a small Bloom filter, so that keys seen once do not
+// take counters from the rest.  After ten sightings per counted key,
+// the counters are halved and the doorkeeper cleared, so that old
+// popularity fades.
+class FrequencySketch {
+public:
+    FrequencySketch(): mask_(0), additions_(0), period_(0) { }
+    
+    // Size the sketch for about "n" distinct keys.  A key's words and
+    // bits are picked by the low bits of its hashes, so growing copies
+    // them into each new half and keeps every count.
+    void EnsureCapacity(size_t n) {
+        if (!table_.empty() && n <= table_.size()) {
+            return;
+        }
+        size_t words = 64;
+        while (words < n) {
+            words *= 2;
+        }
+        Grow(&table_, words);
+        Grow(&doorkeeper_, words / 8);  // Eight bits per key
+        mask_ = words - 1;
+        period_ = 10 * words;
+    }
+    
+    void Increment(uint64_t hash) {
+        const uint64_t h = Spread(hash);
+        if (Doorkeep(h)) {
+            const uint32_t start = (h & 3) << 2;
+            for (uint32_t i = 0; i < 4; i++) {
+                uint64_t& word = table_[Index(h, i)];
+                const uint32_t shift = (start + i) << 2;
+                if (((word >> shift) & 0xf) != 0xf) {
+                    word += uint64_t(1) << shift;
+                }
+            }
+        }
+        if (++additions_ >= period_) {
+            Age();
+        }
+    }
+    
+    uint32_t Estimate(uint64_t hash) const {
+        const uint64_t h = Spread(hash);
+        const uint32_t start = (h & 3) << 2;
+        uint32_t count = 0xf;
+        for (uint32_t i = 0; i < 4; i++) {
+            const uint32_t c = (table_[Index(h, i)] >> ((start + i) << 2)) & 0xf;
+            count = std::min(count, c);
+        }
+        return count + (InDoorkeeper(h) ? 1 : 0);
+    }
+    
+private:
+    // The shard hash has its top bits fixed by the shard, and its low
+    // bits already pick the bucket, so mix it before splitting it up.
+    static uint64_t Spread(uint64_t hash) {
+        uint64_t h = (hash + kPrime5) * kPrime2;
+        h ^= h >> 29;
+        h *= kPrime3;
+        return h ^ (h >> 32);
+    }
+    
+    size_t Index(uint64_t h, uint32_t i) const {
+        static const uint64_t kSeeds[4] = { kPrime1, kPrime2, kPrime3, kPrime4 };
+        uint64_t x = (h + kSeeds[i]) * kSeeds[i];
+        x += x >> 32;
+        return static_cast<size_t>(x) & mask_;
+    }
+    
+    // The doorkeeper bits of h.
+    void DoorkeeperBits(uint64_t h, size_t* b1, size_t* b2) const {
+        const size_t bits_mask = doorkeeper_.size() * 64 - 1;
+        *b1 = static_cast<size_t>(h) & bits_mask;
+        *b2 = static_cast<size_t>(h >> 40 | h << 24) & bits_mask;
+    }
+    bool InDoorkeeper(uint64_t h) const {
+        size_t b1, b2;
+        DoorkeeperBits(h, &b1, &b2);
+        return (doorkeeper_[b1 / 64] >> (b1 % 64) & 1) && (doorkeeper_[b2 / 64] >> (b2 % 64) & 1);
+    }
+    
+    // Returns true if h was already in the doorkeeper; adds it if not.
+    bool Doorkeep(uint64_t h) {
+        if (InDoorkeeper(h)) {
+            return true;
+        }
+        size_t b1, b2;
+        DoorkeeperBits(h, &b1, &b2);
+        doorkeeper_[b1 / 64] |= uint64_t(1) << (b1 % 64);
+        doorkeeper_[b2 / 64] |= uint64_t(1) << (b2 % 64);
+        return false;
+    }
+    
+    static void Grow(std::vector<uint64_t>* v, size_t size) {
+        const size_t old = v->size();
+        v->resize(size);
+        for (size_t i = old; i < size; i++) {
+            (*v)[i] = (old == 0) ? 0 : (*v)[i % old];
+        }
+    }
+    
+    void Age() {
+        for (size_t i = 0; i < table_.size(); i++) {
+            table_[i] = (table_[i] >> 1) & 0x7777777777777777ULL;
+        }
+        std::fill(doorkeeper_.begin(), doorkeeper_.end(), 0);
+        additions_ /= 2;
+    }
+    
+    std::vector<uint64_t> table_;
+    std::vector<uint64_t> doorkeeper_;
+    size_t mask_;
+    size_t additions_;
+    size_t period_;     // Additions between agings
+};
+
+// Each shard's timer wheel has kWheelSlots slots of kWheelTickMillis,
+// so that an entry with a TTL longer than a rotation (about 16 seconds)
+// is passed over once per rotation until it expires.
+static const uint64_t kWheelSlots = 1024;
+static const uint64_t kWheelTickMillis = 16;
+
+// Expired entries reaped by each Insert() before it inserts.
+static const uint32_t kInsertReapBatch = 4;
+
+// With a serializer, the byte that ends each copy in the secondary cache.
+static const char kPlainCopy = 0;       // Inline value bytes
+static const char kSerializedCopy = 1;  // LRUCacheSerializer::Serialize() output
+
+// A copy taken from the secondary cache, ready for NewHandle(): inline
+// value bytes, or a value the serializer rebuilt, with its deleter.
+struct SecondaryCopy {
+    std::string bytes;
+    const void* value;
+    size_t value_size;      // 0 for a rebuilt value
+    size_t charge;
+    void (*deleter)(const char* key, void* value);
+};
+
+// A LookupOrComputeAsync() caller waiting on a load.
+struct LoadCallback {
+    void (*done)(LRUCache::Handle* handle, void* arg);
+    void* arg;
+};
+
+// A load started by LookupOrCompute() or LookupOrComputeAsync() on a
+// miss.  Other callers missing on the same key wait for it instead of
+// loading the key again: blocking callers on "cv", asynchronous ones by
+// leaving a callback.  The caller that starts it first moves the key's
+// copy back from the secondary cache, if there is one, and only loads
+// the key on a miss there.  A Lookup() moving a copy back registers one
+// too, only so that it is marked stale; nobody waits on it.
+struct PendingLoad {
+    std::string key;
+    uint64_t hash;
+    void (*deleter)(const char* key, void* value);
+    LRUCache::Priority priority;
+    PendingLoad* next;      // Shard's list of loads in progress
+    uint32_t replica;       // Index of the NUMA replica that owns the load
+    int waiters;            // Blocking waiters, guarded by the shard mutex
+    std::vector<LoadCallback> callbacks;  // Guarded by the shard mutex
+    bool stale;             // Key erased or inserted since, guarded by the shard mutex
+    bool promotion;         // From the secondary cache; not joined by other callers
+    std::atomic<int> refs;  // The loader's and each blocking waiter's
+    
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done;              // Guarded by mutex
+    LRUHandle* result;      // Holds a reference for each waiter
+    
+    PendingLoad(
+        const char* k, size_t key_len, uint64_t h,
+        void (*d)(const char* key, void* value), LRUCache::Priority p
+    ) : key(k, key_len), hash(h), deleter(d), priority(p), next(NULL), replica(0), waiters(0), stale(false),
+        promotion(false), refs(1), done(false), result(NULL) { }
+    
+    bool Matches(const char* k, size_t key_len, uint64_t h) const {
+        return hash == h && key.size() == key_len && memcmp(key.data(), k, key_len) == 0;
+    }
+    
+    void Finish(LRUHandle* e) {
+        {
+            MutexLock l(&mutex);
+            result = e;
+            done = true;
+        }
+        cv.notify_all();
+    }
+    LRUHandle* Wait() {
+        std::unique_lock<std::mutex> l(mutex);
+        cv.wait(l, [this] { return done; });
+        return result;
+    }
+    
+    void Unref() {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+};
+
+// Snapshot files, written by LRUCache::SaveSnapshot(), are a header and
+// then one record per entry, each shard's from its coldest to its
+// hottest.  Fields are in host byte order.
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t unused;
+    uint64_t entries;
+};
+
+static const char kSnapshotMagic[8] = { 'L', 'R', 'U', 'S', 'N', 'A', 'P', '\0' };
+static const uint32_t kSnapshotVersion = 1;
+
+// A record is followed by the key, then the inline value if value_size is
+// not 0, padded so that the next record is 8-byte aligned.
+struct SnapshotRecord {
+    uint32_t key_len;
+    uint32_t value_size;
+    uint64_t charge;
+    uint64_t ttl_millis;    // Left when saved, or 0 for none
+    
+    const char* key() const { return reinterpret_cast<const char*>(this + 1); }
+    const char* value() const { return key() + key_len; }
+    
+    static size_t Size(size_t key_len, size_t value_size) {
+        return (sizeof(SnapshotRecord) + key_len + value_size + 7) & ~size_t(7);
+    }
+};
+
+// Entries a snapshot load inserts per acquisition of a shard mutex.
+static const size_t kLoadBatch = 1024;
+
+// The contents of a file, mapped read-only where mmap() is available and
+// read into memory otherwise.
+class MappedFile {
+public:
+    MappedFile(): data_(NULL), size_(0) { }
+    ~MappedFile() {
+#ifdef LRU_CACHE_HAVE_POSIX
+        if (data_ != NULL) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+#endif
+    }
+    
+    bool Open(const char* path) {
+#ifdef LRU_CACHE_HAVE_POSIX
+        const int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0 && st.st_size > 0;
+        if (ok) {
+            void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = (p != MAP_FAILED);
+            if (ok) {
+                data_ = static_cast<const char*>(p);
+                size_ = st.st_size;
+                // The file is read once, front to back.
+                madvise(p, size_, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+        return ok;
+#else
+        FILE* f = fopen(path, "rb");
+        if (f == NULL) {
+            return false;
+        }
+        char buf[1 << 16];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            contents_.append(buf, n);
+        }
+        const bool ok = !ferror(f);
+        fclose(f);
+        data_ = contents_.data();
+        size_ = contents_.size();
+        return ok;
+#endif
+    }
+    
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    
+private:
+    const char* data_;
+    size_t size_;
+#ifndef LRU_CACHE_HAVE_POSIX
+    std::string contents_;
+#endif
+    
+    // No copying allowed
+    MappedFile(const MappedFile&);
+    void operator=(const MappedFile&);
+};
+
+#ifdef LRU_CACHE_HAVE_POSIX
+// An LRUSecondaryCache kept in a file used as a circular log of
+// kLogSegmentSize segments, in the SnapshotRecord format.  Insert() and
+// Erase() only push their record onto a lock-free stack, so that spilling
+// shards never wait on each other or on the device.  A background thread
+// appends the records to the newest segment in memory, writes full
+// segments with one large write each, and forgets what a reused segment
+// held.  Only that thread applies the stack to the index.  Take() holds
+// the mutex shared and looks for the key on the stack before the index,
+// so lookups neither wait on each other nor on applying the stack, and
+// still see every Insert() and Erase() that returned before them.  A
+// copy taken is only flagged, and leaves the index when the stack is
+// next applied or its segment is reused.  The index is a flat table of
+// 24-byte slots keyed by the key's 64-bit hash, between 7/16 and 7/8
+// full, so 28 to 55 bytes per copy; keys are compared once the record is
+// read.
+class LogSecondaryCache: public LRUSecondaryCache {
+public:
+    static const size_t kLogSegmentSize = 1 << 20;
+    
+    // Full segments that may wait for the writer.  Records beyond that
+    // are dropped rather than queued.
+    static const size_t kMaxQueuedSegments = 2;
+    static const size_t kMinSegments = kMaxQueuedSegments + 2;
+    
+    // Bytes of records that may wait on the stack.  Inserts beyond that
+    // are dropped, along with any older copy of the key.
+    static const size_t kMaxStagedBytes = kLogSegmentSize;
+    
+    // Index entries of a reused segment forgotten per acquisition of the
+    // mutex.
+    static const size_t kForgetBatch = 1024;
+    
+    LogSecondaryCache(int fd, size_t segments)
+        : fd_(fd), segments_(segments), staged_(NULL), staged_bytes_(0), active_slot_(0), gens_(segments, 0),
+          slot_hashes_(segments), woken_(false), stopping_(false) {
+        active_.reserve(kLogSegmentSize);
+        writer_ = std::thread(&LogSecondaryCache::WriteSegments, this);
+    }
+    virtual ~LogSecondaryCache() {
+        {
+            MutexLock l(&wake_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        writer_.join();
+        close(fd_);
+        Staged* r = staged_.load(std::memory_order_acquire);
+        while (r != NULL) {
+            Staged* next = r->next;
+            delete r;
+            r = next;
+        }
+    }
+    
+    virtual void Insert(const char* key, size_t key_len, const void* value, size_t value_size, size_t charge) {
+        const size_t size = SnapshotRecord::Size(key_len, value_size);
+        Staged* r = new Staged;
+        r->hash = LRUCache::HashKey(key, key_len);
+        if (size <= kLogSegmentSize &&
+            staged_bytes_.fetch_add(size, std::memory_order_relaxed) + size <= kMaxStagedBytes) {
+            SnapshotRecord header;
+            header.key_len = static_cast<uint32_t>(key_len);
+            header.value_size = static_cast<uint32_t>(value_size);
+            header.charge = charge;
+            header.ttl_millis = 0;
+            r->record.resize(size);
+            char* p = &r->record[0];
+            memcpy(p, &header, sizeof(header));
+            memcpy(p + sizeof(header), key, key_len);
+            memcpy(p + sizeof(header) + key_len, value, value_size);
+        } else if (size <= kLogSegmentSize) {
+            staged_bytes_.fetch_sub(size, std::memory_order_relaxed);
+        }
+        // An empty record, for a dropped copy, still forgets the older one.
+        Push(r);
+    }
+    
+    virtual bool Take(const char* key, size_t key_len, std::string* value, size_t* charge) {
+        const uint64_t hash = LRUCache::HashKey(key, key_len);
+        std::string buf;
+        std::shared_lock<std::shared_mutex> l(mutex_);
+        const Staged* staged = FindStagedLocked(hash);
+        if (staged != NULL) {
+            // The newest Insert() or Erase() of the key decides.
+            const std::string& record = staged->record;
+            if (!HoldsKey(record.data(), record.size(), key, key_len) ||
+                staged->taken.exchange(true, std::memory_order_relaxed)) {
+                return false;
+            }
+            buf = record;
+        } else {
+            const LogIndex::Slot* e = FindLocked(hash);
+            if (e == NULL || (e->size.load(std::memory_order_relaxed) & LogIndex::kTaken)) {
+                return false;
+            }
+            const Location loc = e->Get();
+            if (!CopyLocked(loc, &buf)) {
+                // Only on disk: read it without the mutex, then check that
+                // its segment was not reused and the key not written again
+                // meanwhile.
+                buf.resize(loc.size);
+                l.unlock();
+                const ssize_t n = pread(fd_, &buf[0], loc.size, loc.offset);
+                l.lock();
+                if (n != static_cast<ssize_t>(loc.size) || FindStagedLocked(hash) != NULL) {
+                    return false;
+                }
+                e = FindLocked(hash);
+                if (e == NULL || e->offset != loc.offset || e->gen != loc.gen) {
+                    return false;
+                }
+            }
+            if (!HoldsKey(buf.data(), buf.size(), key, key_len) ||
+                (e->size.fetch_or(LogIndex::kTaken, std::memory_order_relaxed) & LogIndex::kTaken)) {
+                return false;
+            }
+        }
+        l.unlock();
+        const SnapshotRecord* r = reinterpret_cast<const SnapshotRecord*>(buf.data());
+        value->assign(r->value(), r->value_size);
+        *charge = r->charge;
+        return true;
+    }
+    
+    virtual void Erase(const char* key, size_t key_len) {
+        Staged* r = new Staged;
+        r->hash = LRUCache::HashKey(key, key_len);
+        Push(r);
+    }
+    
+private:
+    struct Location {
+        uint64_t offset;
+        uint32_t size;
+        uint32_t gen;   // gens_ of the segment when written
+    };
+    
+    struct Segment {
+        size_t slot;
+        std::string data;
+    };
+    
+    // Where the copy of each key hash is: an open-addressing table probed
+    // linearly from the hash's low bits.  Remove() moves the rest of the
+    // run back rather than leave tombstones.  Changed only with mutex_
+    // held exclusively; Take() sets kTaken with it held shared.
+    class LogIndex {
+    public:
+        static const uint32_t kTaken = 1u << 31;
+        
+        struct Slot {
+            uint64_t hash;
+            uint64_t offset;
+            uint32_t gen;
+            mutable std::atomic<uint32_t> size;     // 0 if empty; or'ed with kTaken
+            
+            Location Get() const {
+                Location loc;
+                loc.offset = offset;
+                loc.size = size.load(std::memory_order_relaxed) & ~kTaken;
+                loc.gen = gen;
+                return loc;
+            }
+        };
+        
+        LogIndex() : slots_(new Slot[kMinSlots]), mask_(kMinSlots - 1), elems_(0) {
+            Clear(slots_, kMinSlots);
+        }
+        ~LogIndex() {
+            delete[] slots_;
+        }
+        
+        const Slot* Find(uint64_t hash) const {
+            for (size_t i = hash & mask_; ; i = (i + 1) & mask_) {
+                const Slot& slot = slots_[i];
+                if (slot.size.load(std::memory_order_relaxed) == 0) {
+                    return NULL;
+                }
+                if (slot.hash == hash) {
+                    return &slot;
+                }
+            }
+        }
+        
+        void Set(uint64_t hash, const Location& loc) {
+            if ((elems_ + 1) * 8 > (mask_ + 1) * 7) {
+                Grow();
+            }
+            size_t i = hash & mask_;
+            while (slots_[i].size.load(std::memory_order_relaxed) != 0 && slots_[i].hash != hash) {
+                i = (i + 1) & mask_;
+            }
+            if (slots_[i].size.load(std::memory_order_relaxed) == 0) {
+                elems_++;
+            }
+            slots_[i].hash = hash;
+            slots_[i].offset = loc.offset;
+            slots_[i].gen = loc.gen;
+            slots_[i].size.store(loc.size, std::memory_order_relaxed);
+        }
+        
+        void Remove(uint64_t hash) {
+            const Slot* found = Find(hash);
+            if (found == NULL) {
+                return;
+            }
+            size_t hole = static_cast<size_t>(found - slots_);
+            for (size_t i = (hole + 1) & mask_; slots_[i].size.load(std::memory_order_relaxed) != 0;
+                 i = (i + 1) & mask_) {
+                // Slot i moves into the hole unless its probe starts after
+                // the hole, so that it would no longer be found there.
+                const size_t home = slots_[i].hash & mask_;
+                if (((i - home) & mask_) >= ((i - hole) & mask_)) {
+                    Move(i, hole);
+                    hole = i;
+                }
+            }
+            slots_[hole].size.store(0, std::memory_order_relaxed);
+            elems_--;
+        }
+        
+    private:
+        static const size_t kMinSlots = 1024;
+        
+        static void Clear(Slot* slots, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                slots[i].size.store(0, std::memory_order_relaxed);
+            }
+        }
+        
+        void Move(size_t from, size_t to) {
+            slots_[to].hash = slots_[from].hash;
+            slots_[to].offset = slots_[from].offset;
+            slots_[to].gen = slots_[from].gen;
+            slots_[to].size.store(slots_[from].size.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        
+        void Grow() {
+            Slot* old = slots_;
+            const size_t old_size = mask_ + 1;
+            slots_ = new Slot[old_size * 2];
+            mask_ = old_size * 2 - 1;
+            Clear(slots_, old_size * 2);
+            for (size_t j = 0; j < old_size; j++) {
+                const uint32_t size = old[j].size.load(std::memory_order_relaxed);
+                if (size != 0) {
+                    size_t i = old[j].hash & mask_;
+                    while (slots_[i].size.load(std::memory_order_relaxed) != 0) {
+                        i = (i + 1) & mask_;
+                    }
+                    slots_[i].hash = old[j].hash;
+                    slots_[i].offset = old[j].offset;
+                    slots_[i].gen = old[j].gen;
+                    slots_[i].size.store(size, std::memory_order_relaxed);
+                }
+            }
+            delete[] old;
+        }
+        
+        Slot* slots_;
+        size_t mask_;
+        size_t elems_;
+        
+        // No copying allowed
+        LogIndex(const LogIndex&);
+        void operator=(const LogIndex&);
+    };
+    
+    // An Insert() or Erase() waiting for the writer.
+    struct Staged {
+        Staged* next;
+        uint64_t hash;
+        std::string record;     // Empty to forget the key's copy
+        mutable std::atomic<bool> taken;
+        
+        Staged() : taken(false) { }
+    };
+    
+    // Whether record[0,size) is a whole record for key[0,key_len).
+    static bool HoldsKey(const char* record, size_t size, const char* key, size_t key_len) {
+        if (size < sizeof(SnapshotRecord)) {
+            return false;
+        }
+        const SnapshotRecord* r = reinterpret_cast<const SnapshotRecord*>(record);
+        return r->key_len == key_len && SnapshotRecord::Size(r->key_len, r->value_size) == size &&
+               memcmp(r->key(), key, key_len) == 0;
+    }
+    
+    size_t SlotOf(uint64_t offset) const {
+        return static_cast<size_t>(offset / kLogSegmentSize);
+    }
+    
+    void Push(Staged* r) {
+        Staged* head = staged_.load(std::memory_order_relaxed);
+        do {
+            r->next = head;
+        } while (!staged_.compare_exchange_weak(head, r, std::memory_order_release, std::memory_order_relaxed));
+        if (head == NULL) {
+            Wake();
+        }
+    }
+    
+    void Wake() {
+        {
+            MutexLock l(&wake_mutex_);
+            woken_ = true;
+        }
+        wake_.notify_one();
+    }
+    
+    // Apply the staged records in the order they were pushed.  Returns
+    // whether a segment was queued for the writer.  Requires mutex_ held
+    // exclusively, i.e. by the writer.
+    bool ApplyStagedLocked() {
+        Staged* r = staged_.exchange(NULL, std::memory_order_acquire);
+        Staged* oldest = NULL;
+        while (r != NULL) {
+            Staged* next = r->next;
+            r->next = oldest;
+            oldest = r;
+            r = next;
+        }
+        bool sealed = false;
+        while (oldest != NULL) {
+            r = oldest;
+            oldest = r->next;
+            const size_t size = r->record.size();
+            if (size != 0) {
+                staged_bytes_.fetch_sub(size, std::memory_order_relaxed);
+            }
+            if (size == 0 || r->taken.load(std::memory_order_relaxed)) {
+                index_.Remove(r->hash);
+            } else {
+                if (active_.size() + size > kLogSegmentSize) {
+                    if (!SealLocked()) {
+                        index_.Remove(r->hash);
+                        delete r;
+                        continue;
+                    }
+                    sealed = true;
+                }
+                const size_t pos = active_.size();
+                active_.append(r->record);
+                Location loc;
+                loc.offset = active_slot_ * kLogSegmentSize + pos;
+                loc.size = static_cast<uint32_t>(size);
+                loc.gen = gens_[active_slot_];
+                index_.Set(r->hash, loc);
+                slot_hashes_[active_slot_].push_back(r->hash);
+            }
+            delete r;
+        }
+        return sealed;
+    }
+    
+    // Returns the newest staged record for "hash", or NULL.  Requires
+    // mutex_ held, so that the writer cannot free the records meanwhile.
+    const Staged* FindStagedLocked(uint64_t hash) const {
+        for (const Staged* r = staged_.load(std::memory_order_acquire); r != NULL; r = r->next) {
+            if (r->hash == hash) {
+                return r;
+            }
+        }
+        return NULL;
+    }
+    
+    const LogIndex::Slot* FindLocked(uint64_t hash) const {
+        const LogIndex::Slot* e = index_.Find(hash);
+        if (e == NULL || e->gen != gens_[SlotOf(e->offset)]) {
+            return NULL;
+        }
+        return e;
+    }
+    
+    // Copy the record at "loc" from a segment still in memory.
+    bool CopyLocked(const Location& loc, std::string* buf) const {
+        const size_t slot = SlotOf(loc.offset);
+        const size_t pos = loc.offset - slot * kLogSegmentSize;
+        const std::string* data = (slot == active_slot_) ? &active_ : NULL;
+        for (size_t i = 0; data == NULL && i < queue_.size(); i++) {
+            if (queue_[i].slot == slot) {
+                data = &queue_[i].data;
+            }
+        }
+        if (data == NULL) {
+            return false;
+        }
+        buf->assign(data->data() + pos, loc.size);
+        return true;
+    }
+    
+    // Queue the active segment for writing and start the next one, unless
+    // the writer is too far behind.  Bumping the reused slot's gen is all
+    // it takes to forget what it held; dropping those index entries is
+    // left to the writer.
+    bool SealLocked() {
+        if (queue_.size() >= kMaxQueuedSegments) {
+            return false;
+        }
+        queue_.push_back(Segment());
+        queue_.back().slot = active_slot_;
+        queue_.back().data.swap(active_);
+        
+        active_slot_ = (active_slot_ + 1) % segments_;
+        forget_.push_back(std::vector<uint64_t>());
+        forget_.back().swap(slot_hashes_[active_slot_]);
+        gens_[active_slot_]++;
+        active_.reserve(kLogSegmentSize);
+        return true;
+    }
+    
+    // Drop up to kForgetBatch index entries of reused segments.  Entries
+    // for copies written since are current, and are kept.
+    void ForgetLocked() {
+        for (size_t n = 0; n < kForgetBatch && !forget_.empty(); ) {
+            std::vector<uint64_t>& hashes = forget_.front();
+            while (n < kForgetBatch && !hashes.empty()) {
+                const LogIndex::Slot* e = index_.Find(hashes.back());
+                if (e != NULL && e->gen != gens_[SlotOf(e->offset)]) {
+                    index_.Remove(hashes.back());
+                }
+                hashes.pop_back();
+                n++;
+            }
+            if (hashes.empty()) {
+                forget_.pop_front();
+            }
+        }
+    }
+    
+    void WriteSegments() {
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> w(wake_mutex_);
+                wake_.wait(w, [this] { return stopping_ || woken_; });
+                if (stopping_) {
+                    return;
+                }
+                woken_ = false;
+            }
+            std::unique_lock<std::shared_mutex> l(mutex_);
+            for (;;) {
+                ApplyStagedLocked();
+                ForgetLocked();
+                if (queue_.empty()) {
+                    if (forget_.empty()) {
+                        break;
+                    }
+                    l.unlock();
+                    l.lock();
+                    continue;
+                }
+                // The segment stays queued, and readable, until it is written.
+                const Segment& segment = queue_.front();
+                l.unlock();
+                const ssize_t n = pwrite(fd_, segment.data.data(), segment.data.size(),
+                                         segment.slot * kLogSegmentSize);
+                l.lock();
+                if (n != static_cast<ssize_t>(queue_.front().data.size())) {
+                    gens_[queue_.front().slot]++;   // Forget what it held
+                }
+                queue_.pop_front();
+            }
+        }
+    }
+    
+    const int fd_;
+    const size_t segments_;
+    
+    std::atomic<Staged*> staged_;               // Newest first
+    std::atomic<size_t> staged_bytes_;          // Of the records on staged_
+    
+    // mutex_ protects the following state, and the records on staged_
+    // from being freed.  Only the writer takes it exclusively.
+    std::shared_mutex mutex_;
+    LogIndex index_;
+    std::string active_;
+    size_t active_slot_;
+    std::deque<Segment> queue_;                 // Full segments, oldest first
+    std::vector<uint32_t> gens_;                // Bumped when a slot is reused
+    std::vector<std::vector<uint64_t> > slot_hashes_;  // Keys written to each slot
+    std::deque<std::vector<uint64_t> > forget_;        // Keys of reused slots
+    
+    // wake_mutex_ protects woken_ and stopping_.
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    bool woken_;
+    bool stopping_;
+    std::thread writer_;
+};
+#endif
+
+// A single shard of sharded cache.
+// Shards are padded to whole cache lines, so that the lock-free counters
+// at the end of one shard and the mutex and settings of the next never
+// share a line.
+static const size_t kCacheLineSize = 64;
+
+class alignas(kCacheLineSize) LRUCacheImpl : public ShardPolicy<LRUCacheImpl, LRUHandle> {
+public:
+    LRUCacheImpl();
+    ~LRUCacheImpl();
+    
+    // Separate from constructor so caller can easily make an array of LRUCache
+    void SetCapacity(size_t capacity) { capacity_ = capacity; }
+    
+    // Change the capacity of a shard in use.  Evicting down to it is left
+    // to EvictExcess().
+    void Resize(size_t capacity) {
+        MutexLock l(&mutex_, lock_stats_);
+        capacity_ = capacity;
+    }
+    void SetPolicy(LRUCachePolicy policy) { policy_ = policy; }
+    void SetProtectedRatio(double ratio) { protected_ratio_ = ratio; }
+    void SetAllocator(LRUCacheAllocator* allocator) { allocator_ = allocator; }
+    void SetSecondaryCache(LRUSecondaryCache* secondary, LRUCacheSerializer* serializer) {
+        secondary_ = secondary;
+        serializer_ = serializer;
+    }
+    // Must be called first, before the shard is used.
+    void SetIndexType(LRUCacheIndexType type) { table_.Init(type == kOpenAddressingIndex); }
+    void SetExpectedEntries(size_t n) { table_.SetMinSize(static_cast<uint32_t>(std::min<size_t>(n, UINT32_MAX / 2))); }
+    void SetInstrumentLocks() { lock_stats_ = new LockStats; }
+    void SetReplica(uint32_t replica) { replica_ = replica; }
+    
+    // Admit new entries by frequency; see FrequencySketch.  The sketch
+    // starts out sized for "expected_entries", and grows with the shard.
+    // Has no effect with a global budget.
+    void SetAdmissionFilter(size_t expected_entries) {
+        admission_filter_ = true;
+        sketch_.EnsureCapacity(expected_entries);
+    }
+    
+    // Charge usage to a budget shared with "num_shards" shards instead of
+    // evicting to fit capacity.  The capacity still sizes the protected
+    // segment.
+    void SetGlobalBudget(GlobalBudget* budget, size_t num_shards) {
+        budget_ = budget;
+        num_shards_ = num_shards;
+    }
+    
+    // Serve Lookup() hits without taking the mutex.  Must be called
+    // before the shard is used.
+    void SetLockFreeLookup() {
+        lock_free_lookup_ = true;
+        table_.SetReclaimer(&reclaimer_);
+    }
+    
+    // Like Cache methods, but with an extra "hash" parameter.
+    // If value_size is not 0, the value is a copy of value[0,value_size)
+    // kept inline in the entry.  If deadline is not 0, the entry expires
+    // at that NowMillis().
+    LRUCache::Handle* Insert(
+        const char* key, size_t key_len, uint64_t hash, const void* value, size_t value_size,
+        size_t charge, void (*deleter)(const char* key, void* value), LRUCache::Priority priority,
+        uint64_t deadline
+    );
+    LRUCache::Handle* Lookup(const char* key, size_t key_len, uint64_t hash);
+    LRUCache::Handle* LookupOrCompute(
+        const char* key, size_t key_len, uint64_t hash,
+        bool (*loader)(const char* key, size_t key_len, void* arg, void** value, size_t* charge),
+        void* arg, void (*deleter)(const char* key, void* value), LRUCache::Priority priority
+    );
+    void LookupOrComputeAsync(
+        const char* key, size_t key_len, uint64_t hash,
+        void (*start)(LRUCache::Load* load, const char* key, size_t key_len, void* arg),
+        void (*done)(LRUCache::Handle* handle, void* arg), void* arg,
+        void (*deleter)(const char* key, void* value), LRUCache::Priority priority
+    );
+    
+    // Insert the result of "load", if any, and hand it to everyone
+    // waiting on the load.  If "keep" is set, returns the entry with a
+    // reference for the caller; otherwise the load's first callback gets
+    // that reference and NULL is returned.
+    LRUHandle* FinishLoad(PendingLoad* load, bool loaded, void* value, size_t charge, bool keep);
+    
+    // After a Lookup() miss, move the key's copy back from the secondary
+    // cache, if it has one, and return the key's entry.  An Erase() or
+    // Insert() of the key meanwhile wins over the copy.
+    LRUCache::Handle* PromoteSecondary(const char* key, size_t key_len, uint64_t hash);
+    void Release(LRUCache::Handle* handle);
+    void Erase(const char* key, size_t key_len, uint64_t hash);
+    
+    // Append a SnapshotRecord for each entry to *out, coldest first, and
+    // return how many were appended.
+    size_t AppendSnapshot(std::string* out);
+    
+    // Insert the snapshot records listed in order[0,n), which all map to
+    // this shard and have inline values, coldest first.  Those that the
+    // hotter ones after them would evict at once are skipped.
+    void LoadSnapshot(
+        const uint32_t* order, size_t n, const SnapshotRecord* const* records, const uint64_t* hashes,
+        void (*deleter)(const char* key, void* value)
+    );
+    
+    // Lookup() or Insert() the keys listed in order[0,n), which all map to
+    // this shard, under a single acquisition of the mutex.  Entry i's key
+    // is keys[i][0,key_lens[i]) with hash hashes[i], and its handle goes to
+    // handles[i].  MultiLookup() may reorder "order".  If handles is NULL,
+    // MultiInsert() releases the new entries itself.
+    void MultiLookup(
+        uint32_t* order, size_t n, const char* const* keys, const size_t* key_lens,
+        const uint64_t* hashes, LRUCache::Handle** handles
+    );
+    void MultiInsert(
+        const uint32_t* order, size_t n, const char* const* keys, const size_t* key_lens,
+        const uint64_t* hashes, void* const* values, const size_t* charges,
+        void (*deleter)(const char* key, void* value), LRUCache::Priority priority,
+        LRUCache::Handle** handles
+    );
+    
+    // Add this shard's counters and usage to *stats.
+    void AddStats(LRUCacheStats* stats);
+    
+    // Evict while the shard is over its capacity, or the global budget is
+    // exceeded, visiting up to "limit" entries, and return how many were
+    // visited; see EvictLocked().
+    uint32_t EvictExcess(uint32_t limit);
+    
+    // Give slab chunks that no entry uses any more back to malloc, after
+    // EvictExcess() has brought a shrunk shard down to capacity.
+    void TrimSlab();
+    
+    // With a global budget: the tick of the next eviction candidate, or
+    // kNoTail if nothing is evictable.  Read without the mutex.
+    static const uint64_t kNoTail = ~uint64_t(0);
+    uint64_t Tail() const { return tail_.load(std::memory_order_relaxed); }
+    
+    // Remove up to "limit" expired entries, and return how many were
+    // removed.
+    uint32_t ReapExpired(uint32_t limit);
+    
+private:
+    friend class ShardPolicy<LRUCacheImpl, LRUHandle>;
+    
+    // REQUIRES: inside an EpochGuard.  Same contract as
+    // HandleTable::LookupLockFree().
+    bool LookupLockFree(const char* key, size_t key_len, uint64_t hash, LRUHandle** result);
+    
+    // REQUIRES: mutex_ held.
+    LRUHandle* LookupLocked(const char* key, size_t key_len, uint64_t hash);
+    // Caches "e", from NewHandle(), and returns it with one reference for
+    // the caller.  Callers inserting a new value of the key first
+    // MarkLoadStale().
+    LRUHandle* InsertLocked(
+        LRUHandle* e, void (*deleter)(const char* key, void* value), LRUCache::Priority priority
+    );
+    
+    // Allocate an entry and fill in all but its deleter and links.
+    // REQUIRES: mutex_ held, unless allocator_ != NULL.
+    LRUHandle* NewHandle(
+        const char* key, size_t key_len, uint64_t hash, const void* value, size_t value_size,
+        size_t charge, uint64_t deadline
+    );
+    
+    // REQUIRES: mutex_ held.
+    bool Admit(const LRUHandle* e);
+    void Detach(LRUHandle* e);
+    void MarkLoadStale(const char* key, size_t key_len, uint64_t hash);
+    void WheelInsert(LRUHandle* e);
+    void WheelRemove(LRUHandle* e);
+    uint32_t ReapLocked(uint64_t now, uint32_t limit);
+    LRUHandle* JoinLoad(
+        const char* key, size_t key_len, uint64_t hash,
+        void (*deleter)(const char* key, void* value), LRUCache::Priority priority,
+        const LoadCallback* callback, PendingLoad** load, bool* started
+    );
+    bool LoadSecondary(PendingLoad* load, bool keep, LRUHandle** result);
+    LRUHandle* CompleteLoad(
+        PendingLoad* load, bool loaded, const void* value, size_t value_size, size_t charge,
+        EntryDeleter deleter, bool keep
+    );
+    
+    // ShardPolicy's hooks.
+    LRUCachePolicy policy() const { return policy_; }
+    size_t Size() const { return table_.Size(); }
+    void Stamp(LRUHandle* e) {
+        if (budget_ != NULL) {
+            e->tick = budget_->clock.load(std::memory_order_relaxed);
+        }
+    }
+    void Restamp(LRUHandle* e, const LRUHandle* oldest) { e->tick = oldest->tick; }
+    void OnSecondChance(LRUHandle* e) {
+        if (admission_filter_ && lock_free_lookup_) {
+            // Lock-free hits are only counted here.
+            sketch_.Increment(e->hash);
+        }
+    }
+    bool MarkInUse(LRUHandle* e) { return e->MarkInUse(); }
+    void ClearInUse(LRUHandle* e);
+    void EvictEntry(LRUHandle* old);
+    
+    void FinishErase(LRUHandle* e);
+    void Unref(LRUHandle* e);
+    void FreeEntry(LRUHandle* e);
+    void RunDeleters(LRUHandle* dead);
+    void Spill(const LRUHandle* e, std::string* scratch);
+    bool TakeSecondary(const char* key, size_t key_len, SecondaryCopy* copy);
+    void ReleasePendingFrees();
+    
+    void SetDeleter(LRUHandle* e, EntryDeleter deleter) {
+        e->deleter = deleter;
+    }
+    EntryDeleter Deleter(const LRUHandle* e) const {
+        return e->deleter;
+    }
+    
+    // REQUIRES: mutex_ held.
+    LRUHandle* TakeDead() {
+        LRUHandle* dead = dead_;
+        dead_ = NULL;
+        return dead;
+    }
+    
+    size_t ProtectedCapacity() const {
+        return static_cast<size_t>(capacity_ * protected_ratio_);
+    }
+    
+    // REQUIRES: mutex_ held.
+    bool Overfull() const {
+        return budget_ != NULL ? budget_->Over(num_shards_) : usage_ > capacity_;
+    }
+    
+    // REQUIRES: mutex_ held.  Keep reserved_ within a slack or two above
+    // usage_; call after every change of usage_.
+    void Reserve() {
+        if (budget_ == NULL) {
+            return;
+        }
+        const size_t slack = budget_->slack.load(std::memory_order_relaxed);
+        if (usage_ > reserved_) {
+            const size_t delta = usage_ - reserved_ + slack;
+            budget_->reserved.fetch_add(delta, std::memory_order_relaxed);
+            reserved_ += delta;
+        } else if (reserved_ - usage_ > 2 * slack) {
+            const size_t delta = reserved_ - usage_ - slack;
+            budget_->reserved.fetch_sub(delta, std::memory_order_relaxed);
+            reserved_ -= delta;
+        }
+    }
+    
+    // REQUIRES: mutex_ held.  Publish the next eviction candidate for
+    // Tail(); call after changes to the lists.
+    void PublishTail() {
+        if (budget_ == NULL) {
+            return;
+        }
+        const LRUHandle* old = Oldest();
+        tail_.store(old == NULL ? kNoTail : old->tick, std::memory_order_relaxed);
+    }
+    
+    static size_t HandleSize(size_t key_len, size_t value_size, bool has_ttl) {
+        const size_t links = has_ttl ? sizeof(ExpiryLinks) : 0;
+        if (value_size > 0) {
+            return links + LRUHandle::InlineValueOffset(key_len) + value_size;
+        }
+        return links + sizeof(LRUHandle) + key_len;
+    }
+    
+    // REQUIRES: mutex_ held, unless allocator_ != NULL.
+    void* AllocateHandle(size_t size) {
+        return allocator_ != NULL ? allocator_->Allocate(size) : slab_.Allocate(size);
+    }
+    void DeallocateHandle(LRUHandle* e) {
+        const size_t size = HandleSize(e->key_length, e->value_size, e->has_ttl);
+        void* p = e->has_ttl ? static_cast<void*>(ExpiryLinks::Of(e)) : static_cast<void*>(e);
+        if (allocator_ != NULL) {
+            allocator_->Deallocate(p, size);
+        } else {
+            slab_.Deallocate(p, size);
+        }
+    }
+    
+    // Called by the reclaimer, which only runs with mutex_ held.  Entries
+    // from a client allocator are handed back by the next RunDeleters(),
+    // outside the mutex.
+    static void DeallocateRetired(void* shard, void* e) {
+        LRUCacheImpl* s = reinterpret_cast<LRUCacheImpl*>(shard);
+        LRUHandle* h = reinterpret_cast<LRUHandle*>(e);
+        if (s->allocator_ == NULL || s->closing_) {
+            s->DeallocateHandle(h);
+            return;
+        }
+        h->next = s->reclaimed_.load(std::memory_order_relaxed);
+        while (!s->reclaimed_.compare_exchange_weak(h->next, h, std::memory_order_release)) {
+        }
+    }
+    
+    // Initialized before use.
+    size_t capacity_;
+    LRUCachePolicy policy_;
+    double protected_ratio_;
+    bool lock_free_lookup_;
+    bool admission_filter_;
+    uint32_t replica_;              // Stamped on entries and loads
+    LRUCacheAllocator* allocator_;  // NULL for slab_
+    LRUSecondaryCache* secondary_;  // Evicted entries are spilled here
+    LRUCacheSerializer* serializer_;    // Spills values that are not plain bytes
+    GlobalBudget* budget_;          // NULL to evict to fit capacity_
+    size_t num_shards_;             // Sharing budget_
+    LockStats* lock_stats_;         // NULL unless instrumented, guarded by mutex_
+    
+    // mutex_ protects the following state.
+    std::mutex mutex_;
+    size_t usage_;
+    size_t reserved_;   // Of budget_, >= usage_
+    
+    // Charge of the entries clients hold handles to.  Release() and
+    // lock-free lookups update it without the mutex.
+    std::atomic<size_t> pinned_usage_;
+    
+    // The lists are ShardPolicy's, also guarded by mutex_.  Entries on
+    // lru_ and protected_ have in_cache==true, and refs==1 unless clients
+    // have referenced them since eviction last reached them.  Entries on
+    // in_use_ have refs >= 2, kInUse set and in_cache==true.  Entries out
+    // of the cache but still referenced are on no list, and have kInUse
+    // set and in_cache==false.
+    
+    uint64_t inserts_;
+    uint64_t evictions_;
+    uint64_t erases_;
+    uint64_t expirations_;
+    uint64_t rejections_;
+    
+    // Keys looked up and inserted, if admission_filter_ is set.
+    FrequencySketch sketch_;
+    
+    // Entries with a TTL, in the slot of deadline / kWheelTickMillis.
+    // Allocated by the first such insert.  Slots before reap_tick_ have
+    // been reaped.
+    std::vector<ExpiryLinks> wheel_;
+    uint64_t reap_tick_;
+    size_t ttl_entries_;
+    
+    HandleIndex table_;
+    
+    // Entries whose last reference went away under mutex_, linked through
+    // "next".  Their deleters run once the mutex has been dropped.
+    LRUHandle* dead_;
+    
+    HandleSlab slab_;
+    
+    // Entries whose deleters have run, linked through "next" and pushed
+    // without the mutex.  Their memory goes back to the allocator the next
+    // time the mutex is held.
+    std::atomic<LRUHandle*> pending_free_;
+    std::atomic<LRUHandle*> reclaimed_;  // Retired entries for allocator_
+    bool closing_;                       // Set once the destructor has run
+    
+    // Entries and bucket arrays that lock-free readers may still see.
+    // Declared after slab_ so that it is emptied first.
+    EpochReclaimer reclaimer_;
+    
+    // Lookup() outcomes.  Lock-free hits bypass mutex_, so these are
+    // relaxed atomics; they are only ever summed.
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+    
+    // Time spent in deleters, if lock_stats_ is set.
+    std::atomic<uint64_t> deleter_nanos_;
+    
+    // See Tail().
+    std::atomic<uint64_t> tail_;
+    
+    // Loads in progress, guarded by mutex_.  There are rarely more than a
+    // few, so a list is enough.
+    PendingLoad* loads_;
+};
+
+LRUCacheImpl::LRUCacheImpl()
+    : policy_(kLRUPolicy), protected_ratio_(0), lock_free_lookup_(false), admission_filter_(false), replica_(0),
+      allocator_(NULL), secondary_(NULL), serializer_(NULL), budget_(NULL), num_shards_(1), lock_stats_(NULL),
+      usage_(0), reserved_(0), pinned_usage_(0), inserts_(0), evictions_(0), erases_(0),
+      expirations_(0), rejections_(0), reap_tick_(0), ttl_entries_(0),
+      dead_(NULL), pending_free_(NULL), reclaimed_(NULL), closing_(false), hits_(0), misses_(0), deleter_nanos_(0), tail_(kNoTail),
+      loads_(NULL) {
+}
+
+LRUCacheImpl::~LRUCacheImpl() {
+    assert(in_use_.next == &in_use_);  // Error if caller has an unreleased handle
+    assert(loads_ == NULL);            // Error if a LookupOrCompute() is running
+    LRUHandle* lists[] = { &lru_, &protected_ };
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        for (LRUHandle* e = lists[i]->next; e != lists[i]; ) {
+            LRUHandle* next = e->next;
+            assert(e->refs.load(std::memory_order_relaxed) == 1);  // Error if caller has an unreleased handle
+            Unref(e);
+            e = next;
+        }
+    }
+    RunDeleters(TakeDead());
+    ReleasePendingFrees();
+    RunDeleters(NULL);
+    closing_ = true;  // reclaimer_ frees what is left as it goes
+    if (budget_ != NULL) {
+        budget_->reserved.fetch_sub(reserved_, std::memory_order_relaxed);
+    }
+    delete lock_stats_;
+}
+
+// REQUIRES: mutex_ held.
+void LRUCacheImpl::Unref(LRUHandle* e) {
+    const uint32_t old = e->refs.fetch_sub(1, std::memory_order_acq_rel);
+    assert((old & ~LRUHandle::kInUse) > 0);
+    if (old == 1) {
+        FreeEntry(e);
+    } else if (old == 2) {
+        pinned_usage_.fetch_sub(e->charge, std::memory_order_relaxed);
+    } else if (old == (LRUHandle::kInUse | 2)) {
+        // No longer in use by any client.
+        pinned_usage_.fetch_sub(e->charge, std::memory_order_relaxed);
+        if (!e->in_cache) {
+            // Drop the reference FinishErase() left behind, unless a
+            // lock-free lookup that found the entry before it was erased
+            // has taken a new one.
+            uint32_t r = LRUHandle::kInUse | 1;
+            if (e->refs.compare_exchange_strong(r, 0, std::memory_order_acq_rel)) {
+                FreeEntry(e);
+            } else {
+                pinned_usage_.fetch_add(e->charge, std::memory_order_relaxed);
+            }
+            return;
+        }
+        Unpin(e);
+        if (budget_ == NULL) {
+            EvictLocked();
+        }
+    }
+}
+
+// REQUIRES: mutex_ held, e->refs == 0 and e is no longer in table_.
+void LRUCacheImpl::FreeEntry(LRUHandle* e) {
+    usage_ -= e->charge;
+    Reserve();
+    e->next = dead_;
+    dead_ = e;
+}
+
+// Run the deleters of entries taken from dead_, so that slow deleters
+// (or ones that use the cache themselves) do not hold up the shard, and
+// queue their memory for ReleasePendingFrees().  Memory from a client
+// allocator is handed back here instead, once no reader can see it.
+// REQUIRES: mutex_ not held.
+void LRUCacheImpl::RunDeleters(LRUHandle* dead) {
+    if (allocator_ != NULL) {
+        LRUHandle* e = reclaimed_.exchange(NULL, std::memory_order_acquire);
+        while (e != NULL) {
+            LRUHandle* next = e->next;
+            DeallocateHandle(e);
+            e = next;
+        }
+    }
+    if (dead == NULL) {
+        return;
+    }
+    const uint64_t start = (lock_stats_ != NULL) ? NowNanos() : 0;
+    std::string copy;
+    LRUHandle* last = dead;
+    for (LRUHandle* e = dead; e != NULL; e = e->next) {
+        if (e->spill) {
+            Spill(e, &copy);
+        }
+        EntryDeleter deleter = Deleter(e);
+        if (deleter != NULL) {
+            (*deleter)(e->key(), e->value);
+        }
+        last = e;
+    }
+    if (lock_stats_ != NULL) {
+        deleter_nanos_.fetch_add(NowNanos() - start, std::memory_order_relaxed);
+    }
+    if (allocator_ != NULL && !lock_free_lookup_) {
+        while (dead != NULL) {
+            LRUHandle* next = dead->next;
+            DeallocateHandle(dead);
+            dead = next;
+        }
+        return;
+    }
+    last->next = pending_free_.load(std::memory_order_relaxed);
+    while (!pending_free_.compare_exchange_weak(last->next, dead, std::memory_order_release)) {
+    }
+}
+
+// Copy "e", an evicted entry, to the secondary cache, through "scratch"
+// if it has to be serialized or tagged.
+// REQUIRES: mutex_ not held.
+void LRUCacheImpl::Spill(const LRUHandle* e, std::string* scratch) {
+    if (serializer_ == NULL) {
+        secondary_->Insert(e->key(), e->key_length, e->value, e->value_size, e->charge);
+        return;
+    }
+    scratch->clear();
+    if (e->value_size > 0 && Deleter(e) == NULL) {
+        scratch->append(static_cast<const char*>(e->value), e->value_size);
+        scratch->push_back(kPlainCopy);
+    } else if (serializer_->Serialize(e->key(), e->key_length, e->value, Deleter(e), scratch)) {
+        scratch->push_back(kSerializedCopy);
+    } else {
+        return;
+    }
+    secondary_->Insert(e->key(), e->key_length, scratch->data(), scratch->size(), e->charge);
+}
+
+// Move the key's copy out of the secondary cache into *copy, if it has
+// one that can be read back.
+// REQUIRES: mutex_ not held.
+bool LRUCacheImpl::TakeSecondary(const char* key, size_t key_len, SecondaryCopy* copy) {
+    std::string& bytes = copy->bytes;
+    if (!secondary_->Take(key, key_len, &bytes, &copy->charge) || bytes.empty()) {
+        return false;
+    }
+    copy->deleter = NULL;
+    char tag = kPlainCopy;
+    if (serializer_ != NULL) {
+        tag = bytes[bytes.size() - 1];
+        bytes.resize(bytes.size() - 1);
+    }
+    if (tag == kPlainCopy) {
+        copy->value = bytes.data();
+        copy->value_size = bytes.size();
+        return !bytes.empty();
+    }
+    void* value;
+    if (tag != kSerializedCopy ||
+        !serializer_->Deserialize(key, key_len, bytes.data(), bytes.size(), &value, &copy->deleter)) {
+        return false;
+    }
+    copy->value = value;
+    copy->value_size = 0;
+    return true;
+}
+
+// REQUIRES: mutex_ held.
+void LRUCacheImpl::ReleasePendingFrees() {
+    LRUHandle* e = pending_free_.exchange(NULL, std::memory_order_acquire);
+    while (e != NULL) {
+        LRUHandle* next = e->next;
+        if (lock_free_lookup_) {
+            // A concurrent reader may still be looking at e->refs.
+            reclaimer_.Retire(e, &DeallocateRetired, this);
+        } else {
+            DeallocateHandle(e);
+        }
+        e = next;
+    }
+}
+
+// REQUIRES: mutex_ held.  Clear kInUse from "e", which has just dropped
+// to the cache's own reference.
+void LRUCacheImpl::ClearInUse(LRUHandle* e) {
+    if (e->refs.fetch_and(~LRUHandle::kInUse, std::memory_order_relaxed) != (LRUHandle::kInUse | 1)) {
+        // Found again by a lock-free lookup since the last client let go.
+        pinned_usage_.fetch_add(e->charge, std::memory_order_relaxed);
+    }
+}
+
+// REQUIRES: mutex_ held.  Evict "old", the entry eviction has picked.
+void LRUCacheImpl::EvictEntry(LRUHandle* old) {
+    table_.Remove(old->key(), old->key_length, old->hash);
+    // Plain bytes can be copied out and back as they are; other
+    // values only if the serializer takes them.
+    old->spill = secondary_ != NULL && !old->has_ttl &&
+        ((old->value_size > 0 && Deleter(old) == NULL) || serializer_ != NULL);
+    FinishErase(old);
+    ++evictions_;
+}
+
+// "e" has been removed from table_; drop it from the cache.
+void LRUCacheImpl::FinishErase(LRUHandle* e) {
+    uint32_t r = e->refs.load(std::memory_order_relaxed);
+    Unlink(e, (r & LRUHandle::kInUse) != 0);
+    if (e->has_ttl) {
+        WheelRemove(e);
+    }
+    e->in_cache = false;
+    // Drop the cache's reference, unless clients still hold the entry:
+    // then it keeps it, with kInUse set, so that the last Release()
+    // frees the entry under the mutex.
+    for (;;) {
+        if (r == 1) {
+            if (e->refs.compare_exchange_weak(r, 0, std::memory_order_acq_rel)) {
+                FreeEntry(e);
+                return;
+            }
+        } else if (e->refs.compare_exchange_weak(r, r | LRUHandle::kInUse, std::memory_order_relaxed)) {
+            return;
+        }
+    }
+}
+
+void LRUCacheImpl::WheelInsert(LRUHandle* e) {
+    if (wheel_.empty()) {
+        wheel_.resize(kWheelSlots);
+        for (size_t i = 0; i < kWheelSlots; i++) {
+            wheel_[i].next = wheel_[i].prev = &wheel_[i];
+        }
+    }
+    const uint64_t now_tick = NowMillis() / kWheelTickMillis;
+    if (ttl_entries_++ == 0) {
+        reap_tick_ = now_tick;
+    }
+    // An entry already due goes in the next slot to be reaped.
+    ExpiryLinks* x = ExpiryLinks::Of(e);
+    uint64_t tick = x->deadline / kWheelTickMillis;
+    if (tick < reap_tick_) {
+        tick = reap_tick_;
+    }
+    ExpiryLinks* slot = &wheel_[tick % kWheelSlots];
+    x->next = slot;
+    x->prev = slot->prev;
+    x->prev->next = x;
+    x->next->prev = x;
+}
+
+void LRUCacheImpl::WheelRemove(LRUHandle* e) {
+    ExpiryLinks* x = ExpiryLinks::Of(e);
+    x->next->prev = x->prev;
+    x->prev->next = x->next;
+    ttl_entries_--;
+}
+
+// Walk the slots from reap_tick_ up to, but not including, the current
+// one, so that each entry is visited about once per rotation.  Entries due
+// in the current slot are left to lookups and later calls.
+uint32_t LRUCacheImpl::ReapLocked(uint64_t now, uint32_t limit) {
+    const uint64_t now_tick = now / kWheelTickMillis;
+    uint32_t reaped = 0;
+    for (uint64_t slots = 0; ttl_entries_ > 0 && reaped < limit && reap_tick_ < now_tick; slots++) {
+        if (slots == kWheelSlots) {
+            // Every slot has been visited, so nothing due is left.
+            reap_tick_ = now_tick;
+            break;
+        }
+        ExpiryLinks* slot = &wheel_[reap_tick_ % kWheelSlots];
+        for (ExpiryLinks* x = slot->next; x != slot && reaped < limit; ) {
+            ExpiryLinks* next = x->next;
+            if (x->deadline <= now) {
+                LRUHandle* e = x->entry();
+                table_.Remove(e->key(), e->key_length, e->hash);
+                FinishErase(e);
+                ++expirations_;
+                ++reaped;
+            }
+            x = next;
+        }
+        if (reaped >= limit) {
+            break;
+        }
+        reap_tick_++;
+    }
+    if (ttl_entries_ == 0 && reap_tick_ < now_tick) {
+        reap_tick_ = now_tick;
+    }
+    if (reaped > 0) {
+        PublishTail();
+    }
+    return reaped;
+}
+
+uint32_t LRUCacheImpl::ReapExpired(uint32_t limit) {
+    LRUHandle* dead;
+    uint32_t reaped = 0;
+    {
+        MutexLock l(&mutex_, lock_stats_);
+        ReleasePendingFrees();
+        if (ttl_entries_ > 0) {
+            reaped = ReapLocked(NowMillis(), limit);
+        }
+        dead = TakeDead();
+    }
+    RunDeleters(dead);
+    return reaped;
+}
+
+bool LRUCacheImpl::LookupLockFree(const char* key, size_t key_len, uint64_t hash, LRUHandle** result) {
+    if (!table_.LookupLockFree(key, key_len, hash, result)) {
+        return false;
+    }
+    if (*result != NULL) {
+        const uint32_t old = (*result)->TryRef();
+        if (old == 0) {
+            return false;   // Dead; the mutex path sees the current entry
+        }
+        if (old == 1) {
+            pinned_usage_.fetch_add((*result)->charge, std::memory_order_relaxed);
+        }
+    }
+    if (*result != NULL && (*result)->has_ttl && (*result)->Expired(NowMillis())) {
+        // Leave removing it to the mutex path.
+        Release(reinterpret_cast<LRUCache::Handle*>(*result));
+        return false;
+    }
+    // Promotion is deferred to the next eviction sweep.
+    if (*result != NULL) {
+        (*result)->SetReferenced();
+        hits_.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+LRUCache::Handle* LRUCacheImpl::Lookup(const char* key, size_t key_len, uint64_t hash) {
+    if (lock_free_lookup_) {
+        LRUHandle* e;
+        EpochGuard g;
+        if (LookupLockFree(key, key_len, hash, &e)) {
+            return reinterpret_cast<LRUCache::Handle*>(e);
+        }
+    }
+    
+    LRUHandle* e;
+    LRUHandle* dead;
+    {
+        MutexLock l(&mutex_, lock_stats_);
+        e = LookupLocked(key, key_len, hash);
+        dead = TakeDead();
+    }
+    RunDeleters(dead);
+    return reinterpret_cast<LRUCache::Handle*>(e);
+}
+
+// Look up "key", and on a miss join the load in progress for it, or
+// start one if there is none, as *started reports.  With a callback the
+// caller is left on the load's callbacks; otherwise it is counted as a
+// blocking waiter and must Wait() and Unref() the load.
+LRUHandle* LRUCacheImpl::JoinLoad(
+    const char* key, size_t key_len, uint64_t hash,
+    void (*deleter)(const char* key, void* value), LRUCache::Priority priority,
+    const LoadCallback* callback, PendingLoad** load, bool* started
+) {
+    bool counted = false;
+    if (lock_free_lookup_) {
+        LRUHandle* e;
+        EpochGuard g;
+        if (LookupLockFree(key, key_len, hash, &e)) {
+            if (e != NULL) {
+                return e;
+            }
+            counted = true;
+        }
+    }
+    
+    LRUHandle* e;
+    LRUHandle* dead;
+    *started = false;
+    {
+        MutexLock l(&mutex_, lock_stats_);
+        e = LookupLocked(key, key_len, hash);
+        if (counted) {
+            // Count the lock-free miss and this lookup once.
+            misses_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        if (e == NULL) {
+            PendingLoad* p = loads_;
+            while (p != NULL && (p->promotion || !p->Matches(key, key_len, hash))) {
+                p = p->next;
+            }
+            if (p == NULL) {
+                p = new PendingLoad(key, key_len, hash, deleter, priority);
+                p->replica = replica_;
+                p->next = loads_;
+                loads_ = p;
+                *started = true;
+            } else if (callback == NULL) {
+                p->waiters++;
+                p->refs.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (callback != NULL) {
+                p->callbacks.push_back(*callback);
+            }
+            *load = p;
+        }
+        dead = TakeDead();
+    }
+    RunDeleters(dead);
+    return e;
+}
+
+LRUCache::Handle* LRUCacheImpl::LookupOrCompute(
+    const char* key, size_t key_len, uint64_t hash,
+    bool (*loader)(const char* key, size_t key_len, void* arg, void** value, size_t* charge),
+    void* arg, void (*deleter)(const char* key, void* value), LRUCache::Priority priority
+) {
+    PendingLoad* load;
+    bool started;
+    LRUHandle* e = JoinLoad(key, key_len, hash, deleter, priority, NULL, &load, &started);
+    if (e != NULL) {
+        return reinterpret_cast<LRUCache::Handle*>(e);
+    }
+    if (!started) {
+        e = load->Wait();
+        load->Unref();
+        return reinterpret_cast<LRUCache::Handle*>(e);
+    }
+    if (LoadSecondary(load, true, &e)) {
+        return reinterpret_cast<LRUCache::Handle*>(e);
+    }
+    
+    // The loader runs without the mutex, like a caller's own Lookup(),
+    // load and Insert() would.
+    void* value = NULL;
+    size_t charge = 0;
+    const bool loaded = (*loader)(key, key_len, arg, &value, &charge);
+    return reinterpret_cast<LRUCache::Handle*>(FinishLoad(load, loaded, value, charge, true));
+}
+
+void LRUCacheImpl::LookupOrComputeAsync(
+    const char* key, size_t key_len, uint64_t hash,
+    void (*start)(LRUCache::Load* load, const char* key, size_t key_len, void* arg),
+    void (*done)(LRUCache::Handle* handle, void* arg), void* arg,
+    void (*deleter)(const char* key, void* value), LRUCache::Priority priority
+) {
+    const LoadCallback callback = { done, arg };
+    PendingLoad* load;
+    bool started;
+    LRUHandle* e = JoinLoad(key, key_len, hash, deleter, priority, &callback, &load, &started);
+    if (e != NULL) {
+        (*done)(reinterpret_cast<LRUCache::Handle*>(e), arg);
+    } else if (started && !LoadSecondary(load, false, &e)) {
+        // May finish the load, and so call "done", before returning.
+        (*start)(reinterpret_cast<LRUCache::Load*>(load), key, key_len, arg);
+    }
+}
+
+// Finish "load" with the key's copy in the secondary cache, if it has
+// one, so that the key need not be loaded.  Returns false, leaving the
+// load in progress, if there is none.  *result is as for FinishLoad().
+bool LRUCacheImpl::LoadSecondary(PendingLoad* load, bool keep, LRUHandle** result) {
+    SecondaryCopy copy;
+    if (secondary_ == NULL || !TakeSecondary(load->key.data(), load->key.size(), &copy)) {
+        return false;
+    }
+    *result = CompleteLoad(load, true, copy.value, copy.value_size, copy.charge, copy.deleter, keep);
+    return true;
+}
+
+LRUHandle* LRUCacheImpl::FinishLoad(PendingLoad* load, bool loaded, void* value, size_t charge, bool keep) {
+    if (loaded && secondary_ != NULL) {
+        // Any copy there is older than the loaded value.
+        secondary_->Erase(load->key.data(), load->key.size());
+    }
+    return CompleteLoad(load, loaded, value, 0, charge, load->deleter, keep);
+}
+
+// FinishLoad() with a value given as for NewHandle() and its deleter.
+LRUHandle* LRUCacheImpl::CompleteLoad(
+    PendingLoad* load, bool loaded, const void* value, size_t value_size, size_t charge,
+    EntryDeleter deleter, bool keep
+) {
+    LRUHandle* e = NULL;
+    if (loaded && allocator_ != NULL) {
+        e = NewHandle(load->key.data(), load->key.size(), load->hash, value, value_size, charge, 0);
+    }
+    LRUHandle* dead;
+    std::vector<LoadCallback> callbacks;
+    {
+        MutexLock l(&mutex_, lock_stats_);
+        ReleasePendingFrees();
+        PendingLoad** p = &loads_;
+        while (*p != load) {
+            p = &(*p)->next;
+        }
+        *p = load->next;
+        if (loaded) {
+            if (e == NULL) {
+                e = NewHandle(load->key.data(), load->key.size(), load->hash, value, value_size, charge, 0);
+            }
+            if (load->stale) {
+                // The value may be older than what the key was erased or
+                // replaced with, so it only goes to those waiting on it.
+                SetDeleter(e, deleter);
+                Detach(e);
+            } else {
+                MarkLoadStale(e->key(), e->key_length, e->hash);
+                e = InsertLocked(e, deleter, load->priority);
+            }
+            // One reference has been returned; hand out the rest.
+            const size_t refs = load->waiters + load->callbacks.size();
+            e->refs.fetch_add(static_cast<uint32_t>(refs), std::memory_order_relaxed);
+            if (!keep) {
+                Unref(e);
+            }
+        }
+        callbacks.swap(load->callbacks);
+        dead = TakeDead();
+    }
+    RunDeleters(dead);
+    load->Finish(e);
+    load->Unref();
+    for (size_t i = 0; i < callbacks.size(); i++) {
+        (*callbacks[i].done)(reinterpret_cast<LRUCache::Handle*>(e), callbacks[i].arg);
+    }
+    return keep ? e : NULL;
+}
+
+LRUCache::Handle* LRUCacheImpl::PromoteSecondary(const char* key, size_t key_len, uint64_t hash) {
+    PendingLoad* load = NULL;
+    LRUHandle* e;
+    LRUHandle* dead;
+    {
+        MutexLock l(&mutex_, lock_stats_);
+        // Another caller may have cached the key since the miss.
+        e = LookupLocked(key, key_len, hash);
+        misses_.fetch_sub(1, std::memory_order_relaxed);  // Counted by the miss
+        if (e == NULL) {
+            load = new PendingLoad(key, key_len, hash, NULL, LRUCache::kNormalPriority);
+            load->promotion = true;
+            load->next = loads_;
+            loads_ = load;
+        }
+        dead = TakeDead();
+    }
+    RunDeleters(dead);
+    if (e != NULL) {
+        return reinterpret_cast<LRUCache::Handle*>(e);
+    }
+    
+    SecondaryCopy copy;
+    const bool taken = TakeSecondary(key, key_len, &copy);
+    if (taken && allocator_ != NULL) {
+        e = NewHandle(key, key_len, hash, copy.value, copy.value_size, copy.charge, 0);
+    }
+    {
+        MutexLock l(&mutex_, lock_stats_);
+        ReleasePendingFrees();
+        PendingLoad** p = &loads_;
+        while (*p != load) {
+            p = &(*p)->next;
+        }
+        *p = load->next;
+        if (taken && e == NULL) {
+            e = NewHandle(key, key_len, hash, copy.value, copy.value_size, copy.charge, 0);
+        }
+        if (taken && !load->stale) {
+            e = InsertLocked(e, copy.deleter, LRUCache::kNormalPriority);
+        } else {
+            if (e != NULL) {
+                // The copy is older than what the key was erased or
+                // replaced with; the caller gets the key's entry instead.
+                // Dropping it runs the deleter of a rebuilt value.
+                SetDeleter(e, copy.deleter);
+                Detach(e);
+                Unref(e);
+            }
+            e = LookupLocked(key, key_len, hash);
+            misses_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        dead = TakeDead();
+    }
+    RunDeleters(dead);
+    load->Unref();
+    return reinterpret_cast<LRUCache::Handle*>(e);
+}
+
+size_t LRUCacheImpl::AppendSnapshot(std::string* out) {
+    MutexLock l(&mutex_, lock_stats_);
+    const uint64_t now = NowMillis();
+    size_t n = 0;
+    // Protected entries are hotter than probation ones, and entries in
+    // use hotter still.
+    LRUHandle* lists[] = { &lru_, &protected_, &in_use_ };
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        for (LRUHandle* e = lists[i]->next; e != lists[i]; e = e->next) {
+            SnapshotRecord r;
+            r.key_len = e->key_length;
+            r.value_size = e->value_size;
+            r.charge = e->charge;
+            r.ttl_millis = 0;
+            if (e->has_ttl) {
+                const uint64_t deadline = ExpiryLinks::Of(e)->deadline;
+                if (deadline <= now) {
+                    continue;
+                }
+                r.ttl_millis = deadline - now;
+            }
+            const size_t size = SnapshotRecord::Size(r.key_len, r.value_size);
+            const size_t pos = out->size();
+            out->resize(pos + size);
+            char* p = &(*out)[pos];
+            memcpy(p, &r, sizeof(r));
+            memcpy(p + sizeof(r), e->key(), r.key_len);
+            if (r.value_size > 0) {
+                memcpy(p + sizeof(r) + r.key_len, e->value, r.value_size);
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+void LRUCacheImpl::LoadSnapshot(
+    const uint32_t* order, size_t n, const SnapshotRecord* const* records, const uint64_t* hashes,
+    void (*deleter)(const char* key, void* value)
+) {
+    size_t first = n;
+    {
+        MutexLock l(&mutex_, lock_stats_);
+        size_t charge = 0;
+        while (first > 0 && charge + records[order[first - 1]]->charge <= capacity_) {
+            charge += records[order[--first]]->charge;
+        }
+        table_.Reserve(static_cast<uint32_t>(n - first));
+    }
+    
+    const uint64_t now = NowMillis();
+    std::vector<LRUHandle*> made;
+    for (size_t i = first; i < n; ) {
+        const size_t end = std::min(n, i + kLoadBatch);
+        if (allocator_ != NULL) {
+            made.clear();
+            for (size_t j = i; j < end; j++) {
+                const SnapshotRecord* r = records[order[j]];
+                made.push_back(NewHandle(r->key(), r->key_len, hashes[order[j]], r->value(), r->value_size,
+                                         r->charge, r->ttl_millis != 0 ? now + r->ttl_millis : 0));
+            }
+        }
+        LRUHandle* dead;
+        {
+            MutexLock l(&mutex_, lock_stats_);
+            ReleasePendingFrees();
+            for (const size_t start = i; i < end; i++) {
+                const SnapshotRecord* r = records[order[i]];
+                LRUHandle* e = !made.empty() ? made[i - start]
+                             : NewHandle(r->key(), r->key_len, hashes[order[i]], r->value(), r->value_size,
+                                         r->charge, r->ttl_millis != 0 ? now + r->ttl_millis : 0);
+                MarkLoadStale(r->key(), r->key_len, hashes[order[i]]);
+                Unref(InsertLocked(e, deleter, LRUCache::kNormalPriority));
+            }
+            dead = TakeDead();
+        }
+        RunDeleters(dead);
+    }
+}
+
+void LRUCacheImpl::MultiLookup(
+    uint32_t* order, size_t n, const char* const* keys, const size_t* key_lens,
+    const uint64_t* hashes, LRUCache::Handle** handles
+) {
+    if (lock_free_lookup_) {
+        // Keep the keys that need the mutex at the front of "order".
+        size_t locked = 0;
+        {
+            EpochGuard g;
+            for (size_t i = 0; i < n; i++) {
+                const uint32_t k = order[i];
+                LRUHandle* e;
+                if (LookupLockFree(keys[k], key_lens[k], hashes[k], &e)) {
+                    handles[k] = reinterpret_cast<LRUCache::Handle*>(e);
+                } else {
+                    order[locked++] = k;
+                }
+            }
+        }
+        n = locked;
+        if (n == 0) {
+            return;
+        }
+    }
+    
+    LRUHandle* dead;
+    {
+        MutexLock l(&mutex_, lock_stats_);
+        // Start all bucket loads before walking any chain.
+        for (size_t i = 0; i < n; i++) {
+            table_.Prefetch(hashes[order[i]]);
+        }
+        for (size_t i = 0; i < n; i++) {
+            const uint32_t k = order[i];
+            handles[k] = reinterpret_cast<LRUCache::Handle*>(LookupLocked(keys[k], key_lens[k], hashes[k]));
+        }
+        dead = TakeDead();
+    }
+    RunDeleters(dead);
+}
+
+LRUHandle* LRUCacheImpl::LookupLocked(const char* key, size_t key_len, uint64_t hash) {
+    if (admission_filter_) {
+        sketch_.Increment(hash);
+    }
+    LRUHandle* e = table_.Lookup(key, key_len, hash);
+    if (e != NULL && e->has_ttl && e->Expired(NowMillis())) {
+        // Drop it now rather than leave it to the reaper.
+        table_.Remove(key, key_len, hash);
+        FinishErase(e);
+        ++expirations_;
+        PublishTail();
+        e = NULL;
+    }
+    if (e == NULL) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        const uint32_t old = e->refs.fetch_add(1, std::memory_order_relaxed);
+        if (old == 1) {
+            pinned_usage_.fetch_add(e->charge, std::memory_order_relaxed);
+        }
+        Hit(e, (old & LRUHandle::kInUse) != 0);
+        PublishTail();
+    }
+    return e;
+}
+
+void LRUCacheImpl::Release(LRUCache::Handle* handle) {
+    // The cache holds its own reference to every entry in table_, so the
+    // count can only drop to zero here once the entry has been removed.
+    // Only the last client reference to an in-use entry needs the mutex,
+    // to move the entry back to the LRU list; kInUse cannot change while
+    // the mutex is held.
+    LRUHandle* e = reinterpret_cast<LRUHandle*>(handle);
+    const size_t charge = e->charge;  // e may be freed once the reference is dropped
+    uint32_t r = e->refs.load(std::memory_order_relaxed);
+    while (r != (LRUHandle::kInUse | 2)) {
+        assert(r > 1);
+        if (e->refs.compare_exchange_weak(r, r - 1, std::memory_order_acq_rel)) {
+            if (r == 2) {
+                pinned_usage_.fetch_sub(charge, std::memory_order_relaxed);
+            }
+            return;
+        }
+    }
+    
+    LRUHandle* dead;
+    {
+        MutexLock l(&mutex_, lock_stats_);
+        Unref(e);
+        PublishTail();
+        dead = TakeDead();
+    }
+    RunDeleters(dead);
+}
+
+LRUCache::Handle* LRUCacheImpl::Insert(
+    const char* key, size_t key_len, uint64_t hash, const void* value, size_t value_size,
+    size_t charge, void (*deleter)(const char* key, void* value), LRUCache::Priority priority,
+    uint64_t deadline
+) {
+    // A client allocator may be slow or take locks of its own, so it is
+    // called before the mutex is taken.
+    LRUHandle* e = NULL;
+    if (allocator_ != NULL) {
+        e = NewHandle(key, key_len, hash, value, value_size, charge, deadline);
+    }
+    LRUHandle* dead;
+    {
+        MutexLock l(&mutex_, lock_stats_);
+        ReleasePendingFrees();
+        // Expired entries make room before anything is evicted.
+        if (ttl_entries_ > 0) {
+            ReapLocked(NowMillis(), kInsertReapBatch);
+        }
+        if (e == NULL) {
+            e = NewHandle(key, key_len, hash, value, value_size, charge, deadline);
+        }
+        MarkLoadStale(key, key_len, hash);
+        e = InsertLocked(e, deleter, priority);
+        dead = TakeDead();
+    }
+    RunDeleters(dead);
+    return reinterpret_cast<LRUCache::Handle*>(e);
+}
+
+void LRUCacheImpl::MultiInsert(
+    const uint32_t* order, size_t n, const char* const* keys, const size_t* key_lens,
+    const uint64_t* hashes, void* const* values, const size_t* charges,
+    void (*deleter)(const char* key, void* value), LRUCache::Priority priority,
+    LRUCache::Handle** handles
+) {
+    std::vector<LRUHandle*> made;
+    if (allocator_ != NULL) {
+        made.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            const uint32_t k = order[i];
+            made[i] = NewHandle(keys[k], key_lens[k], hashes[k], values[k], 0, charges[k], 0);
+        }
+    }
+    LRUHandle* dead;
+    {
+        MutexLock l(&mutex_, lock_stats_);
+        ReleasePendingFrees();
+        // Expired entries make room before anything is evicted, as in
+        // Insert(), reaped once for the whole batch.
+        if (ttl_entries_ > 0) {
+            const size_t limit = n < UINT32_MAX / kInsertReapBatch ? n * kInsertReapBatch : UINT32_MAX;
+            ReapLocked(NowMillis(), static_cast<uint32_t>(limit));
+        }
+        // While the shard fills up, grow the index once for the batch
+        // rather than by doubling within it, but only for the entries
+        // that fit: past that, each insert evicts as many as it adds.
+        if (usage_ < capacity_) {
+            size_t room = capacity_ - usage_;
+            size_t fit = 0;
+            while (fit < n && charges[order[fit]] <= room) {
+                room -= charges[order[fit++]];
+            }
+            table_.Reserve(static_cast<uint32_t>(fit));
+        }
+        for (size_t i = 0; i < n; i++) {
+            table_.Prefetch(hashes[order[i]]);
+        }
+        for (size_t i = 0; i < n; i++) {
+            const uint32_t k = order[i];
+            LRUHandle* e = !made.empty() ? made[i]
+                         : NewHandle(keys[k], key_lens[k], hashes[k], values[k], 0, charges[k], 0);
+            MarkLoadStale(keys[k], key_lens[k], hashes[k]);
+            e = InsertLocked(e, deleter, priority);
+            if (handles != NULL) {
+                handles[k] = reinterpret_cast<LRUCache::Handle*>(e);
+            } else {
+                Unref(e);
+            }
+        }
+        dead = TakeDead();
+    }
+    RunDeleters(dead);
+}
+
+LRUHandle* LRUCacheImpl::NewHandle(
+    const char* key, size_t key_len, uint64_t hash, const void* value, size_t value_size,
+    size_t charge, uint64_t deadline
+) {
+    assert(key_len <= UINT32_MAX && value_size <= UINT32_MAX);
+    const bool has_ttl = deadline != 0;
+    char* base = static_cast<char*>(AllocateHandle(HandleSize(key_len, value_size, has_ttl)));
+    LRUHandle* e = new (base + (has_ttl ? sizeof(ExpiryLinks) : 0)) LRUHandle;
+    e->has_ttl = has_ttl;
+    e->spill = false;
+    e->replica = static_cast<unsigned char>(replica_);
+    if (has_ttl) {
+        ExpiryLinks::Of(e)->deadline = deadline;  // Before lock-free readers can see e
+    }
+    if (value_size > 0) {
+        e->value = reinterpret_cast<char*>(e) + LRUHandle::InlineValueOffset(key_len);
+        memcpy(e->value, value, value_size);
+    } else {
+        e->value = const_cast<void*>(value);
+    }
+    e->charge = charge;
+    e->key_length = static_cast<uint32_t>(key_len);
+    e->value_size = static_cast<uint32_t>(value_size);
+    e->hash = hash;
+    e->refs.store(2, std::memory_order_relaxed);  // One from LRUCache, one for the returned handle
+    e->referenced.store(false, std::memory_order_relaxed);
+    e->in_cache = true;
+    e->in_protected = false;
+    e->low_priority = false;
+    memcpy(e->key_data, key, key_len);
+    e->key_data[key_len] = '\0';
+    return e;
+}
+
+LRUHandle* LRUCacheImpl::InsertLocked(
+    LRUHandle* e, void (*deleter)(const char* key, void* value), LRUCache::Priority priority
+) {
+    const size_t charge = e->charge;
+    const uint64_t hash = e->hash;
+    SetDeleter(e, deleter);
+    ++inserts_;
+    
+    if (admission_filter_ && budget_ == NULL) {
+        sketch_.EnsureCapacity(table_.Size() + 1);
+        sketch_.Increment(hash);
+        if (usage_ + charge > capacity_ && !Admit(e)) {
+            Detach(e);
+            ++rejections_;
+            return e;
+        }
+    }
+    
+    if (budget_ != NULL) {
+        budget_->clock.fetch_add(1, std::memory_order_relaxed);
+    }
+    LRU_Append(&lru_, e);
+    usage_ += charge;
+    pinned_usage_.fetch_add(charge, std::memory_order_relaxed);
+    Reserve();
+    
+    LRUHandle* old = table_.Insert(e);
+    if (old != NULL) {
+        FinishErase(old);
+    }
+    if (e->has_ttl) {
+        WheelInsert(e);
+    }
+    
+    // With a global budget, the caller evicts from the coldest shards.
+    if (budget_ == NULL) {
+        EvictLocked();
+    }
+    
+    // Low priority entries become the next eviction candidates.
+    if (priority == LRUCache::kLowPriority && e->in_cache) {
+        MakeLowPriority(e, (e->refs.load(std::memory_order_relaxed) & LRUHandle::kInUse) != 0);
+    }
+    PublishTail();
+    return e;
+}
+
+// REQUIRES: mutex_ held.  Hand "e", a new entry, back with one reference
+// without caching it, as if it had been inserted and evicted at once.
+void LRUCacheImpl::Detach(LRUHandle* e) {
+    e->in_cache = false;
+    e->refs.store(LRUHandle::kInUse | 2, std::memory_order_relaxed);
+    usage_ += e->charge;
+    pinned_usage_.fetch_add(e->charge, std::memory_order_relaxed);
+}
+
+// REQUIRES: mutex_ held.  Keep the loads of the key in progress, a
+// LookupOrCompute() and any promotions, from caching their value, which
+// an Erase() or Insert() of the key has overtaken.
+void LRUCacheImpl::MarkLoadStale(const char* key, size_t key_len, uint64_t hash) {
+    for (PendingLoad* p = loads_; p != NULL; p = p->next) {
+        if (p->Matches(key, key_len, hash)) {
+            p->stale = true;
+        }
+    }
+}
+
+// REQUIRES: mutex_ held.  Whether to cache "e", a new entry that would
+// make the shard evict.  It must be seen more often than the entry
+// eviction would start with, which skips entries in use; those are
+// pinned on the way, as EvictLocked() would.  A key already cached is
+// always replaced.
+bool LRUCacheImpl::Admit(const LRUHandle* e) {
+    LRUHandle* victim;
+    for (;;) {
+        victim = Oldest();
+        if (victim == NULL) {
+            return true;
+        }
+        if (!victim->MarkInUse()) {
+            break;
+        }
+        Pin(victim);
+    }
+    if (sketch_.Estimate(e->hash) > sketch_.Estimate(victim->hash)) {
+        return true;
+    }
+    return table_.Lookup(e->key(), e->key_length, e->hash) != NULL;
+}
+
+void LRUCacheImpl::Erase(const char* key, size_t key_len, uint64_t hash) {
+    LRUHandle* dead;
+    {
+        MutexLock l(&mutex_, lock_stats_);
+        ReleasePendingFrees();
+        MarkLoadStale(key, key_len, hash);
+        LRUHandle* e = table_.Remove(key, key_len, hash);
+        if (e != NULL) {
+            FinishErase(e);
+            ++erases_;
+            PublishTail();
+        }
+        dead = TakeDead();
+    }
+    RunDeleters(dead);
+}
+
+uint32_t LRUCacheImpl::EvictExcess(uint32_t limit) {
+    LRUHandle* dead;
+    uint32_t visited;
+    {
+        MutexLock l(&mutex_, lock_stats_);
+        ReleasePendingFrees();
+        visited = EvictLocked(limit);
+        PublishTail();
+        dead = TakeDead();
+    }
+    RunDeleters(dead);
+    return visited;
+}
+
+// One size class per acquisition of the mutex, as each takes time linear
+// in its free objects.  Memory is only trimmed once it is free: the
+// evicted entries' deleters have run, and under lock_free_lookup, no
+// reader can still see them.
+void LRUCacheImpl::TrimSlab() {
+    if (allocator_ != NULL) {
+        return;
+    }
+    for (int c = 0; c < HandleSlab::kNumClasses; c++) {
+        MutexLock l(&mutex_, lock_stats_);
+        if (c == 0) {
+            ReleasePendingFrees();
+            if (lock_free_lookup_) {
+                reclaimer_.Collect();
+            }
+        }
+        slab_.Trim(c);
+    }
+}
+
+void LRUCacheImpl::AddStats(LRUCacheStats* stats) {
+    stats->hits += hits_.load(std::memory_order_relaxed);
+    stats->misses += misses_.load(std::memory_order_relaxed);
+    
+    MutexLock l(&mutex_);
+    stats->inserts += inserts_;
+    stats->evictions += evictions_;
+    stats->erases += erases_;
+    stats->expirations += expirations_;
+    stats->rejections += rejections_;
+    stats->usage += usage_;
+    
+    stats->pinned_usage += pinned_usage_.load(std::memory_order_relaxed);
+    stats->entries += table_.Size();
+    stats->table_slots += table_.Slots();
+    stats->table_resizes += table_.Resizes();
+    stats->slab_bytes += slab_.Bytes();
+    if (lock_stats_ != NULL) {
+        stats->lock_acquisitions += lock_stats_->acquisitions;
+        stats->lock_contended += lock_stats_->contended;
+        stats->lock_wait_nanos += lock_stats_->wait_nanos;
+        stats->lock_hold_nanos += lock_stats_->hold_nanos;
+        stats->deleter_nanos += deleter_nanos_.load(std::memory_order_relaxed);
+    }
+}
+
+// Shards whose eviction candidates EvictOverBudget() compares per round,
+// and entries it visits in the coldest of them.
+static const size_t kEvictionCandidates = 8;
+static const uint32_t kEvictionBatch = 4;
+
+// Entries SetCapacity() visits per acquisition of a shard mutex, whether
+// it evicts them or not.
+static const uint32_t kShrinkBatch = 64;
+
+// Expired entries ReapExpired() removes per acquisition of a shard mutex.
+static const uint32_t kReapBatch = 64;
+
+class ShardedLRUCache: public LRUCache {
+private:
+    LRUCacheImpl* shard_;
+    int num_shard_bits_;
+    std::mutex id_mutex_;
+    uint64_t last_id_;
+    
+    // SetCapacity() calls hold capacity_mutex_ while resizing the shards.
+    std::mutex capacity_mutex_;
+    std::atomic<size_t> capacity_;
+    
+    // Only used with LRUCacheOptions::global_capacity.
+    bool global_;
+    GlobalBudget budget_;
+    
+    LRUSecondaryCache* secondary_;
+    
+    // Only used with LRUCacheOptions::reap_interval_millis.
+    std::thread reaper_;
+    std::mutex reaper_mutex_;
+    std::condition_variable reaper_cv_;
+    bool stopping_;
+    
+    void ReapPeriodically(uint32_t interval_millis) {
+        std::unique_lock<std::mutex> l(reaper_mutex_);
+        while (!reaper_cv_.wait_for(l, std::chrono::milliseconds(interval_millis),
+                                    [this] { return stopping_; })) {
+            l.unlock();
+            ReapExpired();
+            l.lock();
+        }
+    }
+    
+    // The top num_shard_bits_ bits of the hash.  Going through the high
+    // half keeps zero shard bits defined.
+    uint32_t Shard(uint64_t hash) const {
+        return static_cast<uint32_t>(((hash >> 32) << num_shard_bits_) >> 32);
+    }
+    
+    // The keys of a MultiLookup() or MultiInsert(), hashed and grouped by
+    // shard.  Within a group, keys keep their order in the batch.  If
+    // key_hashes is not NULL, it holds the caller's hashes of the keys.
+    class Batch {
+    public:
+        Batch(
+            const ShardedLRUCache* cache, size_t n, const char* const* keys, const size_t* key_lens,
+            const uint64_t* key_hashes = NULL
+        ) : hashes_(n), order_(n) {
+            std::vector<uint64_t> sorted(n);
+            for (size_t i = 0; i < n; i++) {
+                hashes_[i] = ShardHash(key_hashes != NULL ? key_hashes[i] : Hash(keys[i], key_lens[i], 0));
+                sorted[i] = (static_cast<uint64_t>(cache->Shard(hashes_[i])) << 32) | i;
+            }
+            std::sort(sorted.begin(), sorted.end());
+            for (size_t i = 0; i < n; i++) {
+                order_[i] = static_cast<uint32_t>(sorted[i]);
+                if (i == 0 || (sorted[i] >> 32) != (sorted[i - 1] >> 32)) {
+                    starts_.push_back(i);
+                    shards_.push_back(static_cast<uint32_t>(sorted[i] >> 32));
+                }
+            }
+            starts_.push_back(n);
+        }
+        
+        const uint64_t* hashes() const { return hashes_.data(); }
+        
+        size_t Groups() const { return shards_.size(); }
+        uint32_t GroupShard(size_t i) const { return shards_[i]; }
+        uint32_t* Group(size_t i) { return &order_[starts_[i]]; }
+        size_t GroupSize(size_t i) const { return starts_[i + 1] - starts_[i]; }
+        
+    private:
+        std::vector<uint64_t> hashes_;
+        std::vector<uint32_t> order_;   // Batch indexes, by shard
+        std::vector<size_t> starts_;    // Start of each group in order_, then n
+        std::vector<uint32_t> shards_;
+    };
+    
+public:
+    // "replica" is stamped on the entries, for NumaReplicatedCache.
+    explicit ShardedLRUCache(const LRUCacheOptions& options, uint32_t replica = 0)
+      : last_id_(0), capacity_(options.capacity), global_(options.global_capacity),
+        secondary_(options.secondary_cache), stopping_(false) {
+        num_shard_bits_ = options.ShardBits();
+        const size_t num_shards = size_t(1) << num_shard_bits_;
+        const size_t per_shard = PerShard(options.capacity);
+        budget_.capacity.store(options.capacity, std::memory_order_relaxed);
+        budget_.slack.store(per_shard / 64, std::memory_order_relaxed);
+        shard_ = new LRUCacheImpl[num_shards];
+        for (size_t s = 0; s < num_shards; s++) {
+            shard_[s].SetIndexType(options.index_type);
+            shard_[s].SetCapacity(per_shard);
+            if (global_) {
+                shard_[s].SetGlobalBudget(&budget_, num_shards);
+            }
+            shard_[s].SetPolicy(options.policy);
+            shard_[s].SetProtectedRatio(options.protected_ratio);
+            shard_[s].SetAllocator(options.allocator);
+            shard_[s].SetSecondaryCache(options.secondary_cache, options.serializer);
+            shard_[s].SetReplica(replica);
+            if (options.expected_entries > 0) {
+                shard_[s].SetExpectedEntries((options.expected_entries + num_shards - 1) / num_shards);
+            }
+            if (options.lock_free_lookup) {
+                shard_[s].SetLockFreeLookup();
+            }
+            if (options.instrument_locks) {
+                shard_[s].SetInstrumentLocks();
+            }
+            if (options.admission_filter) {
+                shard_[s].SetAdmissionFilter((options.expected_entries + num_shards - 1) / num_shards);
+            }
+        }
+        if (options.reap_interval_millis > 0) {
+            reaper_ = std::thread(&ShardedLRUCache::ReapPeriodically, this, options.reap_interval_millis);
+        }
+    }
+    virtual ~ShardedLRUCache() {
+        if (reaper_.joinable()) {
+            {
+                MutexLock l(&reaper_mutex_);
+                stopping_ = true;
+            }
+            reaper_cv_.notify_one();
+            reaper_.join();
+        }
+        delete[] shard_;
+    }
+    
+    // With a global budget, evict from the shard whose next eviction
+    // candidate is the coldest of up to kEvictionCandidates consecutive
+    // shards, starting at "start", until the budget fits.  When those
+    // have nothing left to evict, move on to the next ones.
+    void EvictOverBudget(uint32_t start) {
+        const size_t num_shards = NumShards();
+        const size_t candidates = std::min(num_shards, kEvictionCandidates);
+        size_t fruitless = 0;
+        while (budget_.Over(num_shards) && fruitless * candidates < num_shards) {
+            const uint32_t now = budget_.clock.load(std::memory_order_relaxed);
+            size_t victim = num_shards;
+            uint32_t oldest = 0;
+            for (size_t i = 0; i < candidates; i++) {
+                const size_t s = (start + i) & (num_shards - 1);
+                const uint64_t tail = shard_[s].Tail();
+                if (tail != LRUCacheImpl::kNoTail && (victim == num_shards || now - uint32_t(tail) > oldest)) {
+                    victim = s;
+                    oldest = now - uint32_t(tail);
+                }
+            }
+            if (victim != num_shards && shard_[victim].EvictExcess(kEvictionBatch) > 0) {
+                fruitless = 0;
+            } else {
+                fruitless++;
+                start += static_cast<uint32_t>(candidates);
+            }
+        }
+    }
+    
+    size_t PerShard(size_t capacity) const {
+        const size_t num_shards = size_t(1) << num_shard_bits_;
+        return (capacity + (num_shards - 1)) / num_shards;
+    }
+    
+    // Forget the secondary cache's copy of a key, which a new value of the
+    // key makes stale.  Called before the value is inserted, so that a copy
+    // spilled by evicting the new value is kept.
+    void ForgetSecondary(const char* key, size_t key_len) {
+        if (secondary_ != NULL) {
+            secondary_->Erase(key, key_len);
+        }
+    }
+    
+    // On a miss, move the key's entry back from the secondary cache, if it
+    // has one.
+    Handle* Promote(const char* key, size_t key_len, uint64_t hash) {
+        Handle* h = shard_[Shard(hash)].PromoteSecondary(key, key_len, hash);
+        FitBudget(hash);
+        return h;
     }
-    virtual void Erase(const char* key) {
-        const uint32_t hash = HashSlice(key);
-        shard_[Shard(hash)].Erase(key, hash);
+    
+    void FitBudget(uint64_t hash) {
+        if (global_ && budget_.Over(NumShards())) {
+            EvictOverBudget(Shard(hash));
+        }
+    }
+    
+    virtual void Delete() {
+        delete this;
+    }
+    
+    using LRUCache::Insert;
+    using LRUCache::Lookup;
+    using LRUCache::Erase;
+    
+    virtual Handle* Insert(
+        const char* key, size_t key_len, void* value, size_t charge,
+        void (*deleter)(const char* key, void* value), Priority priority
+    ) {
+        return Insert(key, key_len, Hash(key, key_len, 0), value, charge, deleter, priority);
+    }
+    virtual Handle* Insert(
+        const char* key, size_t key_len, uint64_t key_hash, void* value, size_t charge,
+        void (*deleter)(const char* key, void* value), Priority priority
+    ) {
+        ForgetSecondary(key, key_len);
+        const uint64_t hash = ShardHash(key_hash);
+        Handle* h = shard_[Shard(hash)].Insert(key, key_len, hash, value, 0, charge, deleter, priority, 0);
+        FitBudget(hash);
+        return h;
+    }
+    virtual Handle* InsertInline(
+        const char* key, size_t key_len, const void* value, size_t value_size, size_t charge,
+        void (*deleter)(const char* key, void* value), Priority priority
+    ) {
+        assert(value_size > 0);
+        ForgetSecondary(key, key_len);
+        const uint64_t hash = ShardHash(Hash(key, key_len, 0));
+        Handle* h = shard_[Shard(hash)].Insert(key, key_len, hash, value, value_size, charge, deleter, priority, 0);
+        FitBudget(hash);
+        return h;
+    }
+    virtual Handle* InsertWithTTL(
+        const char* key, size_t key_len, void* value, size_t charge,
+        void (*deleter)(const char* key, void* value), uint64_t ttl_millis, Priority priority
+    ) {
+        assert(ttl_millis > 0);
+        ForgetSecondary(key, key_len);
+        const uint64_t hash = ShardHash(Hash(key, key_len, 0));
+        Handle* h = shard_[Shard(hash)].Insert(key, key_len, hash, value, 0, charge, deleter, priority,
+                                               NowMillis() + ttl_millis);
+        FitBudget(hash);
+        return h;
+    }
+    virtual Handle* Lookup(const char* key, size_t key_len) {
+        return Lookup(key, key_len, Hash(key, key_len, 0));
+    }
+    virtual Handle* Lookup(const char* key, size_t key_len, uint64_t key_hash) {
+        const uint64_t hash = ShardHash(key_hash);
+        Handle* h = shard_[Shard(hash)].Lookup(key, key_len, hash);
+        if (h == NULL && secondary_ != NULL) {
+            h = Promote(key, key_len, hash);
+        }
+        return h;
+    }
+    virtual Handle* LookupOrCompute(
+        const char* key, size_t key_len,
+        bool (*loader)(const char* key, size_t key_len, void* arg, void** value, size_t* charge),
+        void* arg, void (*deleter)(const char* key, void* value), Priority priority
+    ) {
+        const uint64_t hash = ShardHash(Hash(key, key_len, 0));
+        Handle* h = shard_[Shard(hash)].LookupOrCompute(key, key_len, hash, loader, arg, deleter, priority);
+        FitBudget(hash);
+        return h;
+    }
+    virtual void LookupOrComputeAsync(
+        const char* key, size_t key_len,
+        void (*start)(Load* load, const char* key, size_t key_len, void* arg),
+        void (*done)(Handle* handle, void* arg), void* arg,
+        void (*deleter)(const char* key, void* value), Priority priority
+    ) {
+        const uint64_t hash = ShardHash(Hash(key, key_len, 0));
+        shard_[Shard(hash)].LookupOrComputeAsync(key, key_len, hash, start, done, arg, deleter, priority);
+        FitBudget(hash);  // For a copy moved back from the secondary cache
+    }
+    virtual void FinishLoad(Load* load, bool loaded, void* value, size_t charge) {
+        PendingLoad* p = reinterpret_cast<PendingLoad*>(load);
+        const uint64_t hash = p->hash;  // p may be gone once finished
+        shard_[Shard(hash)].FinishLoad(p, loaded, value, charge, false);
+        FitBudget(hash);
+    }
+    virtual void Release(Handle* handle) {
+        // A released entry that eviction found in use may now be evicted.
+        const uint64_t hash = reinterpret_cast<LRUHandle*>(handle)->hash;
+        shard_[Shard(hash)].Release(handle);
+        FitBudget(hash);
+    }
+    virtual void Erase(const char* key, size_t key_len) {
+        Erase(key, key_len, Hash(key, key_len, 0));
+    }
+    virtual void Erase(const char* key, size_t key_len, uint64_t key_hash) {
+        // The copy goes first, so that a promotion that took it before
+        // is still in progress, and is marked stale, below.
+        ForgetSecondary(key, key_len);
+        const uint64_t hash = ShardHash(key_hash);
+        shard_[Shard(hash)].Erase(key, key_len, hash);
+    }
+    virtual void MultiLookup(size_t n, const char* const* keys, const size_t* key_lens, Handle** handles) {
+        Batch batch(this, n, keys, key_lens);
+        for (size_t i = 0; i < batch.Groups(); i++) {
+            shard_[batch.GroupShard(i)].MultiLookup(
+                batch.Group(i), batch.GroupSize(i), keys, key_lens, batch.hashes(), handles);
+        }
+        for (size_t i = 0; secondary_ != NULL && i < n; i++) {
+            if (handles[i] == NULL) {
+                handles[i] = Promote(keys[i], key_lens[i], batch.hashes()[i]);
+            }
+        }
+    }
+    virtual void MultiInsert(
+        size_t n, const char* const* keys, const size_t* key_lens, void* const* values,
+        const size_t* charges, void (*deleter)(const char* key, void* value),
+        Handle** handles, Priority priority
+    ) {
+        Batch batch(this, n, keys, key_lens);
+        InsertBatch(&batch, keys, key_lens, values, charges, deleter, handles, priority);
+    }
+    virtual void MultiInsert(
+        size_t n, const char* const* keys, const size_t* key_lens, const uint64_t* key_hashes,
+        void* const* values, const size_t* charges, void (*deleter)(const char* key, void* value),
+        Handle** handles, Priority priority
+    ) {
+        Batch batch(this, n, keys, key_lens, key_hashes);
+        InsertBatch(&batch, keys, key_lens, values, charges, deleter, handles, priority);
+    }
+    void InsertBatch(
+        Batch* batch, const char* const* keys, const size_t* key_lens, void* const* values,
+        const size_t* charges, void (*deleter)(const char* key, void* value),
+        Handle** handles, Priority priority
+    ) {
+        for (size_t i = 0; secondary_ != NULL && i < batch->Groups(); i++) {
+            for (size_t j = 0; j < batch->GroupSize(i); j++) {
+                ForgetSecondary(keys[batch->Group(i)[j]], key_lens[batch->Group(i)[j]]);
+            }
+        }
+        for (size_t i = 0; i < batch->Groups(); i++) {
+            shard_[batch->GroupShard(i)].MultiInsert(
+                batch->Group(i), batch->GroupSize(i), keys, key_lens, batch->hashes(), values, charges,
+                deleter, priority, handles);
+        }
+        if (batch->Groups() > 0) {
+            FitBudget(batch->hashes()[0]);
+        }
     }
     virtual void* Value(Handle* handle) {
         return reinterpret_cast<LRUHandle*>(handle)->value;
     }
+    virtual size_t ValueSize(Handle* handle) {
+        return reinterpret_cast<LRUHandle*>(handle)->value_size;
+    }
+    virtual bool SaveSnapshot(const char* path) {
+        const std::string tmp = std::string(path) + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "wb");
+        if (f == NULL) {
+            return false;
+        }
+        SnapshotHeader header;
+        memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+        header.version = kSnapshotVersion;
+        header.unused = 0;
+        header.entries = 0;
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+        
+        // Copy each shard out under its mutex, but write without it.
+        std::string records;
+        for (size_t s = 0; ok && s < NumShards(); s++) {
+            records.clear();
+            header.entries += shard_[s].AppendSnapshot(&records);
+            ok = fwrite(records.data(), 1, records.size(), f) == records.size();
+        }
+        ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+        ok = (fclose(f) == 0) && ok;
+        if (ok && rename(tmp.c_str(), path) == 0) {
+            return true;
+        }
+        remove(tmp.c_str());
+        return false;
+    }
+    virtual bool LoadSnapshot(
+        const char* path, void (*deleter)(const char* key, void* value),
+        void (*missing)(const char* key, size_t key_len, void* arg), void* arg
+    ) {
+        MappedFile file;
+        if (!file.Open(path) || file.size() < sizeof(SnapshotHeader)) {
+            return false;
+        }
+        const SnapshotHeader* header = reinterpret_cast<const SnapshotHeader*>(file.data());
+        if (memcmp(header->magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 ||
+            header->version != kSnapshotVersion ||
+            header->entries > (file.size() - sizeof(SnapshotHeader)) / sizeof(SnapshotRecord)) {
+            return false;
+        }
+        
+        // Check every record before inserting any.
+        std::vector<const SnapshotRecord*> records;
+        std::vector<const char*> keys;
+        std::vector<size_t> key_lens;
+        records.reserve(header->entries);
+        keys.reserve(header->entries);
+        key_lens.reserve(header->entries);
+        size_t pos = sizeof(SnapshotHeader);
+        for (uint64_t i = 0; i < header->entries; i++) {
+            if (file.size() - pos < sizeof(SnapshotRecord)) {
+                return false;
+            }
+            const SnapshotRecord* r = reinterpret_cast<const SnapshotRecord*>(file.data() + pos);
+            const size_t size = SnapshotRecord::Size(r->key_len, r->value_size);
+            if (file.size() - pos < size) {
+                return false;
+            }
+            pos += size;
+            if (r->value_size > 0) {
+                records.push_back(r);
+                keys.push_back(r->key());
+                key_lens.push_back(r->key_len);
+            }
+        }
+        
+        for (size_t i = 0; i < records.size(); i++) {
+            ForgetSecondary(keys[i], key_lens[i]);
+        }
+        Batch batch(this, records.size(), keys.data(), key_lens.data());
+        for (size_t i = 0; i < batch.Groups(); i++) {
+            shard_[batch.GroupShard(i)].LoadSnapshot(
+                batch.Group(i), batch.GroupSize(i), records.data(), batch.hashes(), deleter);
+            FitBudget(batch.hashes()[batch.Group(i)[0]]);
+        }
+        
+        if (missing != NULL) {
+            pos = sizeof(SnapshotHeader);
+            for (uint64_t i = 0; i < header->entries; i++) {
+                const SnapshotRecord* r = reinterpret_cast<const SnapshotRecord*>(file.data() + pos);
+                pos += SnapshotRecord::Size(r->key_len, r->value_size);
+                if (r->value_size == 0) {
+                    (*missing)(r->key(), r->key_len, arg);
+                }
+            }
+        }
+        return true;
+    }
     virtual uint64_t NewId() {
         MutexLock l(&id_mutex_);
         return ++(last_id_);
     }
+    virtual void SetCapacity(size_t capacity) {
+        const size_t num_shards = NumShards();
+        bool shrink;
+        {
+            MutexLock l(&capacity_mutex_);
+            shrink = capacity < capacity_.load(std::memory_order_relaxed);
+            capacity_.store(capacity, std::memory_order_relaxed);
+            const size_t per_shard = PerShard(capacity);
+            if (global_) {
+                budget_.capacity.store(capacity, std::memory_order_relaxed);
+                budget_.slack.store(per_shard / 64, std::memory_order_relaxed);
+            }
+            for (size_t s = 0; s < num_shards; s++) {
+                shard_[s].Resize(per_shard);
+            }
+        }
+        
+        // Shrink a batch at a time, so that inserts into the shard being
+        // shrunk only ever wait for one batch.
+        if (global_) {
+            EvictOverBudget(0);
+        } else {
+            for (size_t s = 0; s < num_shards; s++) {
+                while (shard_[s].EvictExcess(kShrinkBatch) == kShrinkBatch) {
+                }
+            }
+        }
+        if (shrink) {
+            for (size_t s = 0; s < num_shards; s++) {
+                shard_[s].TrimSlab();
+            }
+        }
+    }
+    virtual size_t GetCapacity() {
+        return capacity_.load(std::memory_order_relaxed);
+    }
+    virtual void ReapExpired() {
+        const size_t num_shards = NumShards();
+        for (size_t s = 0; s < num_shards; s++) {
+            while (shard_[s].ReapExpired(kReapBatch) == kReapBatch) {
+            }
+        }
+    }
+    virtual void GetStats(LRUCacheStats* stats) {
+        *stats = LRUCacheStats();
+        AddStats(stats);
+    }
+    virtual size_t NumShards() {
+        return size_t(1) << num_shard_bits_;
+    }
+    virtual void GetShardStats(size_t shard, LRUCacheStats* stats) {
+        *stats = LRUCacheStats();
+        AddShardStats(shard, stats);
+    }
+    
+    // Erase "key" from the shards only, leaving any secondary cache
+    // copy alone; see NumaReplicatedCache.
+    void EraseCached(const char* key, size_t key_len, uint64_t key_hash) {
+        const uint64_t hash = ShardHash(key_hash);
+        shard_[Shard(hash)].Erase(key, key_len, hash);
+    }
+    
+    // Add the counters and usage of all shards, or of one, to *stats.
+    void AddStats(LRUCacheStats* stats) {
+        const size_t num_shards = NumShards();
+        for (size_t s = 0; s < num_shards; s++) {
+            shard_[s].AddStats(stats);
+        }
+    }
+    void AddShardStats(size_t shard, LRUCacheStats* stats) {
+        assert(shard < NumShards());
+        shard_[shard].AddStats(stats);
+    }
+};
+
+#ifdef LRU_CACHE_HAVE_NUMA
+// Further nodes share replicas, so that the capacity is not split too
+// finely on large machines.
+static const size_t kMaxNumaReplicas = 4;
+
+// The numbers in a sysfs list such as "0-3,8-11".  Empty if the file
+// cannot be read.
+static std::vector<int> ReadSysfsList(const char* path) {
+    std::vector<int> ids;
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return ids;
+    }
+    char buf[4096];
+    if (fgets(buf, sizeof(buf), f) != NULL) {
+        for (const char* p = buf; *p != '\0' && *p != '\n'; ) {
+            char* end;
+            const long lo = strtol(p, &end, 10);
+            if (end == p) {
+                break;
+            }
+            long hi = lo;
+            p = end;
+            if (*p == '-') {
+                hi = strtol(p + 1, &end, 10);
+                p = end;
+            }
+            for (long i = lo; i <= hi; i++) {
+                ids.push_back(static_cast<int>(i));
+            }
+            if (*p == ',') {
+                p++;
+            }
+        }
+    }
+    fclose(f);
+    return ids;
+}
+
+// Run "fn" on a thread bound to "cpus", so that the memory it touches
+// first is allocated on their node.  Threads it starts stay bound.
+template <class F>
+static void RunOnCpus(const std::vector<int>& cpus, F fn) {
+    std::thread t([&cpus, &fn] {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t i = 0; i < cpus.size(); i++) {
+            if (cpus[i] < CPU_SETSIZE) {
+                CPU_SET(cpus[i], &set);
+            }
+        }
+        // Best effort: without the binding, only locality suffers.
+        sched_setaffinity(0, sizeof(set), &set);
+        fn();
+    });
+    t.join();
+}
+
+// One ShardedLRUCache per NUMA node, for LRUCacheOptions::numa_replicas.
+// Nodes without CPUs are skipped, and beyond kMaxNumaReplicas nodes share
+// replicas round robin.  Each replica is built on its node, and threads
+// use the replica of the CPU they run on, so that the entries they
+// insert are also first touched, and so allocated, there.  Handles and
+// loads are stamped with their replica and go back to it.  The capacity
+// is split evenly between the replicas, and an insert drops the key from
+// the other replicas before it caches the new value in its own.
+class NumaReplicatedCache: public LRUCache {
+public:
+    explicit NumaReplicatedCache(const LRUCacheOptions& options)
+        : capacity_(options.capacity) {
+        const std::vector<int> nodes = ReadSysfsList("/sys/devices/system/node/online");
+        size_t with_cpus = 0;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes[i]);
+            const std::vector<int> cpus = ReadSysfsList(path);
+            if (cpus.empty()) {
+                continue;
+            }
+            const size_t r = with_cpus++ % kMaxNumaReplicas;
+            if (r == cpus_.size()) {
+                cpus_.push_back(std::vector<int>());
+            }
+            cpus_[r].insert(cpus_[r].end(), cpus.begin(), cpus.end());
+        }
+        if (cpus_.empty()) {
+            cpus_.push_back(std::vector<int>());
+        }
+        replicas_.resize(cpus_.size());
+        LRUCacheOptions replica_options = options;
+        replica_options.capacity = PerReplica(options.capacity);
+        for (size_t r = 0; r < cpus_.size(); r++) {
+            for (size_t i = 0; i < cpus_[r].size(); i++) {
+                const size_t cpu = static_cast<size_t>(cpus_[r][i]);
+                if (cpu >= cpu_replica_.size()) {
+                    cpu_replica_.resize(cpu + 1, 0);
+                }
+                cpu_replica_[cpu] = static_cast<unsigned char>(r);
+            }
+            ShardedLRUCache** replica = &replicas_[r];
+            RunOnCpus(cpus_[r], [replica, &replica_options, r] {
+                *replica = new ShardedLRUCache(replica_options, static_cast<uint32_t>(r));
+            });
+        }
+    }
+    virtual ~NumaReplicatedCache() {
+        for (size_t r = 0; r < replicas_.size(); r++) {
+            delete replicas_[r];
+        }
+    }
+    
+    virtual void Delete() {
+        delete this;
+    }
+    
+    using LRUCache::Insert;
+    using LRUCache::Lookup;
+    using LRUCache::Erase;
+    
+    virtual Handle* Insert(
+        const char* key, size_t key_len, void* value, size_t charge,
+        void (*deleter)(const char* key, void* value), Priority priority
+    ) {
+        return Insert(key, key_len, Hash(key, key_len, 0), value, charge, deleter, priority);
+    }
+    virtual Handle* Insert(
+        const char* key, size_t key_len, uint64_t key_hash, void* value, size_t charge,
+        void (*deleter)(const char* key, void* value), Priority priority
+    ) {
+        ShardedLRUCache* local = Local();
+        EraseOthers(local, key, key_len, key_hash);
+        return local->Insert(key, key_len, key_hash, value, charge, deleter, priority);
+    }
+    virtual Handle* InsertInline(
+        const char* key, size_t key_len, const void* value, size_t value_size, size_t charge,
+        void (*deleter)(const char* key, void* value), Priority priority
+    ) {
+        ShardedLRUCache* local = Local();
+        EraseOthers(local, key, key_len, Hash(key, key_len, 0));
+        return local->InsertInline(key, key_len, value, value_size, charge, deleter, priority);
+    }
+    virtual Handle* InsertWithTTL(
+        const char* key, size_t key_len, void* value, size_t charge,
+        void (*deleter)(const char* key, void* value), uint64_t ttl_millis, Priority priority
+    ) {
+        ShardedLRUCache* local = Local();
+        EraseOthers(local, key, key_len, Hash(key, key_len, 0));
+        return local->InsertWithTTL(key, key_len, value, charge, deleter, ttl_millis, priority);
+    }
+    virtual Handle* Lookup(const char* key, size_t key_len) {
+        return Local()->Lookup(key, key_len);
+    }
+    virtual Handle* Lookup(const char* key, size_t key_len, uint64_t key_hash) {
+        return Local()->Lookup(key, key_len, key_hash);
+    }
+    virtual Handle* LookupOrCompute(
+        const char* key, size_t key_len,
+        bool (*loader)(const char* key, size_t key_len, void* arg, void** value, size_t* charge),
+        void* arg, void (*deleter)(const char* key, void* value), Priority priority
+    ) {
+        return Local()->LookupOrCompute(key, key_len, loader, arg, deleter, priority);
+    }
+    virtual void LookupOrComputeAsync(
+        const char* key, size_t key_len,
+        void (*start)(Load* load, const char* key, size_t key_len, void* arg),
+        void (*done)(Handle* handle, void* arg), void* arg,
+        void (*deleter)(const char* key, void* value), Priority priority
+    ) {
+        Local()->LookupOrComputeAsync(key, key_len, start, done, arg, deleter, priority);
+    }
+    virtual void FinishLoad(Load* load, bool loaded, void* value, size_t charge) {
+        const uint32_t r = reinterpret_cast<PendingLoad*>(load)->replica;
+        replicas_[r]->FinishLoad(load, loaded, value, charge);
+    }
+    virtual void Release(Handle* handle) {
+        replicas_[reinterpret_cast<LRUHandle*>(handle)->replica]->Release(handle);
+    }
+    virtual void* Value(Handle* handle) {
+        return reinterpret_cast<LRUHandle*>(handle)->value;
+    }
+    virtual size_t ValueSize(Handle* handle) {
+        return reinterpret_cast<LRUHandle*>(handle)->value_size;
+    }
+    virtual void Erase(const char* key, size_t key_len) {
+        Erase(key, key_len, Hash(key, key_len, 0));
+    }
+    virtual void Erase(const char* key, size_t key_len, uint64_t key_hash) {
+        for (size_t r = 0; r < replicas_.size(); r++) {
+            replicas_[r]->Erase(key, key_len, key_hash);
+        }
+    }
+    virtual void MultiLookup(size_t n, const char* const* keys, const size_t* key_lens, Handle** handles) {
+        Local()->MultiLookup(n, keys, key_lens, handles);
+    }
+    virtual void MultiInsert(
+        size_t n, const char* const* keys, const size_t* key_lens, void* const* values,
+        const size_t* charges, void (*deleter)(const char* key, void* value),
+        Handle** handles, Priority priority
+    ) {
+        std::vector<uint64_t> key_hashes(n);
+        for (size_t i = 0; i < n; i++) {
+            key_hashes[i] = Hash(keys[i], key_lens[i], 0);
+        }
+        MultiInsert(n, keys, key_lens, key_hashes.data(), values, charges, deleter, handles, priority);
+    }
+    virtual void MultiInsert(
+        size_t n, const char* const* keys, const size_t* key_lens, const uint64_t* key_hashes,
+        void* const* values, const size_t* charges, void (*deleter)(const char* key, void* value),
+        Handle** handles, Priority priority
+    ) {
+        ShardedLRUCache* local = Local();
+        for (size_t i = 0; i < n; i++) {
+            EraseOthers(local, keys[i], key_lens[i], key_hashes[i]);
+        }
+        local->MultiInsert(n, keys, key_lens, key_hashes, values, charges, deleter, handles, priority);
+    }
+    virtual bool SaveSnapshot(const char* path) {
+        return Local()->SaveSnapshot(path);
+    }
+    
+    // Each replica loads on its own node; only the first reports the
+    // missing keys.
+    virtual bool LoadSnapshot(
+        const char* path, void (*deleter)(const char* key, void* value),
+        void (*missing)(const char* key, size_t key_len, void* arg), void* arg
+    ) {
+        bool ok = true;
+        for (size_t r = 0; ok && r < replicas_.size(); r++) {
+            ShardedLRUCache* replica = replicas_[r];
+            RunOnCpus(cpus_[r], [&] {
+                ok = replica->LoadSnapshot(path, deleter, r == 0 ? missing : NULL, arg);
+            });
+        }
+        return ok;
+    }
+    virtual uint64_t NewId() {
+        return replicas_[0]->NewId();
+    }
+    virtual void SetCapacity(size_t capacity) {
+        MutexLock l(&capacity_mutex_);
+        capacity_.store(capacity, std::memory_order_relaxed);
+        for (size_t r = 0; r < replicas_.size(); r++) {
+            replicas_[r]->SetCapacity(PerReplica(capacity));
+        }
+    }
+    virtual size_t GetCapacity() {
+        return capacity_.load(std::memory_order_relaxed);
+    }
+    virtual void ReapExpired() {
+        for (size_t r = 0; r < replicas_.size(); r++) {
+            replicas_[r]->ReapExpired();
+        }
+    }
+    virtual void GetStats(LRUCacheStats* stats) {
+        *stats = LRUCacheStats();
+        for (size_t r = 0; r < replicas_.size(); r++) {
+            replicas_[r]->AddStats(stats);
+        }
+    }
+    virtual size_t NumShards() {
+        return replicas_[0]->NumShards();
+    }
+    virtual void GetShardStats(size_t shard, LRUCacheStats* stats) {
+        *stats = LRUCacheStats();
+        for (size_t r = 0; r < replicas_.size(); r++) {
+            replicas_[r]->AddShardStats(shard, stats);
+        }
+    }
+    
+private:
+    size_t PerReplica(size_t capacity) const {
+        const size_t n = cpus_.size();
+        return (capacity + (n - 1)) / n;
+    }
+    
+    // Drop "key" from the replicas other than "local", so that no node
+    // serves an older value once an insert of it returns.  The secondary
+    // cache, which the replicas share, is left to the insert itself.
+    void EraseOthers(ShardedLRUCache* local, const char* key, size_t key_len, uint64_t key_hash) {
+        for (size_t r = 0; r < replicas_.size(); r++) {
+            if (replicas_[r] != local) {
+                replicas_[r]->EraseCached(key, key_len, key_hash);
+            }
+        }
+    }
+    
+    // The replica of the CPU the calling thread runs on.
+    ShardedLRUCache* Local() {
+        if (replicas_.size() == 1) {
+            return replicas_[0];
+        }
+        const int cpu = sched_getcpu();
+        const size_t r = (cpu >= 0 && static_cast<size_t>(cpu) < cpu_replica_.size()) ? cpu_replica_[cpu] : 0;
+        return replicas_[r];
+    }
+    
+    // SetCapacity() calls hold capacity_mutex_ while resizing the
+    // replicas.  capacity_ is the total of theirs.
+    std::mutex capacity_mutex_;
+    std::atomic<size_t> capacity_;
+    std::vector<ShardedLRUCache*> replicas_;
+    std::vector<std::vector<int> > cpus_;       // Of each replica's nodes
+    std::vector<unsigned char> cpu_replica_;    // Indexed by CPU number
 };
+#endif
 
 }  // end anonymous namespace
 
+LRUSecondaryCache* LRUSecondaryCache::NewLogFile(const char* path, size_t capacity) {
+#ifdef LRU_CACHE_HAVE_POSIX
+    size_t segments = capacity / LogSecondaryCache::kLogSegmentSize;
+    if (segments < LogSecondaryCache::kMinSegments) {
+        segments = LogSecondaryCache::kMinSegments;
+    }
+    const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    return new LogSecondaryCache(fd, segments);
+#else
+    return NULL;
+#endif
+}
+
+uint64_t LRUCache::HashKey(const char* key, size_t key_len) {
+    return Hash(key, key_len, 0);
+}
+
 LRUCache* LRUCache::New(size_t capacity) {
-    return new ShardedLRUCache(capacity);
+    LRUCacheOptions options;
+    options.capacity = capacity;
+    return New(options);
+}
+
+LRUCache* LRUCache::New(const LRUCacheOptions& options) {
+#ifdef LRU_CACHE_HAVE_NUMA
+    if (options.numa_replicas) {
+        return new NumaReplicatedCache(options);
+    }
+#endif
+    return new ShardedLRUCache(options);
 }
@@ -11,9 +11,11 @@
 // the string.
 //
 // A builtin cache implementation with a least-recently-used eviction
-// policy is provided.  Clients may use their own implementations if
-// they want something more sophisticated (like scan-resistance, a
-// custom eviction policy, variable cache sizing, etc.)
+// policy is provided, along with a CLOCK (second-chance) variant that
+// is cheaper on hits and a scan-resistant segmented LRU.  Clients may
+// use their own implementations if they want something more
+// sophisticated (like a custom eviction policy, variable cache sizing,
+// etc.)
 
 #pragma once
 
@@ -22,12 +24,347 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <thread>
+
+// Allocator for the cache's per-entry bookkeeping (the entry header and
+// its copy of the key).  Values are owned by the client and never pass
+// through it.  Must be safe to call from multiple threads at once.
+struct LRUCacheAllocator {
+    virtual ~LRUCacheAllocator() { }
+    
+    virtual void* Allocate(size_t size) = 0;
+    
+    // "size" is the value that was passed to the matching Allocate().
+    virtual void Deallocate(void* ptr, size_t size) = 0;
+};
+
+// A slower tier, such as a local SSD, that an LRUCache copies evicted
+// entries to and looks up keys it misses in.  Entries with a TTL are
+// never copied.  Inline values (see LRUCache::InsertInline()) without a
+// deleter are copied as they are, since those are plain bytes; other
+// values only through an LRUCacheSerializer.  Must be safe to call from
+// multiple threads at once; the cache calls it without internal locks
+// held.  Erase() and every insert of a key also remove it from this
+// tier, before the new value is cached, so that a copy is never older
+// than what the cache holds.  An eviction of the key spilling at the same
+// moment may still write a copy back, so it suits immutable values such
+// as file blocks best.
+struct LRUSecondaryCache {
+    virtual ~LRUSecondaryCache() { }
+    
+    // Keep a copy of key -> value[0,value_size) with its charge,
+    // replacing any older copy.  May drop it instead, e.g. when full.
+    virtual void Insert(const char* key, size_t key_len, const void* value, size_t value_size, size_t charge) = 0;
+    
+    // If there is a copy for key[0,key_len), move it out to *value and
+    // *charge and return true.
+    virtual bool Take(const char* key, size_t key_len, std::string* value, size_t* charge) = 0;
+    
+    virtual void Erase(const char* key, size_t key_len) = 0;
+    
+    // Return a secondary cache of about "capacity" bytes kept in a file
+    // at "path", which is created or truncated.  Insert() and Erase()
+    // hand their work to a background thread through a lock-free queue.
+    // It appends copies to 1 MB segments in memory and writes each full
+    // segment with a single write; once the file is full the oldest
+    // segment is reused.  So the cache's latency does not depend on the
+    // device, and copies made faster than it can write are dropped.
+    // Returns NULL if the file cannot be opened, or if the platform has
+    // no pread()/pwrite().
+    static LRUSecondaryCache* NewLogFile(const char* path, size_t capacity);
+};
+
+// Turns values that are not plain bytes, such as objects with a deleter,
+// into bytes an LRUSecondaryCache can hold, and back.  Must be safe to
+// call from multiple threads at once; the cache calls it without internal
+// locks held.  With a serializer, the cache ends each copy it hands to
+// the secondary cache with a byte of its own, telling plain bytes from
+// serialized values.
+struct LRUCacheSerializer {
+    virtual ~LRUCacheSerializer() { }
+    
+    // Append the bytes of an evicted entry's value to *out and return
+    // true, or return false to not copy it.  "deleter" is the one the
+    // value was inserted with; it is called on the value afterwards.
+    virtual bool Serialize(
+        const char* key, size_t key_len, void* value, void (*deleter)(const char* key, void* value),
+        std::string* out
+    ) = 0;
+    
+    // Rebuild a value from data[0,size), as written by Serialize(), into
+    // *value, and set *deleter to the deleter to cache it with.  Return
+    // false if it cannot be rebuilt; the copy is then dropped.
+    virtual bool Deserialize(
+        const char* key, size_t key_len, const char* data, size_t size, void** value,
+        void (**deleter)(const char* key, void* value)
+    ) = 0;
+};
+
+// Eviction policy used within each shard of the cache.
+enum LRUCachePolicy {
+    // Strict least-recently-used: every hit moves the entry to the head
+    // of the LRU list.
+    kLRUPolicy = 0,
+    
+    // CLOCK: a hit only sets the entry's reference bit.  The eviction
+    // sweep gives referenced entries a second chance and evicts the
+    // first one found unreferenced, approximating LRU at a fraction of
+    // the per-hit cost.
+    kClockPolicy = 1,
+    
+    // Segmented LRU: new entries enter a probation segment and move to a
+    // protected segment on their first hit.  Entries pushed out of the
+    // protected segment go back to probation instead of being evicted,
+    // so a scan of once-read entries cannot flush the hot set.
+    kSegmentedLRUPolicy = 2
+};
+
+// Hash index used within each shard of the cache.
+enum LRUCacheIndexType {
+    // Buckets of chained entries.  Compact when the cache is small.
+    kChainedIndex = 0,
+    
+    // Open addressing with a byte of hash per slot, compared eight slots
+    // at a time.  Misses rarely touch an entry and hits touch one, at the
+    // cost of a larger index.
+    kOpenAddressingIndex = 1
+};
+
+// Options to control the behavior of a cache created by LRUCache::New().
+struct LRUCacheOptions {
+    // Total charge the cache may hold before it starts evicting.  Entries
+    // referenced by outstanding handles are not evicted, so pinning more
+    // than this lets usage exceed it until the handles are released.
+    size_t capacity;
+    
+    // The cache is split into 2^num_shard_bits shards, each with its own
+    // mutex and an equal share of the capacity.  More shards reduce lock
+    // contention; fewer shards make small caches round capacity less and
+    // evict closer to a global LRU order.  A negative value picks a
+    // default from the number of hardware threads.  At most
+    // kMaxNumShardBits; see ShardBits().
+    //
+    // Default: -1
+    int num_shard_bits;
+    static const int kMaxNumShardBits = 20;
+    
+    // If true, capacity bounds the shards' total usage instead of being
+    // split evenly between them, so that a shard hit by more keys than
+    // its share may grow while others have room.  An insert that takes
+    // the cache over capacity evicts from whichever of a few sampled
+    // shards has the coldest eviction candidate.  Shards reserve usage in
+    // small chunks, so total usage may exceed capacity by about 1/64.
+    //
+    // Default: false
+    bool global_capacity;
+    
+    // Default: kLRUPolicy
+    LRUCachePolicy policy;
+    
+    // Fraction of each shard's capacity the protected segment may hold
+    // under kSegmentedLRUPolicy.  Ignored by the other policies.
+    //
+    // Default: 0.8
+    double protected_ratio;
+    
+    // If true, Lookup() hits are served from a concurrently readable
+    // hash table without taking the shard mutex, and Release() only takes
+    // it when the last reference to an already evicted entry goes away,
+    // or the last client reference to an entry eviction found in use.
+    // Hits then record recency with a per-entry reference bit, and the
+    // entry is moved to the head of the LRU list by the next eviction
+    // sweep instead of on every hit.  Misses and all writes still lock.
+    //
+    // Default: false
+    bool lock_free_lookup;
+    
+    // Default: kChainedIndex
+    LRUCacheIndexType index_type;
+    
+    // If not 0, each shard's hash index is sized up front for its share
+    // of this many entries, e.g. capacity divided by the average charge,
+    // and is never shrunk below that.  This saves the resizes an index
+    // goes through as it grows from empty.
+    //
+    // Default: 0
+    size_t expected_entries;
+    
+    // If true, each shard times its mutex and the deleters it runs, as
+    // reported by LRUCacheStats.  Costs a few clock reads per operation.
+    //
+    // Default: false
+    bool instrument_locks;
+    
+    // If non-NULL, used for all per-entry allocations; it must outlive
+    // the cache.  If NULL, each shard recycles entries through its own
+    // size-class slab, so that inserts and evictions in steady state do
+    // not allocate.  Slab memory is returned when the cache is deleted,
+    // and slab chunks left without live entries are returned when
+    // SetCapacity() lowers the capacity.
+    //
+    // Default: NULL
+    LRUCacheAllocator* allocator;
+    
+    // If non-NULL, evicted entries it can hold are copied to it, and
+    // Lookup(), MultiLookup() and LookupOrCompute() misses are looked up
+    // in it and moved back into the cache; see LRUSecondaryCache.  It
+    // must outlive the cache.
+    //
+    // Default: NULL
+    LRUSecondaryCache* secondary_cache;
+    
+    // If non-NULL, evicted values that are not plain bytes are copied to
+    // secondary_cache through it.  It must outlive the cache.
+    //
+    // Default: NULL
+    LRUCacheSerializer* serializer;
+    
+    // If not 0, a background thread calls ReapExpired() this often, so
+    // that expired entries give back their charge even if they are never
+    // looked up again.  Otherwise they are only reaped by lookups of
+    // them, by inserts into their shard, and by ReapExpired().
+    //
+    // Default: 0
+    uint32_t reap_interval_millis;
+    
+    // If true, a new entry that would make its shard evict is only cached
+    // if its key has been looked up or inserted more often of late than
+    // the key of the entry eviction would start with.  Otherwise Insert()
+    // returns a handle to an entry that is not in the cache, so that keys
+    // seen once do not push out popular ones.  Replacing a cached key is
+    // always admitted.  Frequencies are kept in a count-min sketch in each
+    // shard, of about 9 bytes per entry, and are halved periodically.
+    // Ignored with global_capacity.  Under lock_free_lookup, lock-free
+    // hits are counted at most once per eviction sweep.
+    //
+    // Default: false
+    bool admission_filter;
+    
+    // If true, on Linux the cache keeps a replica for each NUMA node with
+    // CPUs (up to four; further nodes share them), built in that node's
+    // memory.  Threads look up and insert in the replica of the node they
+    // run on, so that the entries they insert are allocated there too.
+    // "capacity" is split evenly between the replicas.  An entry inserted
+    // on one node is not seen by the others, so this suits read-mostly
+    // data that any node can load; inserting a key drops it from the
+    // other replicas first, so none keeps serving an older value.
+    // Erase(), SetCapacity(), ReapExpired() and LoadSnapshot() apply to
+    // every replica; SaveSnapshot() saves the calling thread's.  Ignored
+    // on other platforms.
+    //
+    // Default: false
+    bool numa_replicas;
+    
+    LRUCacheOptions()
+        : capacity(0), num_shard_bits(-1), global_capacity(false), policy(kLRUPolicy), protected_ratio(0.8),
+          lock_free_lookup(false), index_type(kChainedIndex), expected_entries(0), instrument_locks(false),
+          allocator(NULL), secondary_cache(NULL), serializer(NULL), reap_interval_millis(0), admission_filter(false),
+          numa_replicas(false) { }
+    
+    // The number of shard bits a cache built from these options uses:
+    // num_shard_bits, at most kMaxNumShardBits, or if it is negative,
+    // enough shards that two threads per core rarely meet on one mutex.
+    // TypedLRUCache shards by the same rule.
+    int ShardBits() const {
+        if (num_shard_bits >= 0) {
+            return num_shard_bits < kMaxNumShardBits ? num_shard_bits : kMaxNumShardBits;
+        }
+        const unsigned threads = std::thread::hardware_concurrency();
+        if (threads == 0) {
+            return 4;
+        }
+        int bits = 0;
+        while (bits < kMaxNumShardBits && (1u << bits) < 2 * threads) {
+            bits++;
+        }
+        return bits;
+    }
+};
+
+// Counters and usage reported by LRUCache::GetStats().  Counters are
+// totals since the cache was created.  Each shard is read separately, so
+// under concurrent use the figures are not one consistent snapshot.
+struct LRUCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    
+    // Entries pushed out for capacity; replaced and erased entries are
+    // not counted.
+    uint64_t evictions;
+    
+    // Erase() calls that found the key.
+    uint64_t erases;
+    
+    // Entries removed because their TTL ran out.
+    uint64_t expirations;
+    
+    // Inserts turned away by LRUCacheOptions::admission_filter.
+    uint64_t rejections;
+    
+    // Total charge of live entries, including ones already evicted or
+    // erased but still referenced by a handle.
+    size_t usage;
+    
+    // The part of usage held by outstanding handles, which eviction
+    // cannot reclaim.
+    size_t pinned_usage;
+    
+    // Entries in the cache, and slots in the shards' hash indexes.
+    size_t entries;
+    size_t table_slots;
+    
+    // Hash index resizes, growing or shrinking.
+    uint64_t table_resizes;
+    
+    // Bytes the shards' slabs hold for entries, in use or free.  0 with
+    // a client LRUCacheOptions::allocator.
+    size_t slab_bytes;
+    
+    // Shard mutex timings, only kept if LRUCacheOptions::instrument_locks
+    // is set.  An acquisition is contended if the mutex was held by
+    // another thread; waits are only timed for those.  Hold time covers
+    // everything done under the mutex, such as eviction sweeps.  Deleters
+    // run outside the mutex and are timed separately.
+    uint64_t lock_acquisitions;
+    uint64_t lock_contended;
+    uint64_t lock_wait_nanos;
+    uint64_t lock_hold_nanos;
+    uint64_t deleter_nanos;
+    
+    LRUCacheStats()
+        : hits(0), misses(0), inserts(0), evictions(0), erases(0), expirations(0), rejections(0), usage(0),
+          pinned_usage(0), entries(0), table_slots(0), table_resizes(0), slab_bytes(0),
+          lock_acquisitions(0), lock_contended(0), lock_wait_nanos(0),
+          lock_hold_nanos(0), deleter_nanos(0) { }
+    
+    double HitRatio() const {
+        return hits + misses > 0 ? double(hits) / double(hits + misses) : 0;
+    }
+    double LoadFactor() const {
+        return table_slots > 0 ? double(entries) / double(table_slots) : 0;
+    }
+};
 
 struct LRUCache {
     // Create a new cache with a fixed size capacity.  This implementation
     // of Cache uses a least-recently-used eviction policy.
     static LRUCache* New(size_t capacity);
     
+    // Create a new cache configured by "options".
+    static LRUCache* New(const LRUCacheOptions& options);
+    
+    // The 64-bit hash of key[0,key_len) used by the methods that do not
+    // take one.  Callers that use a key several times can hash it once and
+    // pass the result to the overloads that take a "hash".  Those accept
+    // any well-mixed 64-bit hash instead, provided a key is always given
+    // the same hash; a key passed both with and without a hash must be
+    // given HashKey()'s.
+    static uint64_t HashKey(const char* key, size_t key_len);
+    
     // Destroys all existing entries by calling the "deleter"
     // function that was passed to the constructor.
     virtual void Delete() = 0;
@@ -35,6 +372,21 @@ struct LRUCache {
     // Opaque handle to an entry stored in the cache.
     struct Handle { };
     
+    // Opaque handle to a load started by LookupOrComputeAsync().
+    struct Load { };
+    
+    // Where Insert() places a new entry in the eviction order.
+    enum Priority {
+        // Insert as the most recently used entry.
+        kNormalPriority = 0,
+        
+        // Insert as the next eviction candidate, e.g. for blocks read by
+        // a scan.  A hit moves it to the most recently used position but,
+        // under kSegmentedLRUPolicy, not into the protected segment, so a
+        // single re-read during the scan cannot pollute the hot set.
+        kLowPriority = 1
+    };
+    
     // Insert a mapping from key->value into the cache and assign it
     // the specified charge against the total cache capacity.
     //
@@ -43,18 +395,124 @@ struct LRUCache {
     // longer needed.
     //
     // When the inserted entry is no longer needed, the key and
-    // value will be passed to "deleter".
+    // value will be passed to "deleter".  The key passed to "deleter"
+    // is the cache's own copy of key[0,key_len), followed by a NUL.
+    // Deleters are called without any internal lock held, so they may
+    // be slow or use the cache themselves.
+    //
+    // Keys are arbitrary byte strings and may contain embedded zeros.
+    //
+    // With LRUCacheOptions::admission_filter, the mapping may be turned
+    // away; the handle is still valid, but Lookup() will not find it.
     virtual Handle* Insert(
+        const char* key, size_t key_len, void* value, size_t charge,
+        void (*deleter)(const char* key, void* value),
+        Priority priority = kNormalPriority
+    ) = 0;
+    
+    // Same as above, with a caller-supplied hash of the key; see HashKey().
+    virtual Handle* Insert(
+        const char* key, size_t key_len, uint64_t hash, void* value, size_t charge,
+        void (*deleter)(const char* key, void* value),
+        Priority priority = kNormalPriority
+    ) = 0;
+    
+    // Same as above, but "key" is a NUL-terminated string.
+    Handle* Insert(
         const char* key, void* value, size_t charge,
-        void (*deleter)(const char* key, void* value)
+        void (*deleter)(const char* key, void* value),
+        Priority priority = kNormalPriority
+    ) {
+        return Insert(key, strlen(key), value, charge, deleter, priority);
+    }
+    
+    // Like Insert(), but the value is a copy of value[0,value_size) kept in
+    // the entry itself, so that a small value costs no allocation of its
+    // own and no pointer chase after Value().  Value() returns the cache's
+    // copy, aligned to 8 bytes, which stays valid while the handle is
+    // held; concurrent readers may share it.  If "deleter" is not NULL it
+    // is called with the copy before the entry is freed, e.g. to run a
+    // destructor.
+    // REQUIRES: value_size > 0.
+    virtual Handle* InsertInline(
+        const char* key, size_t key_len, const void* value, size_t value_size, size_t charge,
+        void (*deleter)(const char* key, void* value) = NULL,
+        Priority priority = kNormalPriority
+    ) = 0;
+    
+    // Like Insert(), but the mapping expires ttl_millis milliseconds from
+    // now: later lookups miss, and it is removed as if erased, though not
+    // counted as one, by the next lookup of the key or a reaping pass.
+    // Expired entries are reaped in steps of 16 milliseconds, so one may
+    // hold its charge that much longer, and in a cache without
+    // reap_interval_millis until its shard is next written to.
+    // REQUIRES: ttl_millis > 0.
+    virtual Handle* InsertWithTTL(
+        const char* key, size_t key_len, void* value, size_t charge,
+        void (*deleter)(const char* key, void* value), uint64_t ttl_millis,
+        Priority priority = kNormalPriority
     ) = 0;
     
-    // If the cache has no mapping for "key", returns NULL.
+    // If the cache has no mapping for key[0,key_len), returns NULL.
     //
     // Else return a handle that corresponds to the mapping.  The caller
     // must call this->Release(handle) when the returned mapping is no
     // longer needed.
-    virtual Handle* Lookup(const char* key) = 0;
+    virtual Handle* Lookup(const char* key, size_t key_len) = 0;
+    
+    // Same as above, with a caller-supplied hash of the key; see HashKey().
+    virtual Handle* Lookup(const char* key, size_t key_len, uint64_t hash) = 0;
+    
+    // Same as above, but "key" is a NUL-terminated string.
+    Handle* Lookup(const char* key) {
+        return Lookup(key, strlen(key));
+    }
+    
+    // Like Lookup(), but on a miss calls loader(key, key_len, arg, &value,
+    // &charge) and inserts the value it returns as Insert() would.  Only
+    // one caller at a time loads a given key: concurrent callers missing
+    // on it wait for that load and share its result, rather than loading
+    // the key again.  The loader is called without any internal lock
+    // held.  If it returns false, nothing is inserted, and this call and
+    // those waiting on it return NULL.  A copy of the key in the
+    // secondary cache is moved back instead of calling the loader, or
+    // "start" below.  If the key is erased or inserted
+    // while it loads, the loaded value is still returned to this call
+    // and those waiting on it, but not cached, so as not to replace the
+    // newer state.  The same holds for FinishLoad().
+    // REQUIRES: loader must not throw, nor call LookupOrCompute() for a
+    // key it is itself loading.
+    virtual Handle* LookupOrCompute(
+        const char* key, size_t key_len,
+        bool (*loader)(const char* key, size_t key_len, void* arg, void** value, size_t* charge),
+        void* arg, void (*deleter)(const char* key, void* value),
+        Priority priority = kNormalPriority
+    ) = 0;
+    
+    // Non-blocking LookupOrCompute(), for callers that must not wait on
+    // another thread's load, such as event loops.  Calls done(handle, arg)
+    // once the entry is available: right away on a hit, or else from the
+    // thread that finishes the load, with no internal lock held.  The
+    // handle must be released as usual, and is NULL if the load failed.
+    //
+    // On a miss that no load in progress covers, start(load, key,
+    // key_len, arg) is called to begin one, e.g. by issuing an
+    // asynchronous read, and FinishLoad() must then be called on "load"
+    // exactly once, from any thread.  Blocking and asynchronous callers
+    // missing on the same key share one load.
+    virtual void LookupOrComputeAsync(
+        const char* key, size_t key_len,
+        void (*start)(Load* load, const char* key, size_t key_len, void* arg),
+        void (*done)(Handle* handle, void* arg), void* arg,
+        void (*deleter)(const char* key, void* value),
+        Priority priority = kNormalPriority
+    ) = 0;
+    
+    // Complete a load passed to a LookupOrComputeAsync() "start" callback.
+    // If "loaded" is true, inserts value with the given charge as Insert()
+    // would.  Then wakes or calls back everyone waiting on the load,
+    // before returning.
+    virtual void FinishLoad(Load* load, bool loaded, void* value, size_t charge) = 0;
     
     // Release a mapping returned by a previous Lookup().
     // REQUIRES: handle must not have been released yet.
@@ -67,10 +525,112 @@ struct LRUCache {
     // REQUIRES: handle must have been returned by a method on *this.
     virtual void* Value(Handle* handle) = 0;
     
-    // If the cache contains entry for key, erase it.  Note that the
-    // underlying entry will be kept around until all existing handles
+    // Return the size of an inline value, or 0 if the handle's value was
+    // inserted with Insert().
+    // REQUIRES: handle must not have been released yet.
+    // REQUIRES: handle must have been returned by a method on *this.
+    virtual size_t ValueSize(Handle* handle) = 0;
+    
+    // Look up key[0,key_len) and copy its inline value out to
+    // buf[0,size).  Returns false if the key is missing, or its value is
+    // not an inline value of exactly "size" bytes.
+    bool LookupCopy(const char* key, size_t key_len, void* buf, size_t size) {
+        Handle* handle = Lookup(key, key_len);
+        if (handle == NULL) {
+            return false;
+        }
+        const bool ok = (ValueSize(handle) == size);
+        if (ok) {
+            memcpy(buf, Value(handle), size);
+        }
+        Release(handle);
+        return ok;
+    }
+    
+    // If the cache contains entry for key[0,key_len), erase it.  Note that
+    // the underlying entry will be kept around until all existing handles
     // to it have been released.
-    virtual void Erase(const char* key) = 0;
+    virtual void Erase(const char* key, size_t key_len) = 0;
+    
+    // Same as above, with a caller-supplied hash of the key; see HashKey().
+    virtual void Erase(const char* key, size_t key_len, uint64_t hash) = 0;
+    
+    // Same as above, but "key" is a NUL-terminated string.
+    void Erase(const char* key) {
+        Erase(key, strlen(key));
+    }
+    
+    // Batched Lookup(): handles[i] is set as Lookup(keys[i], key_lens[i])
+    // would, for i in [0,n).  The keys are grouped by shard first, so each
+    // shard's mutex is taken once per batch rather than once per key.
+    virtual void MultiLookup(
+        size_t n, const char* const* keys, const size_t* key_lens, Handle** handles
+    ) = 0;
+    
+    // Batched Insert() of keys[i]->values[i] with charges[i], all with the
+    // same deleter and priority.  Returns the handles in handles[i], or,
+    // if handles is NULL, releases them.  Duplicate keys in a batch are
+    // inserted in batch order, so the last one wins.  Each shard's mutex is
+    // taken once per batch, and while the shard is below capacity its
+    // index is grown once for the batch, so this is also the fast way to
+    // populate a new cache.
+    virtual void MultiInsert(
+        size_t n, const char* const* keys, const size_t* key_lens, void* const* values,
+        const size_t* charges, void (*deleter)(const char* key, void* value),
+        Handle** handles, Priority priority = kNormalPriority
+    ) = 0;
+    
+    // Same as above, with caller-supplied hashes of the keys; see HashKey().
+    virtual void MultiInsert(
+        size_t n, const char* const* keys, const size_t* key_lens, const uint64_t* hashes,
+        void* const* values, const size_t* charges, void (*deleter)(const char* key, void* value),
+        Handle** handles, Priority priority = kNormalPriority
+    ) = 0;
+    
+    // Change the capacity, split across the shards as LRUCache::New()
+    // does.  When shrinking, entries are evicted down to the new capacity
+    // before this returns, a few at a time so that no shard is locked for
+    // long; entries referenced by handles stay until they are released.
+    virtual void SetCapacity(size_t capacity) = 0;
+    virtual size_t GetCapacity() = 0;
+    
+    // Write the cache's entries to "path", replacing it, so that a later
+    // cache can be warmed with LoadSnapshot(), e.g. after a restart.  Inline
+    // values (see InsertInline()) are saved with their keys; other values
+    // cannot be, so only their keys are.  Each shard's entries are saved
+    // from its coldest to its hottest, and remaining TTLs are kept.  Each
+    // shard is locked only while its entries are copied out.  Returns false
+    // if the file could not be written.
+    virtual bool SaveSnapshot(const char* path) = 0;
+    
+    // Insert the inline entries of a snapshot written by SaveSnapshot(),
+    // coldest first and with "deleter" as InsertInline() would, so that
+    // the hottest are the ones kept if they do not all fit.  If "missing"
+    // is not NULL, missing(key, key_len, arg) is called for each key saved
+    // without a value, e.g. to reload it with LookupOrComputeAsync().  The
+    // file is mapped rather than read where possible, each shard's index
+    // is sized for its share up front, and entries are inserted in
+    // batches per acquisition of the shard mutex.  Snapshots are in host
+    // byte order.  Returns false if the file is missing or not a valid
+    // snapshot, in which case nothing is inserted.
+    virtual bool LoadSnapshot(
+        const char* path, void (*deleter)(const char* key, void* value) = NULL,
+        void (*missing)(const char* key, size_t key_len, void* arg) = NULL, void* arg = NULL
+    ) = 0;
+    
+    // Remove every expired entry.  Locks each shard a few times, for a
+    // bounded batch each time.
+    virtual void ReapExpired() = 0;
+    
+    // Report the cache's counters and usage.  Takes each shard's mutex
+    // in turn, so it is meant for periodic monitoring rather than the
+    // request path.
+    virtual void GetStats(LRUCacheStats* stats) = 0;
+    
+    // The same for a single shard, to spot hot shards.
+    // REQUIRES: shard < NumShards().
+    virtual size_t NumShards() = 0;
+    virtual void GetShardStats(size_t shard, LRUCacheStats* stats) = 0;
     
     // Return a new numeric id.  May be used by multiple clients who are
     // sharing the same cache to partition the key space.  Typically the
@@ -0,0 +1,498 @@
+// Copyright 2016 <chaishushan{AT}gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// Benchmarks for LRUCache.  Run with `lru-cache-test -test.bench=.*`.
+//
+// Each benchmark reports ns per cache operation; workloads that can miss
+// also report the hit ratio of their final run.
+
+#include "test.h"
+#include "cache.h"
+#include "typed_cache.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <vector>
+
+static void NoopDeleter(const char* /*key*/, void* /*value*/) { }
+
+// Deterministic xorshift generator, so that runs are comparable.
+class Random {
+public:
+    explicit Random(uint64_t seed) : x_(seed | 1) { }
+    uint64_t Next() {
+        x_ ^= x_ << 13;
+        x_ ^= x_ >> 7;
+        x_ ^= x_ << 17;
+        return x_;
+    }
+    // Uniform in [0, 1).
+    double NextDouble() {
+        return (Next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+private:
+    uint64_t x_;
+};
+
+// Zipfian distribution over [0, n) with skew theta, from Gray et al.,
+// "Quickly Generating Billion-Record Synthetic Databases".  Low indexes
+// are the hot ones.
+class ZipfianGenerator {
+public:
+    ZipfianGenerator(uint32_t n, double theta) : n_(n), theta_(theta) {
+        zetan_ = Zeta(n, theta);
+        alpha_ = 1.0 / (1.0 - theta);
+        eta_ = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - Zeta(2, theta) / zetan_);
+    }
+
+    uint32_t Next(Random* rnd) const {
+        const double u = rnd->NextDouble();
+        const double uz = u * zetan_;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + pow(0.5, theta_)) {
+            return 1;
+        }
+        const uint32_t k = uint32_t(n_ * pow(eta_ * u - eta_ + 1.0, alpha_));
+        return k < n_ ? k : n_ - 1;
+    }
+
+private:
+    static double Zeta(uint32_t n, double theta) {
+        double sum = 0;
+        for (uint32_t i = 1; i <= n; i++) {
+            sum += 1.0 / pow(double(i), theta);
+        }
+        return sum;
+    }
+
+    uint32_t n_;
+    double theta_, zetan_, alpha_, eta_;
+};
+
+// Pre-generated key indexes, so that key generation stays off the clock.
+// The sequence is a power of two long and is cycled through.
+static const uint32_t kTraceLength = 1 << 20;
+
+static std::vector<uint32_t> UniformTrace(uint32_t n) {
+    Random rnd(301);
+    std::vector<uint32_t> trace(kTraceLength);
+    for (uint32_t i = 0; i < kTraceLength; i++) {
+        trace[i] = uint32_t(rnd.Next() % n);
+    }
+    return trace;
+}
+
+static std::vector<uint32_t> ZipfianTrace(uint32_t n) {
+    Random rnd(301);
+    ZipfianGenerator zipf(n, 0.99);
+    std::vector<uint32_t> trace(kTraceLength);
+    for (uint32_t i = 0; i < kTraceLength; i++) {
+        // Scatter the hot keys over the key space, and so over the shards.
+        trace[i] = uint32_t((uint64_t(zipf.Next(&rnd)) * 2654435761u) % n);
+    }
+    return trace;
+}
+
+// Builds fixed-size keys: the index followed by constant padding.
+class KeyBuffer {
+public:
+    explicit KeyBuffer(size_t size) : buf_(size < sizeof(uint32_t) ? sizeof(uint32_t) : size, 'k') { }
+
+    const char* Get(uint32_t i) {
+        memcpy(&buf_[0], &i, sizeof(i));
+        return &buf_[0];
+    }
+    size_t size() const { return buf_.size(); }
+
+private:
+    std::vector<char> buf_;
+};
+
+// Times one op, from construction to destruction, when latency recording
+// is on.
+class OpTimer {
+public:
+    explicit OpTimer(bool record) : start_(record ? BenchNanoTime() : 0) { }
+    ~OpTimer() {
+        if (start_ != 0) {
+            BenchRecordLatency(BenchNanoTime() - start_);
+        }
+    }
+
+private:
+    uint64_t start_;
+};
+
+// The options of the policy and index variants of the benchmarks; the
+// capacity is set by each benchmark.
+static LRUCacheOptions Options(LRUCachePolicy policy, LRUCacheIndexType index_type) {
+    LRUCacheOptions options;
+    options.policy = policy;
+    options.index_type = index_type;
+    return options;
+}
+
+static LRUCache* NewFilledCache(LRUCacheOptions options, size_t capacity, uint32_t keys, KeyBuffer* key) {
+    options.capacity = capacity;
+    LRUCache* cache = LRUCache::New(options);
+    for (uint32_t i = 0; i < keys; i++) {
+        cache->Release(cache->Insert(key->Get(i), key->size(), NULL, 1, &NoopDeleter));
+    }
+    return cache;
+}
+
+// Every lookup hits.
+static void BenchLookupHit(size_t key_size, const LRUCacheOptions& options = LRUCacheOptions()) {
+    BenchStopTimer();
+    const uint32_t kKeys = 1 << 16;
+    KeyBuffer key(key_size);
+    // Leave room for uneven shards, so that nothing is evicted.
+    LRUCache* cache = NewFilledCache(options, 2 * kKeys, kKeys, &key);
+    const std::vector<uint32_t> trace = UniformTrace(kKeys);
+    int hits = 0;
+    BenchStartTimer();
+
+    const bool record = BenchLatencyEnabled();
+    for (int i = 0; i < BenchN(); i++) {
+        OpTimer op(record);
+        LRUCache::Handle* h = cache->Lookup(key.Get(trace[i & (kTraceLength - 1)]), key.size());
+        if (h != NULL) {
+            hits++;
+            cache->Release(h);
+        }
+    }
+
+    BenchStopTimer();
+    BenchReportMetric(100.0 * hits / BenchN(), "hit%");
+    cache->Delete();
+}
+
+// Cached workload: look up, and insert on a miss.  "ratio" is the
+// capacity as a fraction of the working set.
+static void BenchWorkload(const std::vector<uint32_t>& trace, uint32_t keys, double ratio,
+                          const LRUCacheOptions& options = LRUCacheOptions()) {
+    BenchStopTimer();
+    KeyBuffer key(16);
+    const size_t capacity = size_t(keys * ratio);
+    LRUCache* cache = NewFilledCache(options, capacity, capacity, &key);
+    int hits = 0;
+    BenchStartTimer();
+
+    const bool record = BenchLatencyEnabled();
+    for (int i = 0; i < BenchN(); i++) {
+        OpTimer op(record);
+        const char* k = key.Get(trace[i & (kTraceLength - 1)]);
+        LRUCache::Handle* h = cache->Lookup(k, key.size());
+        if (h != NULL) {
+            hits++;
+        } else {
+            h = cache->Insert(k, key.size(), NULL, 1, &NoopDeleter);
+        }
+        cache->Release(h);
+    }
+
+    BenchStopTimer();
+    BenchReportMetric(100.0 * hits / BenchN(), "hit%");
+    cache->Delete();
+}
+
+static const uint32_t kWorkingSet = 1 << 18;
+
+static const std::vector<uint32_t>& Uniform() {
+    static const std::vector<uint32_t> trace = UniformTrace(kWorkingSet);
+    return trace;
+}
+
+static const std::vector<uint32_t>& Zipfian() {
+    static const std::vector<uint32_t> trace = ZipfianTrace(kWorkingSet);
+    return trace;
+}
+
+BENCH(LRUCache, LookupHit) {
+    BenchLookupHit(16);
+}
+
+BENCH(LRUCache, LookupHitKey4) {
+    BenchLookupHit(4);
+}
+
+BENCH(LRUCache, LookupHitKey64) {
+    BenchLookupHit(64);
+}
+
+BENCH(LRUCache, LookupHitKey256) {
+    BenchLookupHit(256);
+}
+
+BENCH(LRUCache, LookupHitClock) {
+    BenchLookupHit(16, Options(kClockPolicy, kChainedIndex));
+}
+
+BENCH(LRUCache, LookupHitSegmentedLRU) {
+    BenchLookupHit(16, Options(kSegmentedLRUPolicy, kChainedIndex));
+}
+
+BENCH(LRUCache, LookupHitOpenAddressing) {
+    BenchLookupHit(16, Options(kLRUPolicy, kOpenAddressingIndex));
+}
+
+// LookupHit for TypedLRUCache with uint64_t keys, which are hashed and
+// compared inline.
+BENCH(LRUCache, TypedLookupHit) {
+    BenchStopTimer();
+    const uint32_t kKeys = 1 << 16;
+    TypedLRUCache<uint64_t, uint64_t> cache(2 * kKeys);
+    for (uint32_t i = 0; i < kKeys; i++) {
+        cache.Release(cache.Insert(i, i));
+    }
+    const std::vector<uint32_t> trace = UniformTrace(kKeys);
+    int hits = 0;
+    BenchStartTimer();
+
+    const bool record = BenchLatencyEnabled();
+    for (int i = 0; i < BenchN(); i++) {
+        OpTimer op(record);
+        TypedLRUCache<uint64_t, uint64_t>::Handle* h = cache.Lookup(trace[i & (kTraceLength - 1)]);
+        if (h != NULL) {
+            hits++;
+            cache.Release(h);
+        }
+    }
+
+    BenchStopTimer();
+    BenchReportMetric(100.0 * hits / BenchN(), "hit%");
+}
+
+// Every lookup misses: the keys looked up were never inserted.
+BENCH(LRUCache, LookupMiss) {
+    BenchStopTimer();
+    const uint32_t kKeys = 1 << 16;
+    KeyBuffer key(16);
+    // Leave room for uneven shards, so that nothing is evicted.
+    LRUCache* cache = NewFilledCache(LRUCacheOptions(), 2 * kKeys, kKeys, &key);
+    const std::vector<uint32_t> trace = UniformTrace(kKeys);
+    int hits = 0;
+    BenchStartTimer();
+
+    const bool record = BenchLatencyEnabled();
+    for (int i = 0; i < BenchN(); i++) {
+        OpTimer op(record);
+        LRUCache::Handle* h = cache->Lookup(key.Get(kKeys + trace[i & (kTraceLength - 1)]), key.size());
+        if (h != NULL) {
+            hits++;
+            cache->Release(h);
+        }
+    }
+
+    BenchStopTimer();
+    BenchReportMetric(100.0 * hits / BenchN(), "hit%");
+    cache->Delete();
+}
+
+// Every insert is of a new key into a full cache, so it evicts.
+BENCH(LRUCache, InsertEvict) {
+    BenchStopTimer();
+    const uint32_t kCapacity = 1 << 14;
+    KeyBuffer key(16);
+    LRUCache* cache = NewFilledCache(LRUCacheOptions(), kCapacity, kCapacity, &key);
+    BenchStartTimer();
+
+    const bool record = BenchLatencyEnabled();
+    for (int i = 0; i < BenchN(); i++) {
+        OpTimer op(record);
+        cache->Release(cache->Insert(key.Get(kCapacity + i), key.size(), NULL, 1, &NoopDeleter));
+    }
+
+    BenchStopTimer();
+    cache->Delete();
+}
+
+BENCH(LRUCache, UniformCapacity10) {
+    BenchWorkload(Uniform(), kWorkingSet, 0.10);
+}
+
+BENCH(LRUCache, UniformCapacity50) {
+    BenchWorkload(Uniform(), kWorkingSet, 0.50);
+}
+
+BENCH(LRUCache, UniformCapacity90) {
+    BenchWorkload(Uniform(), kWorkingSet, 0.90);
+}
+
+BENCH(LRUCache, ZipfianCapacity1) {
+    BenchWorkload(Zipfian(), kWorkingSet, 0.01);
+}
+
+BENCH(LRUCache, ZipfianCapacity10) {
+    BenchWorkload(Zipfian(), kWorkingSet, 0.10);
+}
+
+BENCH(LRUCache, ZipfianCapacity50) {
+    BenchWorkload(Zipfian(), kWorkingSet, 0.50);
+}
+
+// The Zipfian workloads under the other policies, whose hit ratios are
+// the point of comparison, and with the open-addressing index.
+BENCH(LRUCache, ZipfianCapacity1Clock) {
+    BenchWorkload(Zipfian(), kWorkingSet, 0.01, Options(kClockPolicy, kChainedIndex));
+}
+
+BENCH(LRUCache, ZipfianCapacity10Clock) {
+    BenchWorkload(Zipfian(), kWorkingSet, 0.10, Options(kClockPolicy, kChainedIndex));
+}
+
+BENCH(LRUCache, ZipfianCapacity50Clock) {
+    BenchWorkload(Zipfian(), kWorkingSet, 0.50, Options(kClockPolicy, kChainedIndex));
+}
+
+BENCH(LRUCache, ZipfianCapacity1SegmentedLRU) {
+    BenchWorkload(Zipfian(), kWorkingSet, 0.01, Options(kSegmentedLRUPolicy, kChainedIndex));
+}
+
+BENCH(LRUCache, ZipfianCapacity10SegmentedLRU) {
+    BenchWorkload(Zipfian(), kWorkingSet, 0.10, Options(kSegmentedLRUPolicy, kChainedIndex));
+}
+
+BENCH(LRUCache, ZipfianCapacity50SegmentedLRU) {
+    BenchWorkload(Zipfian(), kWorkingSet, 0.50, Options(kSegmentedLRUPolicy, kChainedIndex));
+}
+
+BENCH(LRUCache, ZipfianCapacity1OpenAddressing) {
+    BenchWorkload(Zipfian(), kWorkingSet, 0.01, Options(kLRUPolicy, kOpenAddressingIndex));
+}
+
+BENCH(LRUCache, ZipfianCapacity10OpenAddressing) {
+    BenchWorkload(Zipfian(), kWorkingSet, 0.10, Options(kLRUPolicy, kOpenAddressingIndex));
+}
+
+BENCH(LRUCache, ZipfianCapacity50OpenAddressing) {
+    BenchWorkload(Zipfian(), kWorkingSet, 0.50, Options(kLRUPolicy, kOpenAddressingIndex));
+}
+
+// Shared state of the multi-threaded benchmarks.  Each thread walks the
+// trace from its own offset.
+struct ParallelBench {
+    LRUCache* cache;
+    const std::vector<uint32_t>* trace;
+    std::atomic<int> hits;
+};
+
+static void ParallelLookup(int thread, int n, void* arg) {
+    ParallelBench* b = reinterpret_cast<ParallelBench*>(arg);
+    KeyBuffer key(16);
+    const uint32_t offset = uint32_t(thread) * 7919;
+    int hits = 0;
+    const bool record = BenchLatencyEnabled();
+    for (int i = 0; i < n; i++) {
+        OpTimer op(record);
+        LRUCache::Handle* h = b->cache->Lookup(key.Get((*b->trace)[(offset + i) & (kTraceLength - 1)]), key.size());
+        if (h != NULL) {
+            hits++;
+            b->cache->Release(h);
+        }
+    }
+    b->hits += hits;
+}
+
+static void ParallelWorkload(int thread, int n, void* arg) {
+    ParallelBench* b = reinterpret_cast<ParallelBench*>(arg);
+    KeyBuffer key(16);
+    const uint32_t offset = uint32_t(thread) * 7919;
+    int hits = 0;
+    const bool record = BenchLatencyEnabled();
+    for (int i = 0; i < n; i++) {
+        OpTimer op(record);
+        const char* k = key.Get((*b->trace)[(offset + i) & (kTraceLength - 1)]);
+        LRUCache::Handle* h = b->cache->Lookup(k, key.size());
+        if (h != NULL) {
+            hits++;
+        } else {
+            h = b->cache->Insert(k, key.size(), NULL, 1, &NoopDeleter);
+        }
+        b->cache->Release(h);
+    }
+    b->hits += hits;
+}
+
+static void BenchParallelCache(const LRUCacheOptions& options, uint32_t keys,
+                               const std::vector<uint32_t>& trace,
+                               void (*fn)(int thread, int n, void* arg)) {
+    BenchStopTimer();
+    KeyBuffer key(16);
+    ParallelBench b;
+    b.cache = LRUCache::New(options);
+    b.trace = &trace;
+    b.hits = 0;
+    for (uint32_t i = 0; i < keys; i++) {
+        b.cache->Release(b.cache->Insert(key.Get(i), key.size(), NULL, 1, &NoopDeleter));
+    }
+
+    BenchParallel(fn, &b);
+
+    BenchReportMetric(100.0 * b.hits.load() / BenchN(), "hit%");
+    b.cache->Delete();
+}
+
+// Run these with e.g. -test.cpu=1,2,4,8 to see how the shards scale.
+BENCH(LRUCache, ParallelLookupHit) {
+    static const std::vector<uint32_t> trace = UniformTrace(1 << 16);
+    LRUCacheOptions options;
+    options.capacity = 2 << 16;
+    BenchParallelCache(options, 1 << 16, trace, &ParallelLookup);
+}
+
+BENCH(LRUCache, ParallelLookupHitLockFree) {
+    static const std::vector<uint32_t> trace = UniformTrace(1 << 16);
+    LRUCacheOptions options;
+    options.capacity = 2 << 16;
+    options.lock_free_lookup = true;
+    BenchParallelCache(options, 1 << 16, trace, &ParallelLookup);
+}
+
+BENCH(LRUCache, ParallelZipfian) {
+    LRUCacheOptions options;
+    options.capacity = kWorkingSet / 10;
+    BenchParallelCache(options, kWorkingSet / 10, Zipfian(), &ParallelWorkload);
+}
+
+// LookupHit in batches of 100 keys, as issued by a fan-out read.
+BENCH(LRUCache, MultiLookupHit) {
+    BenchStopTimer();
+    const uint32_t kKeys = 1 << 16;
+    const int kBatch = 100;
+    KeyBuffer key(16);
+    LRUCache* cache = NewFilledCache(LRUCacheOptions(), 2 * kKeys, kKeys, &key);
+    const std::vector<uint32_t> trace = UniformTrace(kKeys);
+    std::vector<std::vector<char> > bufs(kBatch, std::vector<char>(key.size(), 'k'));
+    std::vector<const char*> keys(kBatch);
+    std::vector<size_t> key_lens(kBatch, key.size());
+    std::vector<LRUCache::Handle*> handles(kBatch);
+    int hits = 0;
+    BenchStartTimer();
+
+    for (int i = 0; i < BenchN(); i += kBatch) {
+        const int n = (BenchN() - i < kBatch) ? BenchN() - i : kBatch;
+        for (int j = 0; j < n; j++) {
+            memcpy(&bufs[j][0], &trace[(i + j) & (kTraceLength - 1)], sizeof(uint32_t));
+            keys[j] = &bufs[j][0];
+        }
+        cache->MultiLookup(n, &keys[0], &key_lens[0], &handles[0]);
+        for (int j = 0; j < n; j++) {
+            if (handles[j] != NULL) {
+                hits++;
+                cache->Release(handles[j]);
+            }
+        }
+    }
+
+    BenchStopTimer();
+    BenchReportMetric(100.0 * hits / BenchN(), "hit%");
+    cache->Delete();
+}
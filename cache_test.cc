@@ -6,10 +6,20 @@
 #include "cache.h"
 
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <algorithm>
+#include <atomic>
 #include <string>
+#include <thread>
 #include <vector>
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
 // Conversions between numeric keys/values and the types expected by Cache.
 static std::string EncodeKey(int k) {
     char buf[16] = { 0 };
@@ -21,6 +31,7 @@ static int DecodeKey(const std::string& k) {
     sscanf(k.c_str(), "%d", &value);
     return value;
 }
+static void NoopDeleter(const char* /*key*/, void* /*value*/) { }
 static void* EncodeValue(uintptr_t v) { return reinterpret_cast<void*>(v); }
 static int DecodeValue(void* v) { return reinterpret_cast<uintptr_t>(v); }
 
@@ -41,6 +52,9 @@ public:
     LRUCacheTest() : cache_(LRUCache::New(kCacheSize)) {
         current_ = this;
     }
+    explicit LRUCacheTest(const LRUCacheOptions& options) : cache_(LRUCache::New(options)) {
+        current_ = this;
+    }
     ~LRUCacheTest() {
         cache_->Delete();
     }
@@ -190,6 +204,41 @@ TEST(LRUCache, HeavyEntries) {
     ASSERT_TRUE(cached_weight < LRUCacheTest::kCacheSize + LRUCacheTest::kCacheSize/10);
 }
 
+TEST(LRUCache, BinaryKeys) {
+    LRUCacheTest cacheTest;
+    auto p = &cacheTest;
+
+    // Keys with embedded zeros, and keys that are prefixes of each other,
+    // must map to distinct entries.
+    const char k1[] = { 'a', '\0', 'b' };
+    const char k2[] = { 'a', '\0', 'c' };
+    LRUCache* cache = p->cache_;
+    cache->Release(cache->Insert(k1, sizeof(k1), EncodeValue(1), 1, &NoopDeleter));
+    cache->Release(cache->Insert(k2, sizeof(k2), EncodeValue(2), 1, &NoopDeleter));
+    cache->Release(cache->Insert(k1, 1, EncodeValue(3), 1, &NoopDeleter));
+
+    LRUCache::Handle* h = cache->Lookup(k1, sizeof(k1));
+    ASSERT_TRUE(h != NULL);
+    ASSERT_EQ(1, DecodeValue(cache->Value(h)));
+    cache->Release(h);
+
+    h = cache->Lookup(k2, sizeof(k2));
+    ASSERT_TRUE(h != NULL);
+    ASSERT_EQ(2, DecodeValue(cache->Value(h)));
+    cache->Release(h);
+
+    h = cache->Lookup("a");
+    ASSERT_TRUE(h != NULL);
+    ASSERT_EQ(3, DecodeValue(cache->Value(h)));
+    cache->Release(h);
+
+    ASSERT_TRUE(cache->Lookup(k1, 2) == NULL);
+    cache->Erase(k1, sizeof(k1));
+    ASSERT_TRUE(cache->Lookup(k1, sizeof(k1)) == NULL);
+    ASSERT_EQ(2, DecodeValue(cache->Value(h = cache->Lookup(k2, sizeof(k2)))));
+    cache->Release(h);
+}
+
 TEST(LRUCache, NewId) {
     LRUCacheTest cacheTest;
     auto p = &cacheTest;
@@ -198,3 +247,2011 @@ TEST(LRUCache, NewId) {
     uint64_t b = p->cache_->NewId();
     ASSERT_TRUE(a != b);
 }
+
+static LRUCacheOptions LockFreeOptions() {
+    LRUCacheOptions options;
+    options.capacity = LRUCacheTest::kCacheSize;
+    options.lock_free_lookup = true;
+    return options;
+}
+
+TEST(LRUCache, LockFreeLookup) {
+    LRUCacheTest cacheTest(LockFreeOptions());
+    auto p = &cacheTest;
+
+    ASSERT_EQ(-1, p->Lookup(100));
+    p->Insert(100, 101);
+    p->Insert(200, 201);
+    ASSERT_EQ(101, p->Lookup(100));
+    ASSERT_EQ(201, p->Lookup(200));
+
+    // Entries stay pinned while a lock-free handle is outstanding.
+    LRUCache::Handle* h1 = p->cache_->Lookup(EncodeKey(100).c_str());
+    p->Insert(100, 102);
+    ASSERT_EQ(102, p->Lookup(100));
+    ASSERT_EQ(0, p->deleted_keys_.size());
+    p->cache_->Release(h1);
+    ASSERT_EQ(1, p->deleted_keys_.size());
+    ASSERT_EQ(101, p->deleted_values_[0]);
+
+    p->Erase(200);
+    ASSERT_EQ(-1, p->Lookup(200));
+    ASSERT_EQ(2, p->deleted_keys_.size());
+}
+
+TEST(LRUCache, LockFreeEvictionPolicy) {
+    LRUCacheTest cacheTest(LockFreeOptions());
+    auto p = &cacheTest;
+
+    p->Insert(100, 101);
+    p->Insert(200, 201);
+
+    // Entries hit without the mutex are still kept around by the sweep.
+    // Every entry hit since the last sweep is promoted alike, so unlike
+    // EvictionPolicy the new entries are not looked up here.
+    for (int i = 0; i < LRUCacheTest::kCacheSize + 100; i++) {
+        p->Insert(1000+i, 2000+i);
+        ASSERT_EQ(101, p->Lookup(100));
+    }
+    ASSERT_EQ(101, p->Lookup(100));
+    ASSERT_EQ(-1, p->Lookup(200));
+}
+
+static void CheckConcurrentLookup(const LRUCacheOptions& options) {
+    LRUCache* cache = LRUCache::New(options);
+    const int kKeys = 4 * LRUCacheTest::kCacheSize;
+    const int kReaders = 4;
+    std::atomic<bool> done(false);
+    std::atomic<int> errors(0);
+
+    std::vector<std::thread> readers;
+    for (int t = 0; t < kReaders; t++) {
+        readers.push_back(std::thread([&, t]() {
+            uint32_t x = 12345 + t;
+            while (!done.load()) {
+                x = x * 1103515245 + 12345;
+                const uint32_t k = (x >> 8) % kKeys;
+                LRUCache::Handle* h = cache->Lookup(reinterpret_cast<const char*>(&k), sizeof(k));
+                if (h != NULL) {
+                    if (DecodeValue(cache->Value(h)) != int(k) + 1) {
+                        errors++;
+                    }
+                    cache->Release(h);
+                }
+            }
+        }));
+    }
+
+    // Churn through more keys than fit, forcing evictions, replacements,
+    // erases and table resizes underneath the readers.
+    for (int round = 0; round < 20; round++) {
+        for (uint32_t k = 0; k < uint32_t(kKeys); k++) {
+            const char* key = reinterpret_cast<const char*>(&k);
+            cache->Release(cache->Insert(key, sizeof(k), EncodeValue(k + 1), 1, &NoopDeleter));
+            if (k % 7 == 0) {
+                cache->Erase(key, sizeof(k));
+            }
+        }
+    }
+    done.store(true);
+    for (size_t t = 0; t < readers.size(); t++) {
+        readers[t].join();
+    }
+    ASSERT_EQ(0, errors.load());
+    // Every handle has been released.
+    LRUCacheStats stats;
+    cache->GetStats(&stats);
+    ASSERT_EQ(0, int(stats.pinned_usage));
+    cache->Delete();
+}
+
+TEST(LRUCache, LockFreeConcurrentLookup) {
+    CheckConcurrentLookup(LockFreeOptions());
+}
+
+TEST(LRUCache, ClockEvictionPolicy) {
+    LRUCacheOptions options;
+    options.capacity = LRUCacheTest::kCacheSize;
+    options.policy = kClockPolicy;
+    LRUCacheTest cacheTest(options);
+    auto p = &cacheTest;
+
+    p->Insert(100, 101);
+    p->Insert(200, 201);
+    p->Insert(100, 102);
+    ASSERT_EQ(102, p->Lookup(100));
+    ASSERT_EQ(201, p->Lookup(200));
+    ASSERT_EQ(1, p->deleted_keys_.size());
+
+    // Referenced entries survive the sweep; 200 is not hit again, so it
+    // goes once its second chance has been used up.
+    for (int i = 0; i < 3 * LRUCacheTest::kCacheSize; i++) {
+        p->Insert(1000+i, 2000+i);
+        ASSERT_EQ(102, p->Lookup(100));
+    }
+    ASSERT_EQ(102, p->Lookup(100));
+    ASSERT_EQ(-1, p->Lookup(200));
+}
+
+TEST(LRUCache, SegmentedLRUScanResistance) {
+    LRUCacheOptions options;
+    options.capacity = LRUCacheTest::kCacheSize;
+    options.policy = kSegmentedLRUPolicy;
+    LRUCacheTest cacheTest(options);
+    auto p = &cacheTest;
+
+    // A hot set that has been hit once is protected...
+    const int kHot = LRUCacheTest::kCacheSize / 10;
+    for (int i = 0; i < kHot; i++) {
+        p->Insert(i, 100+i);
+        ASSERT_EQ(100+i, p->Lookup(i));
+    }
+
+    // ...from a scan of entries that are never hit again.
+    for (int i = 0; i < 3 * LRUCacheTest::kCacheSize; i++) {
+        p->Insert(10000+i, i);
+    }
+    for (int i = 0; i < kHot; i++) {
+        ASSERT_EQ(100+i, p->Lookup(i));
+    }
+    ASSERT_EQ(-1, p->Lookup(10000));
+}
+
+TEST(LRUCache, LowPriorityInsert) {
+    LRUCacheTest cacheTest;
+    auto p = &cacheTest;
+
+    const int kHot = LRUCacheTest::kCacheSize / 10;
+    for (int i = 0; i < kHot; i++) {
+        p->Insert(i, 100+i);
+    }
+
+    // Low priority entries only ever displace each other.
+    for (int i = 0; i < 3 * LRUCacheTest::kCacheSize; i++) {
+        p->cache_->Release(p->cache_->Insert(
+            EncodeKey(10000+i).c_str(), EncodeValue(i), 1,
+            &LRUCacheTest::Deleter, LRUCache::kLowPriority)
+        );
+    }
+    for (int i = 0; i < kHot; i++) {
+        ASSERT_EQ(100+i, p->Lookup(i));
+    }
+}
+
+TEST(LRUCache, LowPriorityLockFreeHit) {
+    LRUCacheOptions options = LockFreeOptions();
+    options.capacity = 10;
+    options.num_shard_bits = 0;
+    options.policy = kSegmentedLRUPolicy;
+    LRUCache* cache = LRUCache::New(options);
+
+    // A lock-free hit promotes a normal entry at the next sweep, but only
+    // makes a low priority one normal, as a locked hit would.
+    cache->Release(cache->Insert("low", EncodeValue(1), 1, &NoopDeleter, LRUCache::kLowPriority));
+    cache->Release(cache->Insert("normal", EncodeValue(2), 1, &NoopDeleter));
+    cache->Release(cache->Lookup("low"));
+    cache->Release(cache->Lookup("normal"));
+    for (int i = 0; i < 20; i++) {
+        cache->Release(cache->Insert(EncodeKey(i).c_str(), EncodeValue(i), 1, &NoopDeleter));
+    }
+    LRUCache::Handle* h = cache->Lookup("low");
+    ASSERT_TRUE(h == NULL);
+    h = cache->Lookup("normal");
+    ASSERT_TRUE(h != NULL);
+    cache->Release(h);
+    cache->Delete();
+}
+
+TEST(LRUCache, NumShardBits) {
+    LRUCacheOptions options;
+    options.capacity = LRUCacheTest::kCacheSize;
+    options.num_shard_bits = 0;
+    LRUCacheTest cacheTest(options);
+    auto p = &cacheTest;
+
+    // A single shard holds exactly the capacity and evicts in global
+    // LRU order.
+    for (int i = 0; i < LRUCacheTest::kCacheSize; i++) {
+        p->Insert(i, 1000+i);
+    }
+    ASSERT_EQ(0, p->deleted_keys_.size());
+    p->Insert(LRUCacheTest::kCacheSize, 0);
+    ASSERT_EQ(1, p->deleted_keys_.size());
+    ASSERT_EQ(0, p->deleted_keys_[0]);
+
+    for (int bits = 1; bits <= 6; bits++) {
+        options.num_shard_bits = bits;
+        LRUCache* cache = LRUCache::New(options);
+        for (int i = 0; i < 100; i++) {
+            cache->Release(cache->Insert(EncodeKey(i).c_str(), EncodeValue(1000+i), 1, &NoopDeleter));
+        }
+        for (int i = 0; i < 100; i++) {
+            LRUCache::Handle* h = cache->Lookup(EncodeKey(i).c_str());
+            ASSERT_TRUE(h != NULL);
+            ASSERT_EQ(1000+i, DecodeValue(cache->Value(h)));
+            cache->Release(h);
+        }
+        cache->Delete();
+    }
+}
+
+class CountingAllocator: public LRUCacheAllocator {
+public:
+    CountingAllocator(): allocated_(0), deallocated_(0), live_bytes_(0) { }
+
+    virtual void* Allocate(size_t size) {
+        allocated_++;
+        live_bytes_ += size;
+        return malloc(size);
+    }
+    virtual void Deallocate(void* ptr, size_t size) {
+        deallocated_++;
+        live_bytes_ -= size;
+        free(ptr);
+    }
+
+    std::atomic<int> allocated_;
+    std::atomic<int> deallocated_;
+    std::atomic<long> live_bytes_;
+};
+
+TEST(LRUCache, CustomAllocator) {
+    CountingAllocator allocator;
+    LRUCacheOptions options;
+    options.capacity = LRUCacheTest::kCacheSize;
+    options.allocator = &allocator;
+    {
+        LRUCacheTest cacheTest(options);
+        auto p = &cacheTest;
+        for (int i = 0; i < 2 * LRUCacheTest::kCacheSize; i++) {
+            p->Insert(i, 1000+i);
+        }
+        ASSERT_EQ(2 * LRUCacheTest::kCacheSize, allocator.allocated_.load());
+        // Memory of evicted entries is recycled lazily, after their deleter.
+        ASSERT_TRUE(allocator.deallocated_.load() <= int(p->deleted_keys_.size()));
+        ASSERT_TRUE(allocator.deallocated_.load() > 0);
+    }
+    ASSERT_EQ(allocator.allocated_.load(), allocator.deallocated_.load());
+    ASSERT_EQ(0, int(allocator.live_bytes_.load()));
+}
+
+// Looks up a key in "cache_" on every call, which would deadlock if the
+// cache called it with a shard mutex held.
+class ReentrantAllocator: public CountingAllocator {
+public:
+    ReentrantAllocator(): cache_(NULL) { }
+
+    virtual void* Allocate(size_t size) {
+        Touch();
+        return CountingAllocator::Allocate(size);
+    }
+    virtual void Deallocate(void* ptr, size_t size) {
+        Touch();
+        CountingAllocator::Deallocate(ptr, size);
+    }
+
+    std::atomic<LRUCache*> cache_;
+
+private:
+    void Touch() {
+        LRUCache* cache = cache_.load();
+        if (cache != NULL) {
+            cache->Release(cache->Lookup("x"));
+        }
+    }
+};
+
+TEST(LRUCache, AllocatorRunsOutsideLock) {
+    for (int lock_free = 0; lock_free < 2; lock_free++) {
+        ReentrantAllocator allocator;
+        LRUCacheOptions options;
+        options.capacity = 100;
+        options.num_shard_bits = 0;
+        options.lock_free_lookup = (lock_free != 0);
+        options.allocator = &allocator;
+        LRUCache* cache = LRUCache::New(options);
+        cache->Release(cache->Insert("x", EncodeValue(0), 1, &NoopDeleter));
+        allocator.cache_ = cache;
+        for (int i = 0; i < 1000; i++) {
+            cache->Release(cache->Insert(EncodeKey(i).c_str(), EncodeValue(i), 1, &NoopDeleter));
+            if (i % 3 == 0) {
+                cache->Erase(EncodeKey(i).c_str());
+            }
+        }
+        void* values[4];
+        size_t charges[4] = { 1, 1, 1, 1 };
+        std::string keys[4] = { "m0", "m1", "m2", "m3" };
+        const char* key_ptrs[4];
+        size_t key_lens[4];
+        for (int i = 0; i < 4; i++) {
+            values[i] = EncodeValue(i);
+            key_ptrs[i] = keys[i].data();
+            key_lens[i] = keys[i].size();
+        }
+        cache->MultiInsert(4, key_ptrs, key_lens, values, charges, &NoopDeleter, NULL);
+        ASSERT_TRUE(allocator.deallocated_.load() > 0);
+        allocator.cache_ = NULL;
+        cache->Delete();
+        ASSERT_EQ(allocator.allocated_.load(), allocator.deallocated_.load());
+        ASSERT_EQ(0, int(allocator.live_bytes_.load()));
+    }
+}
+
+static LRUCache* reentrant_cache;
+static int reentrant_lookups;
+
+static void ReentrantDeleter(const char* key, void* /*value*/) {
+    // Deleters run outside the shard mutex, so they may use the cache.
+    LRUCache::Handle* h = reentrant_cache->Lookup(key);
+    if (h != NULL) {
+        reentrant_cache->Release(h);
+    }
+    reentrant_cache->Erase("other");
+    reentrant_lookups++;
+}
+
+TEST(LRUCache, DeleterRunsOutsideLock) {
+    LRUCacheOptions options;
+    options.capacity = 2;
+    options.num_shard_bits = 0;
+    reentrant_cache = LRUCache::New(options);
+    reentrant_lookups = 0;
+
+    LRUCache* cache = reentrant_cache;
+    cache->Release(cache->Insert("a", EncodeValue(1), 1, &ReentrantDeleter));
+    cache->Release(cache->Insert("b", EncodeValue(2), 1, &ReentrantDeleter));
+
+    // Eviction, replacement, erase and the last Release of a pinned
+    // entry all run the deleter after dropping the lock.
+    cache->Release(cache->Insert("c", EncodeValue(3), 1, &ReentrantDeleter));
+    ASSERT_EQ(1, reentrant_lookups);
+    cache->Release(cache->Insert("b", EncodeValue(4), 1, &ReentrantDeleter));
+    ASSERT_EQ(2, reentrant_lookups);
+    cache->Erase("c");
+    ASSERT_EQ(3, reentrant_lookups);
+    LRUCache::Handle* h = cache->Lookup("b");
+    cache->Erase("b");
+    ASSERT_EQ(3, reentrant_lookups);
+    cache->Release(h);
+    ASSERT_EQ(4, reentrant_lookups);
+
+    cache->Delete();
+}
+
+static void CheckGrowAndShrink(LRUCacheIndexType index_type) {
+    LRUCacheOptions options;
+    options.capacity = 100000;
+    options.num_shard_bits = 0;
+    options.index_type = index_type;
+    LRUCacheTest cacheTest(options);
+    auto p = &cacheTest;
+
+    // The table resizes incrementally in both directions; entries must
+    // stay reachable whichever array they currently live in.
+    for (int round = 0; round < 3; round++) {
+        const int n = 20000 >> round;
+        for (int i = 0; i < n; i++) {
+            p->Insert(i, i);
+            if (i % 97 == 0) {
+                ASSERT_EQ(i / 2, p->Lookup(i / 2));
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(i, p->Lookup(i));
+        }
+        for (int i = 0; i < n; i++) {
+            p->Erase(i);
+            if (i % 89 == 0 && i + 1 < n) {
+                ASSERT_EQ(-1, p->Lookup(i));
+                ASSERT_EQ(i + 1, p->Lookup(i + 1));
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(-1, p->Lookup(i));
+        }
+    }
+}
+
+TEST(LRUCache, TableGrowAndShrink) {
+    CheckGrowAndShrink(kChainedIndex);
+}
+
+TEST(LRUCache, OpenAddressingIndex) {
+    CheckGrowAndShrink(kOpenAddressingIndex);
+
+    LRUCacheOptions options;
+    options.capacity = LRUCacheTest::kCacheSize;
+    options.index_type = kOpenAddressingIndex;
+    LRUCacheTest cacheTest(options);
+    auto p = &cacheTest;
+
+    p->Insert(100, 101);
+    p->Insert(100, 102);
+    ASSERT_EQ(102, p->Lookup(100));
+    ASSERT_EQ(1, p->deleted_keys_.size());
+    p->Erase(100);
+    ASSERT_EQ(-1, p->Lookup(100));
+    for (int i = 0; i < 2 * LRUCacheTest::kCacheSize; i++) {
+        p->Insert(1000 + i, 2000 + i);
+        ASSERT_EQ(2000 + i, p->Lookup(1000 + i));
+    }
+
+    // Inserts right after a shrink started, and a batch that reserves
+    // room, arrive while entries are still being moved to the smaller
+    // array.  The migration must keep ahead of them.
+    options.capacity = 100000;
+    options.num_shard_bits = 0;
+    LRUCache* cache = LRUCache::New(options);
+    for (int i = 0; i < 20000; i++) {
+        cache->Release(cache->Insert(EncodeKey(i).c_str(), EncodeValue(i), 1, &NoopDeleter));
+    }
+    for (int i = 100; i < 20000; i++) {
+        cache->Erase(EncodeKey(i).c_str());
+    }
+    for (int i = 20000; i < 25000; i++) {
+        cache->Release(cache->Insert(EncodeKey(i).c_str(), EncodeValue(i), 1, &NoopDeleter));
+    }
+    std::vector<std::string> names;
+    for (int i = 25000; i < 30000; i++) {
+        names.push_back(EncodeKey(i));
+    }
+    std::vector<const char*> keys;
+    std::vector<size_t> key_lens, charges(names.size(), 1);
+    std::vector<void*> values;
+    for (size_t i = 0; i < names.size(); i++) {
+        keys.push_back(names[i].data());
+        key_lens.push_back(names[i].size());
+        values.push_back(EncodeValue(25000 + int(i)));
+    }
+    cache->MultiInsert(keys.size(), keys.data(), key_lens.data(), values.data(), charges.data(),
+                       &NoopDeleter, NULL);
+    for (int i = 0; i < 30000; i++) {
+        LRUCache::Handle* h = cache->Lookup(EncodeKey(i).c_str());
+        ASSERT_EQ(i < 100 || i >= 20000, h != NULL);
+        if (h != NULL) {
+            ASSERT_EQ(i, DecodeValue(cache->Value(h)));
+            cache->Release(h);
+        }
+    }
+    cache->Delete();
+
+    options = LockFreeOptions();
+    options.index_type = kOpenAddressingIndex;
+    CheckConcurrentLookup(options);
+}
+
+TEST(LRUCache, Stats) {
+    LRUCacheOptions options;
+    options.capacity = 10;
+    options.num_shard_bits = 0;
+    LRUCacheTest cacheTest(options);
+    auto p = &cacheTest;
+    LRUCacheStats stats;
+
+    for (int i = 0; i < 15; i++) {
+        p->Insert(i, i);
+    }
+    ASSERT_EQ(-1, p->Lookup(0));
+    ASSERT_EQ(14, p->Lookup(14));
+    p->Erase(14);
+    p->Erase(14);
+
+    LRUCache::Handle* h = p->cache_->Lookup(EncodeKey(13).c_str());
+    p->cache_->GetStats(&stats);
+    ASSERT_EQ(2, int(stats.hits));
+    ASSERT_EQ(1, int(stats.misses));
+    ASSERT_EQ(15, int(stats.inserts));
+    ASSERT_EQ(5, int(stats.evictions));
+    ASSERT_EQ(1, int(stats.erases));
+    ASSERT_EQ(9, int(stats.entries));
+    ASSERT_EQ(9, int(stats.usage));
+    ASSERT_EQ(1, int(stats.pinned_usage));
+    ASSERT_TRUE(stats.table_resizes > 0);
+    ASSERT_TRUE(stats.LoadFactor() > 0 && stats.LoadFactor() <= 1);
+    ASSERT_NEAR(2.0 / 3.0, stats.HitRatio(), 1e-6);
+
+    // An erased entry stays pinned until its handle goes.
+    p->Erase(13);
+    p->cache_->GetStats(&stats);
+    ASSERT_EQ(9, int(stats.usage));
+    ASSERT_EQ(1, int(stats.pinned_usage));
+    p->cache_->Release(h);
+    p->cache_->GetStats(&stats);
+    ASSERT_EQ(8, int(stats.usage));
+    ASSERT_EQ(0, int(stats.pinned_usage));
+
+    LRUCache* cache = LRUCache::New(LockFreeOptions());
+    cache->Release(cache->Insert("a", NULL, 1, &NoopDeleter));
+    cache->Release(cache->Lookup("a"));
+    ASSERT_TRUE(cache->Lookup("b") == NULL);
+    cache->GetStats(&stats);
+    ASSERT_EQ(1, int(stats.hits));
+    ASSERT_EQ(1, int(stats.misses));
+    cache->Delete();
+}
+
+TEST(LRUCache, LockInstrumentation) {
+    LRUCacheOptions options;
+    options.capacity = 4;
+    options.num_shard_bits = 2;
+    options.instrument_locks = true;
+    LRUCache* cache = LRUCache::New(options);
+    LRUCacheStats stats;
+
+    for (int i = 0; i < 100; i++) {
+        const std::string key = EncodeKey(i);
+        cache->Release(cache->Insert(key.c_str(), NULL, 1, &NoopDeleter));
+        LRUCache::Handle* h = cache->Lookup(key.c_str());
+        if (h != NULL) {
+            cache->Release(h);
+        }
+    }
+    cache->GetStats(&stats);
+    ASSERT_TRUE(stats.lock_acquisitions >= 200);
+    ASSERT_TRUE(stats.lock_contended <= stats.lock_acquisitions);
+    ASSERT_TRUE(stats.lock_hold_nanos > 0);
+
+    ASSERT_EQ(4, int(cache->NumShards()));
+    uint64_t acquisitions = 0;
+    for (size_t s = 0; s < cache->NumShards(); s++) {
+        LRUCacheStats shard;
+        cache->GetShardStats(s, &shard);
+        acquisitions += shard.lock_acquisitions;
+    }
+    ASSERT_EQ(int(stats.lock_acquisitions), int(acquisitions));
+    cache->Delete();
+
+    // Off by default.
+    cache = LRUCache::New(LRUCacheTest::kCacheSize);
+    cache->Release(cache->Insert("a", NULL, 1, &NoopDeleter));
+    cache->GetStats(&stats);
+    ASSERT_EQ(0, int(stats.lock_acquisitions));
+    cache->Delete();
+}
+
+TEST(LRUCache, MultiLookupAndInsert) {
+    for (int lock_free = 0; lock_free < 2; lock_free++) {
+        LRUCacheOptions options;
+        options.capacity = LRUCacheTest::kCacheSize;
+        options.num_shard_bits = 3;
+        options.lock_free_lookup = (lock_free != 0);
+        LRUCacheTest cacheTest(options);
+        auto p = &cacheTest;
+
+        const int kBatch = 100;
+        std::vector<std::string> strs;
+        std::vector<const char*> keys;
+        std::vector<size_t> key_lens;
+        std::vector<void*> values;
+        std::vector<size_t> charges(kBatch, 1);
+        std::vector<LRUCache::Handle*> handles(kBatch);
+        for (int i = 0; i < kBatch; i++) {
+            strs.push_back(EncodeKey(i));
+        }
+        // A duplicate: the later value wins.
+        strs[kBatch - 1] = EncodeKey(0);
+        for (int i = 0; i < kBatch; i++) {
+            keys.push_back(strs[i].c_str());
+            key_lens.push_back(strs[i].size());
+            values.push_back(EncodeValue(1000 + i));
+        }
+
+        p->cache_->MultiInsert(kBatch, &keys[0], &key_lens[0], &values[0], &charges[0],
+                               &LRUCacheTest::Deleter, &handles[0]);
+        for (int i = 0; i < kBatch; i++) {
+            ASSERT_EQ(1000 + i, DecodeValue(p->cache_->Value(handles[i])));
+            p->cache_->Release(handles[i]);
+        }
+        ASSERT_EQ(1, p->deleted_keys_.size());
+        ASSERT_EQ(0, p->deleted_keys_[0]);
+        ASSERT_EQ(1000, p->deleted_values_[0]);
+        ASSERT_EQ(1000 + kBatch - 1, p->Lookup(0));
+        ASSERT_EQ(1050, p->Lookup(50));
+
+        // Half of the keys are missing.
+        for (int i = 0; i < kBatch; i++) {
+            strs[i] = EncodeKey(i * 2);
+            keys[i] = strs[i].c_str();
+            key_lens[i] = strs[i].size();
+        }
+        p->cache_->MultiLookup(kBatch, &keys[0], &key_lens[0], &handles[0]);
+        for (int i = 0; i < kBatch; i++) {
+            if (i * 2 < kBatch - 1) {
+                ASSERT_TRUE(handles[i] != NULL);
+                ASSERT_EQ(i == 0 ? 1000 + kBatch - 1 : 1000 + i * 2, DecodeValue(p->cache_->Value(handles[i])));
+                p->cache_->Release(handles[i]);
+            } else {
+                ASSERT_TRUE(handles[i] == NULL);
+            }
+        }
+
+        // Without handles, the entries are released right away.
+        p->cache_->MultiInsert(kBatch, &keys[0], &key_lens[0], &values[0], &charges[0],
+                               &LRUCacheTest::Deleter, NULL);
+        ASSERT_EQ(1000 + kBatch - 1, p->Lookup(2 * (kBatch - 1)));
+    }
+}
+
+TEST(LRUCache, MultiInsertReapsExpired) {
+    LRUCacheOptions options;
+    options.capacity = 10;
+    options.num_shard_bits = 0;
+    LRUCache* cache = LRUCache::New(options);
+
+    // The oldest entries are live, and the newer ones have expired by the
+    // time a batch needs their room.
+    for (int i = 0; i < 5; i++) {
+        const std::string k = EncodeKey(i);
+        cache->Release(cache->Insert(k.data(), k.size(), NULL, 1, &NoopDeleter));
+    }
+    for (int i = 5; i < 10; i++) {
+        const std::string k = EncodeKey(i);
+        cache->Release(cache->InsertWithTTL(k.data(), k.size(), NULL, 1, &NoopDeleter, 1));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    std::vector<std::string> strs;
+    const char* keys[5];
+    size_t key_lens[5];
+    void* values[5] = { NULL, NULL, NULL, NULL, NULL };
+    size_t charges[5] = { 1, 1, 1, 1, 1 };
+    for (int i = 0; i < 5; i++) {
+        strs.push_back(EncodeKey(100 + i));
+    }
+    for (int i = 0; i < 5; i++) {
+        keys[i] = strs[i].c_str();
+        key_lens[i] = strs[i].size();
+    }
+    cache->MultiInsert(5, keys, key_lens, values, charges, &NoopDeleter, NULL);
+    LRUCacheStats stats;
+    cache->GetStats(&stats);
+    ASSERT_EQ(5, int(stats.expirations));
+    for (int i = 0; i < 5; i++) {
+        const std::string k = EncodeKey(i);
+        LRUCache::Handle* h = cache->Lookup(k.data(), k.size());
+        ASSERT_TRUE_MSG(h != NULL, "key %d", i);
+        cache->Release(h);
+    }
+    cache->Delete();
+}
+
+TEST(LRUCache, MultiInsertReservesWhatFits) {
+    LRUCacheOptions options;
+    options.capacity = 100;
+    options.num_shard_bits = 0;
+    LRUCache* cache = LRUCache::New(options);
+
+    // A batch far larger than the cache only sizes the index for the
+    // entries that fit.
+    const int kBatch = 10000;
+    std::vector<std::string> strs;
+    std::vector<const char*> keys;
+    std::vector<size_t> key_lens;
+    std::vector<void*> values(kBatch, NULL);
+    std::vector<size_t> charges(kBatch, 1);
+    for (int i = 0; i < kBatch; i++) {
+        strs.push_back(EncodeKey(i));
+    }
+    for (int i = 0; i < kBatch; i++) {
+        keys.push_back(strs[i].c_str());
+        key_lens.push_back(strs[i].size());
+    }
+    cache->MultiInsert(kBatch, &keys[0], &key_lens[0], &values[0], &charges[0], &NoopDeleter, NULL);
+    LRUCacheStats stats;
+    cache->GetStats(&stats);
+    ASSERT_EQ(100, int(stats.entries));
+    // Grown once, and not shrunk back as the batch evicts.
+    ASSERT_EQ(1, int(stats.table_resizes));
+    ASSERT_TRUE_MSG(stats.table_slots <= 256, "slots %d", int(stats.table_slots));
+    cache->Delete();
+}
+
+TEST(LRUCache, CallerSuppliedHash) {
+    LRUCacheTest cacheTest;
+    auto p = &cacheTest;
+    LRUCache* cache = p->cache_;
+
+    // Interchangeable with the calls that hash the key themselves.
+    const std::string k1 = EncodeKey(1);
+    const uint64_t h1 = LRUCache::HashKey(k1.data(), k1.size());
+    cache->Release(cache->Insert(k1.data(), k1.size(), h1, EncodeValue(101), 1, &LRUCacheTest::Deleter));
+    ASSERT_EQ(101, p->Lookup(1));
+    LRUCache::Handle* h = cache->Lookup(k1.data(), k1.size(), h1);
+    ASSERT_TRUE(h != NULL);
+    ASSERT_EQ(101, DecodeValue(cache->Value(h)));
+    cache->Release(h);
+    cache->Erase(k1.data(), k1.size(), h1);
+    ASSERT_EQ(-1, p->Lookup(1));
+
+    // A caller's own hash, even a weak one, works as long as it is used
+    // consistently.
+    for (int i = 0; i < 100; i++) {
+        const std::string k = EncodeKey(i);
+        cache->Release(cache->Insert(k.data(), k.size(), uint64_t(i), EncodeValue(i + 1000), 1,
+                                     &LRUCacheTest::Deleter));
+    }
+    for (int i = 0; i < 100; i++) {
+        const std::string k = EncodeKey(i);
+        h = cache->Lookup(k.data(), k.size(), uint64_t(i));
+        ASSERT_TRUE(h != NULL);
+        ASSERT_EQ(i + 1000, DecodeValue(cache->Value(h)));
+        cache->Release(h);
+    }
+}
+
+TEST(LRUCache, HashSpreadsOverShards) {
+    LRUCacheOptions options;
+    options.capacity = 1 << 20;
+    options.num_shard_bits = 4;
+    LRUCache* cache = LRUCache::New(options);
+
+    // Sequential keys, and sequential caller hashes, must still land
+    // evenly in the shards that the top bits of the hash select.
+    for (int pass = 0; pass < 2; pass++) {
+        const int kKeys = 16000;
+        for (int i = 0; i < kKeys; i++) {
+            const std::string k = EncodeKey(pass * kKeys + i);
+            if (pass == 0) {
+                cache->Release(cache->Insert(k.data(), k.size(), NULL, 1, &NoopDeleter));
+            } else {
+                cache->Release(cache->Insert(k.data(), k.size(), uint64_t(i), NULL, 1, &NoopDeleter));
+            }
+        }
+        for (size_t s = 0; s < cache->NumShards(); s++) {
+            LRUCacheStats stats;
+            cache->GetShardStats(s, &stats);
+            const int expected = (pass + 1) * kKeys / 16;
+            ASSERT_TRUE_MSG(stats.entries > expected * 0.9 && stats.entries < expected * 1.1,
+                            "pass %d shard %d has %d entries", pass, int(s), int(stats.entries));
+        }
+    }
+    cache->Delete();
+}
+
+struct FileExtent {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t file;
+};
+static int inline_deletes = 0;
+static void InlineDeleter(const char* key, void* value) {
+    FileExtent* extent = reinterpret_cast<FileExtent*>(value);
+    ASSERT_EQ(DecodeKey(key), int(extent->file));
+    inline_deletes++;
+}
+
+TEST(LRUCache, InlineValues) {
+    LRUCacheOptions options;
+    options.capacity = 10;
+    options.num_shard_bits = 0;
+    LRUCache* cache = LRUCache::New(options);
+    inline_deletes = 0;
+
+    for (int i = 0; i < 20; i++) {
+        // Keys of every length modulo 8 exercise the value's alignment.
+        const std::string key = EncodeKey(i) + std::string(i % 8, 'x');
+        const FileExtent extent = { uint64_t(i) << 32, uint32_t(i * 10), uint32_t(i) };
+        LRUCache::Handle* h = cache->InsertInline(key.data(), key.size(), &extent, sizeof(extent), 1,
+                                                  &InlineDeleter);
+        ASSERT_EQ(sizeof(extent), cache->ValueSize(h));
+        ASSERT_EQ(0, int(reinterpret_cast<uintptr_t>(cache->Value(h)) % 8));
+        ASSERT_TRUE(cache->Value(h) != &extent);
+        ASSERT_EQ(i * 10, int(reinterpret_cast<FileExtent*>(cache->Value(h))->length));
+        cache->Release(h);
+
+        FileExtent out;
+        ASSERT_TRUE(cache->LookupCopy(key.data(), key.size(), &out, sizeof(out)));
+        ASSERT_EQ(i, int(out.file));
+        ASSERT_TRUE(out.offset == uint64_t(i) << 32);
+        ASSERT_TRUE(!cache->LookupCopy(key.data(), key.size(), &out, sizeof(out) - 1));
+    }
+    ASSERT_EQ(10, inline_deletes);
+
+    // Without a deleter the cache only frees its copy.
+    const FileExtent extent = { 1, 2, 3 };
+    cache->Release(cache->InsertInline("nodeleter", 9, &extent, sizeof(extent), 1));
+    FileExtent out;
+    ASSERT_TRUE(cache->LookupCopy("nodeleter", 9, &out, sizeof(out)));
+    ASSERT_EQ(3, int(out.file));
+
+    cache->Delete();
+    ASSERT_EQ(20, inline_deletes);
+
+    // Values inserted by pointer have no inline size.
+    cache = LRUCache::New(options);
+    cache->Release(cache->Insert("pointer", EncodeValue(7), 1, &NoopDeleter));
+    LRUCache::Handle* h = cache->Lookup("pointer");
+    ASSERT_EQ(0, int(cache->ValueSize(h)));
+    ASSERT_TRUE(!cache->LookupCopy("pointer", 7, &out, sizeof(out)));
+    cache->Release(h);
+    cache->Delete();
+}
+
+// Entries held by clients use memory whether or not they are cached, so
+// evicting them frees nothing: they stay cached, and only unpinned
+// entries are evicted to make room.
+static void CheckPinnedEntriesStayCached(LRUCacheOptions options) {
+    options.capacity = 10;
+    options.num_shard_bits = 0;
+    LRUCache* cache = LRUCache::New(options);
+    LRUCacheStats stats;
+
+    std::vector<LRUCache::Handle*> pinned;
+    for (int i = 0; i < 8; i++) {
+        cache->Release(cache->Insert(EncodeKey(i).c_str(), EncodeValue(i), 1, &NoopDeleter));
+        pinned.push_back(cache->Lookup(EncodeKey(i).c_str()));
+    }
+    for (int i = 100; i < 200; i++) {
+        cache->Release(cache->Insert(EncodeKey(i).c_str(), EncodeValue(i), 1, &NoopDeleter));
+    }
+    cache->GetStats(&stats);
+    ASSERT_EQ(10, int(stats.usage));
+    ASSERT_EQ(8, int(stats.pinned_usage));
+    ASSERT_EQ(98, int(stats.evictions));
+    for (int i = 0; i < 8; i++) {
+        LRUCache::Handle* h = cache->Lookup(EncodeKey(i).c_str());
+        ASSERT_TRUE(h != NULL);
+        ASSERT_EQ(i, DecodeValue(cache->Value(h)));
+        cache->Release(h);
+    }
+
+    // Pinned entries beyond the capacity are evicted once released.
+    LRUCache::Handle* heavy = cache->Insert("heavy", EncodeValue(0), 5, &NoopDeleter);
+    cache->GetStats(&stats);
+    ASSERT_EQ(13, int(stats.usage));
+    ASSERT_EQ(13, int(stats.pinned_usage));
+    for (size_t i = 0; i < pinned.size(); i++) {
+        cache->Release(pinned[i]);
+    }
+    cache->GetStats(&stats);
+    ASSERT_EQ(10, int(stats.usage));
+    ASSERT_EQ(5, int(stats.pinned_usage));
+    cache->Release(heavy);
+    cache->GetStats(&stats);
+    ASSERT_EQ(10, int(stats.usage));
+    ASSERT_EQ(0, int(stats.pinned_usage));
+
+    // An in-use entry that is erased stays pinned until it is released.
+    LRUCache::Handle* h = cache->Insert("p", EncodeValue(0), 1, &NoopDeleter);
+    for (int i = 200; i < 220; i++) {
+        cache->Release(cache->Insert(EncodeKey(i).c_str(), EncodeValue(i), 1, &NoopDeleter));
+    }
+    cache->Erase("p");
+    LRUCache::Handle* again = cache->Lookup("p");
+    ASSERT_TRUE(again == NULL);
+    cache->GetStats(&stats);
+    ASSERT_EQ(10, int(stats.usage));
+    ASSERT_EQ(1, int(stats.pinned_usage));
+    cache->Release(h);
+    cache->GetStats(&stats);
+    ASSERT_EQ(9, int(stats.usage));
+    ASSERT_EQ(0, int(stats.pinned_usage));
+    cache->Delete();
+}
+
+TEST(LRUCache, PinnedEntriesStayCached) {
+    LRUCacheOptions options;
+    CheckPinnedEntriesStayCached(options);
+    options.policy = kClockPolicy;
+    CheckPinnedEntriesStayCached(options);
+    options.policy = kSegmentedLRUPolicy;
+    CheckPinnedEntriesStayCached(options);
+    CheckPinnedEntriesStayCached(LockFreeOptions());
+}
+
+static int CountCached(LRUCache* cache, int begin, int end, bool skewed) {
+    int cached = 0;
+    for (int i = begin; i < end; i++) {
+        const std::string k = EncodeKey(i);
+        LRUCache::Handle* h = skewed ? cache->Lookup(k.data(), k.size(), uint64_t(7))
+                                     : cache->Lookup(k.data(), k.size());
+        if (h != NULL) {
+            cached++;
+            cache->Release(h);
+        }
+    }
+    return cached;
+}
+
+TEST(LRUCache, GlobalCapacity) {
+    LRUCacheOptions options;
+    options.capacity = 100;
+    options.num_shard_bits = 2;
+
+    // Keys sharing a caller hash all land in one shard, which can only
+    // use the whole capacity if it is global.
+    for (int global = 0; global < 2; global++) {
+        options.global_capacity = (global != 0);
+        LRUCache* cache = LRUCache::New(options);
+        for (int i = 0; i < 100; i++) {
+            const std::string k = EncodeKey(i);
+            cache->Release(cache->Insert(k.data(), k.size(), uint64_t(7), NULL, 1, &NoopDeleter));
+        }
+        ASSERT_EQ(global ? 100 : 25, CountCached(cache, 0, 100, true));
+        cache->Delete();
+    }
+
+    // Inserts into the other shards evict the coldest entries of the
+    // full one, and the total stays within capacity.
+    LRUCache* cache = LRUCache::New(options);
+    for (int i = 0; i < 100; i++) {
+        const std::string k = EncodeKey(i);
+        cache->Release(cache->Insert(k.data(), k.size(), uint64_t(7), NULL, 1, &NoopDeleter));
+    }
+    ASSERT_EQ(10, CountCached(cache, 0, 10, true));
+    for (int i = 100; i < 150; i++) {
+        cache->Release(cache->Insert(EncodeKey(i).c_str(), NULL, 1, &NoopDeleter));
+    }
+    LRUCacheStats stats;
+    cache->GetStats(&stats);
+    ASSERT_EQ(100, int(stats.usage));
+    ASSERT_EQ(50, int(stats.evictions));
+    ASSERT_EQ(10, CountCached(cache, 0, 10, true));
+    ASSERT_EQ(0, CountCached(cache, 10, 60, true));
+    ASSERT_EQ(40, CountCached(cache, 60, 100, true));
+    ASSERT_EQ(50, CountCached(cache, 100, 150, false));
+
+    // Pinned entries are not evicted; the budget is met once they go.
+    std::vector<LRUCache::Handle*> pinned;
+    for (int i = 200; i < 300; i++) {
+        pinned.push_back(cache->Insert(EncodeKey(i).c_str(), NULL, 1, &NoopDeleter));
+    }
+    cache->GetStats(&stats);
+    ASSERT_EQ(100, int(stats.pinned_usage));
+    for (size_t i = 0; i < pinned.size(); i++) {
+        cache->Release(pinned[i]);
+    }
+    cache->GetStats(&stats);
+    ASSERT_EQ(100, int(stats.usage));
+    ASSERT_EQ(0, int(stats.pinned_usage));
+    cache->Delete();
+}
+
+static void CheckSetCapacity(bool global_capacity) {
+    LRUCacheOptions options;
+    options.capacity = 1000;
+    options.num_shard_bits = 2;
+    options.global_capacity = global_capacity;
+    LRUCache* cache = LRUCache::New(options);
+    LRUCacheStats stats;
+
+    for (int i = 0; i < 2000; i++) {
+        cache->Release(cache->Insert(EncodeKey(i).c_str(), NULL, 1, &NoopDeleter));
+    }
+    LRUCache::Handle* pinned = cache->Lookup(EncodeKey(1999).c_str());
+    ASSERT_TRUE(pinned != NULL);
+    ASSERT_EQ(1000, int(cache->GetCapacity()));
+
+    // Shrinking evicts right away, except for entries still referenced.
+    cache->SetCapacity(100);
+    ASSERT_EQ(100, int(cache->GetCapacity()));
+    cache->GetStats(&stats);
+    ASSERT_TRUE_MSG(stats.usage <= 100, "usage %d", int(stats.usage));
+    ASSERT_TRUE(stats.evictions >= 1900);
+    LRUCache::Handle* h = cache->Lookup(EncodeKey(1999).c_str());
+    ASSERT_TRUE(h != NULL);
+    cache->Release(h);
+    cache->Release(pinned);
+
+    // Growing makes room again.
+    cache->SetCapacity(1000);
+    for (int i = 0; i < 2000; i++) {
+        cache->Release(cache->Insert(EncodeKey(i).c_str(), NULL, 1, &NoopDeleter));
+    }
+    cache->GetStats(&stats);
+    // A global budget may run past capacity by the shards' slack.
+    ASSERT_TRUE_MSG(stats.usage > 900 && stats.usage <= 1000 + 1000 / 64, "usage %d", int(stats.usage));
+    cache->Delete();
+}
+
+TEST(LRUCache, SetCapacity) {
+    CheckSetCapacity(false);
+    CheckSetCapacity(true);
+}
+
+TEST(LRUCache, SetCapacityBoundsEachSweep) {
+    LRUCacheOptions options;
+    options.capacity = 1000;
+    options.num_shard_bits = 0;
+    options.instrument_locks = true;
+    LRUCache* cache = LRUCache::New(options);
+    LRUCacheStats stats;
+
+    // Entries that are moved to the in-use list count against each
+    // batch like evicted ones, so shrinking past 640 pinned entries and
+    // 360 unpinned ones takes at least 1000 / 64 acquisitions of the mutex.
+    std::vector<LRUCache::Handle*> pinned;
+    for (int i = 0; i < 1000; i++) {
+        cache->Release(cache->Insert(EncodeKey(i).c_str(), NULL, 1, &NoopDeleter));
+        if (i < 640) {
+            pinned.push_back(cache->Lookup(EncodeKey(i).c_str()));
+        }
+    }
+    cache->GetStats(&stats);
+    const uint64_t before = stats.lock_acquisitions;
+    cache->SetCapacity(10);
+    LRUCacheStats after;
+    cache->GetStats(&after);
+    ASSERT_EQ(360, int(after.evictions));
+    ASSERT_TRUE_MSG(after.lock_acquisitions - before >= 1000 / 64,
+                    "acquisitions %d", int(after.lock_acquisitions - before));
+    for (size_t i = 0; i < pinned.size(); i++) {
+        cache->Release(pinned[i]);
+    }
+    cache->Delete();
+}
+
+static void CheckSetCapacityTrimsSlab(LRUCacheOptions options) {
+    options.capacity = 20000;
+    options.num_shard_bits = 2;
+    LRUCache* cache = LRUCache::New(options);
+    for (int i = 0; i < 20000; i++) {
+        cache->Release(cache->Insert(EncodeKey(i).c_str(), EncodeValue(i), 1, &NoopDeleter));
+    }
+    LRUCacheStats full;
+    cache->GetStats(&full);
+    ASSERT_TRUE(full.slab_bytes >= 20000 * 128);
+
+    // The survivors are the newest entries, packed in the newest chunks,
+    // so nearly all of the slabs can go back.
+    cache->SetCapacity(200);
+    LRUCacheStats shrunk;
+    cache->GetStats(&shrunk);
+    ASSERT_TRUE_MSG(shrunk.slab_bytes < full.slab_bytes / 10,
+                    "slab bytes %d of %d", int(shrunk.slab_bytes), int(full.slab_bytes));
+
+    // Survivors stay intact, and the trimmed slabs grow back.
+    for (int i = 19900; i < 20000; i++) {
+        LRUCache::Handle* h = cache->Lookup(EncodeKey(i).c_str());
+        ASSERT_TRUE(h != NULL);
+        ASSERT_EQ(i, DecodeValue(cache->Value(h)));
+        cache->Release(h);
+    }
+    cache->SetCapacity(20000);
+    for (int i = 20000; i < 30000; i++) {
+        cache->Release(cache->Insert(EncodeKey(i).c_str(), EncodeValue(i), 1, &NoopDeleter));
+    }
+    for (int i = 20000; i < 30000; i += 7) {
+        LRUCache::Handle* h = cache->Lookup(EncodeKey(i).c_str());
+        ASSERT_TRUE(h != NULL);
+        ASSERT_EQ(i, DecodeValue(cache->Value(h)));
+        cache->Release(h);
+    }
+    cache->Delete();
+}
+
+TEST(LRUCache, SetCapacityTrimsSlab) {
+    CheckSetCapacityTrimsSlab(LRUCacheOptions());
+    CheckSetCapacityTrimsSlab(LockFreeOptions());
+}
+
+static std::atomic<int> expired_deletes(0);
+static void ExpiredDeleter(const char* /*key*/, void* /*value*/) {
+    expired_deletes++;
+}
+
+static void CheckTimeToLive(LRUCacheOptions options) {
+    options.capacity = 1000;
+    options.num_shard_bits = 0;
+    LRUCache* cache = LRUCache::New(options);
+    LRUCacheStats stats;
+    expired_deletes = 0;
+
+    // Entries meant to expire get 1ms and are waited on for 60 times
+    // that; ones that must not get 100s.  A slow machine can only make
+    // the short ones expire earlier, which the test never looks at.
+    cache->Release(cache->InsertWithTTL("short", 5, NULL, 1, &ExpiredDeleter, 1));
+    cache->Release(cache->InsertWithTTL("long", 4, NULL, 1, &ExpiredDeleter, 100000));
+    cache->Release(cache->Insert("forever", NULL, 1, &ExpiredDeleter));
+    LRUCache::Handle* h = cache->Lookup("long");
+    ASSERT_TRUE(h != NULL);
+    cache->Release(h);
+
+    // A lookup of an expired entry misses and removes it.
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    ASSERT_TRUE(cache->Lookup("short") == NULL);
+    ASSERT_EQ(1, int(expired_deletes));
+    h = cache->Lookup("long");
+    ASSERT_TRUE(h != NULL);
+    cache->Release(h);
+    h = cache->Lookup("forever");
+    ASSERT_TRUE(h != NULL);
+    cache->Release(h);
+
+    // Expired entries that are never looked up are reaped.
+    for (int i = 0; i < 100; i++) {
+        const std::string k = EncodeKey(i);
+        cache->Release(cache->InsertWithTTL(k.data(), k.size(), NULL, 1, &ExpiredDeleter, 1));
+    }
+    h = cache->InsertWithTTL("pinned", 6, NULL, 1, &ExpiredDeleter, 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    cache->ReapExpired();
+    cache->GetStats(&stats);
+    ASSERT_EQ(102, int(stats.expirations));
+    ASSERT_EQ(0, int(stats.erases));
+    ASSERT_EQ(3, int(stats.usage));
+    ASSERT_EQ(2, int(stats.entries));
+    ASSERT_TRUE(cache->Lookup("pinned") == NULL);
+    ASSERT_EQ(101, int(expired_deletes));
+    cache->Release(h);
+    ASSERT_EQ(102, int(expired_deletes));
+
+    // Reinserting without a TTL keeps the key.
+    cache->Release(cache->InsertWithTTL("long", 4, NULL, 1, &ExpiredDeleter, 1));
+    cache->Release(cache->Insert("long", NULL, 1, &ExpiredDeleter));
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    cache->ReapExpired();
+    h = cache->Lookup("long");
+    ASSERT_TRUE(h != NULL);
+    cache->Release(h);
+    cache->Delete();
+
+    // The background reaper needs no calls at all.
+    options.reap_interval_millis = 5;
+    cache = LRUCache::New(options);
+    for (int i = 0; i < 10; i++) {
+        const std::string k = EncodeKey(i);
+        cache->Release(cache->InsertWithTTL(k.data(), k.size(), NULL, 1, &NoopDeleter, 1));
+    }
+    for (int i = 0; i < 200; i++) {
+        cache->GetStats(&stats);
+        if (stats.expirations == 10) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_EQ(10, int(stats.expirations));
+    ASSERT_EQ(0, int(stats.usage));
+    cache->Delete();
+}
+
+TEST(LRUCache, TimeToLive) {
+    LRUCacheOptions options;
+    CheckTimeToLive(options);
+    options.lock_free_lookup = true;
+    CheckTimeToLive(options);
+}
+
+static std::atomic<int> loads(0);
+static bool SlowLoader(const char* /*key*/, size_t /*key_len*/, void* arg, void** value, size_t* charge) {
+    loads++;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    *value = arg;
+    *charge = 1;
+    return arg != NULL;
+}
+
+static void CheckLookupOrCompute(LRUCacheOptions options) {
+    options.capacity = 100;
+    LRUCache* cache = LRUCache::New(options);
+    loads = 0;
+
+    // A miss loads once; later calls hit.
+    for (int i = 0; i < 2; i++) {
+        LRUCache::Handle* h = cache->LookupOrCompute("k", 1, &SlowLoader, EncodeValue(7), &NoopDeleter);
+        ASSERT_TRUE(h != NULL);
+        ASSERT_EQ(7, DecodeValue(cache->Value(h)));
+        cache->Release(h);
+    }
+    ASSERT_EQ(1, int(loads));
+
+    // A failed load inserts nothing.
+    ASSERT_TRUE(cache->LookupOrCompute("none", 4, &SlowLoader, NULL, &NoopDeleter) == NULL);
+    ASSERT_TRUE(cache->Lookup("none") == NULL);
+    ASSERT_EQ(2, int(loads));
+
+    // Concurrent misses on one key share a single load.
+    loads = 0;
+    std::vector<std::thread> threads;
+    std::atomic<int> found(0);
+    for (int t = 0; t < 8; t++) {
+        threads.push_back(std::thread([&cache, &found] {
+            LRUCache::Handle* h = cache->LookupOrCompute("hot", 3, &SlowLoader, EncodeValue(9), &NoopDeleter);
+            if (h != NULL) {
+                found += (DecodeValue(cache->Value(h)) == 9);
+                cache->Release(h);
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+    ASSERT_EQ(1, int(loads));
+    ASSERT_EQ(8, int(found));
+    cache->Delete();
+}
+
+TEST(LRUCache, LookupOrCompute) {
+    LRUCacheOptions options;
+    CheckLookupOrCompute(options);
+    options.lock_free_lookup = true;
+    CheckLookupOrCompute(options);
+}
+
+// An asynchronous store: loads are started into "started_loads" and
+// finished later by the test.
+static std::vector<LRUCache::Load*> started_loads;
+static void StartLoad(LRUCache::Load* load, const char* /*key*/, size_t /*key_len*/, void* /*arg*/) {
+    started_loads.push_back(load);
+}
+static std::vector<LRUCache::Handle*> done_handles;
+static void LoadDone(LRUCache::Handle* handle, void* /*arg*/) {
+    done_handles.push_back(handle);
+}
+
+TEST(LRUCache, LookupOrComputeAsync) {
+    LRUCacheOptions options;
+    options.capacity = 100;
+    LRUCache* cache = LRUCache::New(options);
+    started_loads.clear();
+    done_handles.clear();
+
+    // Misses while the load is in progress start nothing new.
+    for (int i = 0; i < 3; i++) {
+        cache->LookupOrComputeAsync("k", 1, &StartLoad, &LoadDone, NULL, &NoopDeleter);
+    }
+    ASSERT_EQ(1, int(started_loads.size()));
+    ASSERT_EQ(0, int(done_handles.size()));
+
+    // A blocking caller joins the same load.
+    loads = 0;
+    LRUCache::Handle* blocked = NULL;
+    LRUCacheStats stats;
+    cache->GetStats(&stats);
+    const uint64_t misses = stats.misses;
+    std::thread waiter([&cache, &blocked] {
+        blocked = cache->LookupOrCompute("k", 1, &SlowLoader, EncodeValue(1), &NoopDeleter);
+    });
+    // The waiter joins the load under the mutex it counts its miss under.
+    while (stats.misses == misses) {
+        std::this_thread::yield();
+        cache->GetStats(&stats);
+    }
+    cache->FinishLoad(started_loads[0], true, EncodeValue(5), 1);
+    waiter.join();
+    ASSERT_EQ(0, int(loads));
+    ASSERT_TRUE(blocked != NULL);
+    ASSERT_EQ(5, DecodeValue(cache->Value(blocked)));
+    cache->Release(blocked);
+    ASSERT_EQ(3, int(done_handles.size()));
+    for (size_t i = 0; i < done_handles.size(); i++) {
+        ASSERT_TRUE(done_handles[i] != NULL);
+        ASSERT_EQ(5, DecodeValue(cache->Value(done_handles[i])));
+        cache->Release(done_handles[i]);
+    }
+
+    // Hits call back right away.
+    done_handles.clear();
+    cache->LookupOrComputeAsync("k", 1, &StartLoad, &LoadDone, NULL, &NoopDeleter);
+    ASSERT_EQ(1, int(started_loads.size()));
+    ASSERT_EQ(1, int(done_handles.size()));
+    cache->Release(done_handles[0]);
+
+    // Failed loads call back with NULL.
+    done_handles.clear();
+    cache->LookupOrComputeAsync("none", 4, &StartLoad, &LoadDone, NULL, &NoopDeleter);
+    ASSERT_EQ(2, int(started_loads.size()));
+    cache->FinishLoad(started_loads[1], false, NULL, 0);
+    ASSERT_EQ(1, int(done_handles.size()));
+    ASSERT_TRUE(done_handles[0] == NULL);
+    ASSERT_TRUE(cache->Lookup("none") == NULL);
+    cache->Delete();
+}
+
+TEST(LRUCache, LoadOvertakenByWrite) {
+    LRUCacheOptions options;
+    options.capacity = 100;
+    LRUCache* cache = LRUCache::New(options);
+    started_loads.clear();
+
+    // An Insert() during the load wins over the loaded value, which
+    // still reaches the callers that waited for it.
+    done_handles.clear();
+    cache->LookupOrComputeAsync("k", 1, &StartLoad, &LoadDone, NULL, &NoopDeleter);
+    cache->Release(cache->Insert("k", EncodeValue(2), 1, &NoopDeleter));
+    cache->FinishLoad(started_loads[0], true, EncodeValue(1), 1);
+    ASSERT_EQ(1, int(done_handles.size()));
+    ASSERT_EQ(1, DecodeValue(cache->Value(done_handles[0])));
+    cache->Release(done_handles[0]);
+    LRUCache::Handle* h = cache->Lookup("k");
+    ASSERT_TRUE(h != NULL);
+    ASSERT_EQ(2, DecodeValue(cache->Value(h)));
+    cache->Release(h);
+
+    // So does an Erase().
+    done_handles.clear();
+    cache->LookupOrComputeAsync("e", 1, &StartLoad, &LoadDone, NULL, &NoopDeleter);
+    cache->Erase("e");
+    cache->FinishLoad(started_loads[1], true, EncodeValue(3), 1);
+    ASSERT_EQ(1, int(done_handles.size()));
+    ASSERT_EQ(3, DecodeValue(cache->Value(done_handles[0])));
+    cache->Release(done_handles[0]);
+    ASSERT_TRUE(cache->Lookup("e") == NULL);
+
+    LRUCacheStats stats;
+    cache->GetStats(&stats);
+    ASSERT_EQ(1, int(stats.usage));
+    ASSERT_EQ(0, int(stats.pinned_usage));
+    cache->Delete();
+}
+
+static void CollectMissing(const char* key, size_t key_len, void* arg) {
+    static_cast<std::vector<std::string>*>(arg)->push_back(std::string(key, key_len));
+}
+
+static bool CachedInline(LRUCache* cache, int key, int want) {
+    const std::string k = EncodeKey(key);
+    int value = 0;
+    return cache->LookupCopy(k.data(), k.size(), &value, sizeof(value)) && value == want;
+}
+
+TEST(LRUCache, Snapshot) {
+    const char* path = "lru_cache_test.snapshot";
+    LRUCacheOptions options;
+    options.capacity = 100;
+    options.num_shard_bits = 0;
+    LRUCache* cache = LRUCache::New(options);
+    for (int i = 0; i < 50; i++) {
+        const std::string k = EncodeKey(i);
+        const int value = i * 10;
+        cache->Release(cache->InsertInline(k.data(), k.size(), &value, sizeof(value), 1));
+    }
+    cache->Release(cache->Insert("pointer", EncodeValue(1), 1, &NoopDeleter));
+    ASSERT_TRUE(CachedInline(cache, 0, 0));
+    ASSERT_TRUE(cache->SaveSnapshot(path));
+    cache->Delete();
+
+    // Everything comes back, except values that could not be saved.
+    cache = LRUCache::New(options);
+    std::vector<std::string> missing;
+    ASSERT_TRUE(cache->LoadSnapshot(path, NULL, &CollectMissing, &missing));
+    for (int i = 0; i < 50; i++) {
+        ASSERT_TRUE_MSG(CachedInline(cache, i, i * 10), "key %d", i);
+    }
+    ASSERT_TRUE(cache->Lookup("pointer") == NULL);
+    ASSERT_EQ(1, int(missing.size()));
+    ASSERT_TRUE(missing[0] == "pointer");
+    cache->Delete();
+
+    // A smaller cache keeps the hottest entries, without inserting and
+    // then evicting the rest.
+    options.capacity = 10;
+    cache = LRUCache::New(options);
+    ASSERT_TRUE(cache->LoadSnapshot(path));
+    LRUCacheStats stats;
+    cache->GetStats(&stats);
+    ASSERT_EQ(10, int(stats.inserts));
+    ASSERT_EQ(0, int(stats.evictions));
+    ASSERT_TRUE(CachedInline(cache, 0, 0));
+    ASSERT_TRUE(CachedInline(cache, 41, 410));
+    ASSERT_TRUE(!CachedInline(cache, 40, 400));
+
+    // Missing and damaged files insert nothing.
+    ASSERT_TRUE(!cache->LoadSnapshot("lru_cache_test.missing"));
+    FILE* f = fopen(path, "r+b");
+    ASSERT_TRUE(f != NULL);
+    char header[24];
+    ASSERT_EQ(1, int(fread(header, sizeof(header), 1, f)));
+    fclose(f);
+    f = fopen(path, "wb");
+    fwrite(header, sizeof(header), 1, f);
+    fclose(f);
+    ASSERT_TRUE(!cache->LoadSnapshot(path));
+    remove(path);
+    cache->Delete();
+}
+
+static void CheckExpectedEntries(LRUCacheIndexType index_type) {
+    LRUCacheOptions options;
+    options.capacity = 10000;
+    options.num_shard_bits = 2;
+    options.index_type = index_type;
+    options.expected_entries = 4000;
+    LRUCache* cache = LRUCache::New(options);
+    LRUCacheStats before, stats;
+    cache->GetStats(&before);
+
+    // A pre-hashed batch fills the pre-sized indexes without resizing.
+    // Stay a little below the expected count, as the shards' shares vary.
+    std::vector<std::string> names;
+    for (int i = 0; i < 3600; i++) {
+        names.push_back(EncodeKey(i));
+    }
+    std::vector<const char*> keys;
+    std::vector<size_t> key_lens, charges;
+    std::vector<uint64_t> hashes;
+    std::vector<void*> values;
+    for (int i = 0; i < 3600; i++) {
+        keys.push_back(names[i].data());
+        key_lens.push_back(names[i].size());
+        hashes.push_back(LRUCache::HashKey(names[i].data(), names[i].size()));
+        values.push_back(EncodeValue(i));
+        charges.push_back(1);
+    }
+    cache->MultiInsert(keys.size(), keys.data(), key_lens.data(), hashes.data(), values.data(),
+                       charges.data(), &NoopDeleter, NULL);
+    cache->GetStats(&stats);
+    ASSERT_EQ(3600, int(stats.entries));
+    ASSERT_EQ(int(before.table_resizes), int(stats.table_resizes));
+    for (int i = 0; i < 3600; i += 7) {
+        LRUCache::Handle* h = cache->Lookup(names[i].c_str());
+        ASSERT_TRUE(h != NULL);
+        ASSERT_EQ(i, DecodeValue(cache->Value(h)));
+        cache->Release(h);
+    }
+
+    // Nor do they shrink below the expected size.
+    for (int i = 0; i < 3600; i++) {
+        cache->Erase(names[i].c_str());
+    }
+    cache->GetStats(&stats);
+    ASSERT_EQ(0, int(stats.entries));
+    ASSERT_EQ(int(before.table_resizes), int(stats.table_resizes));
+    ASSERT_EQ(int(before.table_slots), int(stats.table_slots));
+    cache->Delete();
+}
+
+TEST(LRUCache, ExpectedEntries) {
+    CheckExpectedEntries(kChainedIndex);
+    CheckExpectedEntries(kOpenAddressingIndex);
+}
+
+TEST(LRUCache, SecondaryCache) {
+    const char* path = "lru_cache_test.log";
+    LRUSecondaryCache* secondary = LRUSecondaryCache::NewLogFile(path, 8 << 20);
+    ASSERT_TRUE(secondary != NULL);
+    LRUCacheOptions options;
+    options.capacity = 10;
+    options.num_shard_bits = 0;
+    options.secondary_cache = secondary;
+    LRUCache* cache = LRUCache::New(options);
+
+    // Evicted inline values come back on a miss.
+    for (int i = 0; i < 100; i++) {
+        const std::string k = EncodeKey(i);
+        const int value = i * 10;
+        cache->Release(cache->InsertInline(k.data(), k.size(), &value, sizeof(value), 1));
+    }
+    ASSERT_TRUE(CachedInline(cache, 0, 0));
+    ASSERT_TRUE(CachedInline(cache, 0, 0));
+    std::vector<std::string> names;
+    for (int i = 1; i < 5; i++) {
+        names.push_back(EncodeKey(i));
+    }
+    const char* keys[4];
+    size_t key_lens[4];
+    LRUCache::Handle* handles[4];
+    for (int i = 0; i < 4; i++) {
+        keys[i] = names[i].data();
+        key_lens[i] = names[i].size();
+    }
+    cache->MultiLookup(4, keys, key_lens, handles);
+    for (int i = 0; i < 4; i++) {
+        ASSERT_TRUE(handles[i] != NULL);
+        ASSERT_EQ((i + 1) * 10, *static_cast<int*>(cache->Value(handles[i])));
+        cache->Release(handles[i]);
+    }
+
+    // Erased keys are gone from both tiers, and values the cache cannot
+    // copy are not kept.
+    cache->Erase(EncodeKey(50).c_str());
+    ASSERT_TRUE(!CachedInline(cache, 50, 500));
+    cache->Release(cache->Insert("pointer", EncodeValue(1), 1, &NoopDeleter));
+    for (int i = 100; i < 120; i++) {
+        const std::string k = EncodeKey(i);
+        cache->Release(cache->InsertInline(k.data(), k.size(), &i, sizeof(i), 1));
+    }
+    ASSERT_TRUE(cache->Lookup("pointer") == NULL);
+
+    // Inserting a key forgets its older copy, even if the new value is
+    // not one that can be copied.
+    const std::string k60 = EncodeKey(60);
+    cache->Release(cache->Insert(k60.data(), k60.size(), EncodeValue(1), 1, &NoopDeleter));
+    for (int i = 120; i < 140; i++) {
+        const std::string k = EncodeKey(i);
+        cache->Release(cache->InsertInline(k.data(), k.size(), &i, sizeof(i), 1));
+    }
+    ASSERT_TRUE(cache->Lookup(k60.data(), k60.size()) == NULL);
+
+    // Copies remain readable once their segments are written out.
+    std::vector<char> value(1000);
+    for (int i = 0; i < 3000; i++) {
+        const std::string k = "big" + EncodeKey(i);
+        memset(value.data(), 'a' + i % 26, value.size());
+        cache->Release(cache->InsertInline(k.data(), k.size(), value.data(), value.size(), 1));
+        if (i % 500 == 0) {
+            // Give the writer time, so that no segment is dropped.
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    }
+    for (int i = 0; i < 2000; i += 97) {
+        const std::string k = "big" + EncodeKey(i);
+        LRUCache::Handle* h = cache->Lookup(k.data(), k.size());
+        ASSERT_TRUE_MSG(h != NULL, "key %s", k.c_str());
+        ASSERT_EQ(1000, int(cache->ValueSize(h)));
+        const char* v = static_cast<const char*>(cache->Value(h));
+        ASSERT_TRUE(v[0] == 'a' + i % 26 && v[999] == 'a' + i % 26);
+        cache->Release(h);
+    }
+    cache->Delete();
+    delete secondary;
+    remove(path);
+}
+
+TEST(LRUCache, SecondaryCacheLookupOrCompute) {
+    const char* path = "lru_cache_test.log";
+    LRUSecondaryCache* secondary = LRUSecondaryCache::NewLogFile(path, 8 << 20);
+    ASSERT_TRUE(secondary != NULL);
+    LRUCacheOptions options;
+    options.capacity = 10;
+    options.num_shard_bits = 0;
+    options.secondary_cache = secondary;
+    LRUCache* cache = LRUCache::New(options);
+    for (int i = 0; i < 20; i++) {
+        const std::string k = EncodeKey(i);
+        const int value = i * 10;
+        cache->Release(cache->InsertInline(k.data(), k.size(), &value, sizeof(value), 1));
+    }
+
+    // A key evicted to the secondary cache is moved back without loading
+    // it, by blocking and asynchronous callers alike.
+    loads = 0;
+    const std::string k0 = EncodeKey(0);
+    LRUCache::Handle* h = cache->LookupOrCompute(k0.data(), k0.size(), &SlowLoader, EncodeValue(1), &NoopDeleter);
+    ASSERT_TRUE(h != NULL);
+    ASSERT_EQ(0, *static_cast<int*>(cache->Value(h)));
+    cache->Release(h);
+    ASSERT_EQ(0, int(loads));
+    started_loads.clear();
+    done_handles.clear();
+    const std::string k1 = EncodeKey(1);
+    cache->LookupOrComputeAsync(k1.data(), k1.size(), &StartLoad, &LoadDone, NULL, &NoopDeleter);
+    ASSERT_EQ(0, int(started_loads.size()));
+    ASSERT_EQ(1, int(done_handles.size()));
+    ASSERT_TRUE(done_handles[0] != NULL);
+    ASSERT_EQ(10, *static_cast<int*>(cache->Value(done_handles[0])));
+    cache->Release(done_handles[0]);
+
+    // Only keys missing from both tiers are loaded.
+    h = cache->LookupOrCompute("new", 3, &SlowLoader, EncodeValue(7), &NoopDeleter);
+    ASSERT_TRUE(h != NULL);
+    ASSERT_EQ(7, DecodeValue(cache->Value(h)));
+    cache->Release(h);
+    ASSERT_EQ(1, int(loads));
+    cache->Delete();
+    delete secondary;
+    remove(path);
+}
+
+// Copies heap-allocated strings deleted by DeleteString().
+static std::atomic<int> strings_made(0);
+static std::atomic<int> strings_deleted(0);
+static void DeleteString(const char* /*key*/, void* value) {
+    delete static_cast<std::string*>(value);
+    strings_deleted++;
+}
+struct StringSerializer: public LRUCacheSerializer {
+    virtual bool Serialize(
+        const char* /*key*/, size_t /*key_len*/, void* value, void (*deleter)(const char* key, void* value),
+        std::string* out
+    ) {
+        if (deleter != &DeleteString) {
+            return false;
+        }
+        out->append(*static_cast<std::string*>(value));
+        return true;
+    }
+    virtual bool Deserialize(
+        const char* /*key*/, size_t /*key_len*/, const char* data, size_t size, void** value,
+        void (**deleter)(const char* key, void* value)
+    ) {
+        *value = new std::string(data, size);
+        strings_made++;
+        *deleter = &DeleteString;
+        return true;
+    }
+};
+
+TEST(LRUCache, SecondaryCacheSerializer) {
+    const char* path = "lru_cache_test.log";
+    LRUSecondaryCache* secondary = LRUSecondaryCache::NewLogFile(path, 8 << 20);
+    ASSERT_TRUE(secondary != NULL);
+    StringSerializer serializer;
+    LRUCacheOptions options;
+    options.capacity = 10;
+    options.num_shard_bits = 0;
+    options.secondary_cache = secondary;
+    options.serializer = &serializer;
+    LRUCache* cache = LRUCache::New(options);
+    strings_made = 0;
+    strings_deleted = 0;
+    for (int i = 0; i < 20; i++) {
+        const std::string k = EncodeKey(i);
+        strings_made++;
+        cache->Release(cache->Insert(k.data(), k.size(), new std::string("value" + k), 1, &DeleteString));
+    }
+    cache->Release(cache->Insert("pointer", EncodeValue(1), 1, &NoopDeleter));
+    const int inline_value = 42;
+    cache->Release(cache->InsertInline("inline", 6, &inline_value, sizeof(inline_value), 1));
+    for (int i = 20; i < 40; i++) {
+        const std::string k = EncodeKey(i);
+        strings_made++;
+        cache->Release(cache->Insert(k.data(), k.size(), new std::string("value" + k), 1, &DeleteString));
+    }
+
+    // Values with a deleter come back rebuilt, by lookups and loads alike.
+    loads = 0;
+    for (int i = 0; i < 2; i++) {
+        const std::string k = EncodeKey(i);
+        LRUCache::Handle* h = (i == 0) ? cache->Lookup(k.data(), k.size())
+                                       : cache->LookupOrCompute(k.data(), k.size(), &SlowLoader, NULL, &NoopDeleter);
+        ASSERT_TRUE_MSG(h != NULL, "key %d", i);
+        ASSERT_TRUE(*static_cast<std::string*>(cache->Value(h)) == "value" + k);
+        cache->Release(h);
+    }
+    ASSERT_EQ(0, int(loads));
+
+    // Plain bytes still come back as they are, and values the serializer
+    // declines are not kept.
+    int value = 0;
+    ASSERT_TRUE(cache->LookupCopy("inline", 6, &value, sizeof(value)));
+    ASSERT_EQ(42, value);
+    ASSERT_TRUE(cache->Lookup("pointer") == NULL);
+
+    // Every value made, inserted or rebuilt, is deleted once.
+    cache->Delete();
+    ASSERT_EQ(int(strings_made), int(strings_deleted));
+    delete secondary;
+    remove(path);
+}
+
+TEST(LRUCache, SecondaryCacheConcurrentTake) {
+    const char* path = "lru_cache_take_test.log";
+    LRUSecondaryCache* secondary = LRUSecondaryCache::NewLogFile(path, 8 << 20);
+    ASSERT_TRUE(secondary != NULL);
+    std::vector<char> value(1000);
+    for (int round = 0; round < 200; round++) {
+        // Each copy is taken once, whether it is still staged, in memory or
+        // on disk by the time the readers get to it.
+        const std::string k = EncodeKey(round);
+        memset(value.data(), 'a' + round % 26, value.size());
+        secondary->Insert(k.data(), k.size(), value.data(), value.size(), 1);
+        std::atomic<int> taken(0);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.push_back(std::thread([secondary, &k, &taken, round] {
+                std::string v;
+                size_t charge = 0;
+                if (secondary->Take(k.data(), k.size(), &v, &charge)) {
+                    if (v.size() == 1000 && v[999] == 'a' + round % 26 && charge == 1) {
+                        taken++;
+                    }
+                }
+            }));
+        }
+        for (size_t t = 0; t < threads.size(); t++) {
+            threads[t].join();
+        }
+        ASSERT_EQ(1, taken.load());
+        if (round % 20 == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    delete secondary;
+    remove(path);
+}
+
+TEST(LRUCache, SecondaryCacheIndex) {
+    const char* path = "lru_cache_index_test.log";
+    LRUSecondaryCache* secondary = LRUSecondaryCache::NewLogFile(path, 8 << 20);
+    ASSERT_TRUE(secondary != NULL);
+
+    // Enough small copies to grow the index several times, and erases
+    // that move the rest of their probe runs back.
+    const int kKeys = 20000;
+    for (int i = 0; i < kKeys; i++) {
+        const std::string k = EncodeKey(i);
+        secondary->Insert(k.data(), k.size(), &i, sizeof(i), 1);
+        if (i % 1000 == 999) {
+            // Give the writer time, so that no copy is dropped.
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+    for (int i = 0; i < kKeys; i += 3) {
+        const std::string k = EncodeKey(i);
+        secondary->Erase(k.data(), k.size());
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    for (int i = 0; i < kKeys; i++) {
+        const std::string k = EncodeKey(i);
+        std::string v;
+        size_t charge = 0;
+        const bool found = secondary->Take(k.data(), k.size(), &v, &charge);
+        ASSERT_TRUE_MSG(found == (i % 3 != 0), "key %d", i);
+        if (found) {
+            int value;
+            ASSERT_EQ(int(sizeof(value)), int(v.size()));
+            memcpy(&value, v.data(), sizeof(value));
+            ASSERT_EQ(i, value);
+        }
+    }
+    delete secondary;
+    remove(path);
+}
+
+// Holds one copy of value 1, and hands it over only after another thread
+// has erased the key (replacement < 0) or inserted "replacement" for it.
+struct RacingSecondaryCache: public LRUSecondaryCache {
+    LRUCache* cache;
+    int replacement;
+    bool held;
+
+    virtual void Insert(const char* /*key*/, size_t /*key_len*/, const void* /*value*/, size_t /*value_size*/,
+                        size_t /*charge*/) { }
+    virtual bool Take(const char* key, size_t key_len, std::string* value, size_t* charge) {
+        if (!held) {
+            return false;
+        }
+        held = false;
+        std::thread racer([this, key, key_len] {
+            if (replacement < 0) {
+                cache->Erase(key, key_len);
+            } else {
+                cache->Release(cache->InsertInline(key, key_len, &replacement, sizeof(replacement), 1));
+            }
+        });
+        racer.join();
+        const int old = 1;
+        value->assign(reinterpret_cast<const char*>(&old), sizeof(old));
+        *charge = 1;
+        return true;
+    }
+    virtual void Erase(const char* /*key*/, size_t /*key_len*/) { }
+};
+
+TEST(LRUCache, SecondaryCachePromotionRace) {
+    for (int replacement = -1; replacement <= 2; replacement += 3) {
+        RacingSecondaryCache secondary;
+        LRUCacheOptions options;
+        options.capacity = 10;
+        options.num_shard_bits = 0;
+        options.secondary_cache = &secondary;
+        secondary.cache = LRUCache::New(options);
+        secondary.replacement = replacement;
+        secondary.held = true;
+
+        // The copy taken is older than the Erase() or Insert() that ran
+        // meanwhile, so it is not cached.
+        LRUCache* cache = secondary.cache;
+        const std::string k = EncodeKey(7);
+        for (int i = 0; i < 2; i++) {
+            LRUCache::Handle* h = cache->Lookup(k.data(), k.size());
+            if (replacement < 0) {
+                ASSERT_TRUE(h == NULL);
+            } else {
+                ASSERT_TRUE(h != NULL);
+                ASSERT_EQ(replacement, *static_cast<int*>(cache->Value(h)));
+                cache->Release(h);
+            }
+        }
+        cache->Delete();
+    }
+}
+
+TEST(LRUCache, AdmissionFilter) {
+    LRUCacheOptions options;
+    options.capacity = LRUCacheTest::kCacheSize;
+    options.num_shard_bits = 0;
+    options.admission_filter = true;
+    {
+        LRUCacheTest cacheTest(options);
+        auto p = &cacheTest;
+
+        // A hot set that fills the cache and is hit a few times...
+        for (int i = 0; i < LRUCacheTest::kCacheSize; i++) {
+            p->Insert(i, 100+i);
+        }
+        for (int r = 0; r < 3; r++) {
+            for (int i = 0; i < LRUCacheTest::kCacheSize; i++) {
+                ASSERT_EQ(100+i, p->Lookup(i));
+            }
+        }
+
+        // ...keeps its place against keys that are seen once, whose inserts
+        // are turned away.
+        for (int i = 0; i < 3 * LRUCacheTest::kCacheSize; i++) {
+            ASSERT_EQ(-1, p->Lookup(10000+i));
+            p->Insert(10000+i, i);
+        }
+        int cached = 0;
+        for (int i = 0; i < LRUCacheTest::kCacheSize; i++) {
+            if (p->Lookup(i) == 100+i) {
+                cached++;
+            }
+        }
+        ASSERT_TRUE_MSG(cached >= LRUCacheTest::kCacheSize * 9 / 10, "cached %d", cached);
+        LRUCacheStats stats;
+        p->cache_->GetStats(&stats);
+        ASSERT_TRUE(stats.rejections >= uint64_t(2 * LRUCacheTest::kCacheSize));
+        ASSERT_TRUE(p->deleted_keys_.size() >= stats.rejections);
+        ASSERT_TRUE(stats.usage <= size_t(LRUCacheTest::kCacheSize));
+
+        // A turned away entry is still returned to the caller.
+        LRUCache::Handle* h = p->cache_->Insert(
+            EncodeKey(20000).c_str(), EncodeValue(7), 1, &LRUCacheTest::Deleter
+        );
+        ASSERT_EQ(7, DecodeValue(p->cache_->Value(h)));
+        p->cache_->Release(h);
+
+        // A key that keeps coming back gets in.
+        for (int tries = 0; tries < 10 && p->Lookup(20000) == -1; tries++) {
+            p->Insert(20000, 7);
+        }
+        ASSERT_EQ(7, p->Lookup(20000));
+    }
+
+    // Without the filter, the same scan flushes the hot set.
+    options.admission_filter = false;
+    LRUCacheTest plainTest(options);
+    for (int i = 0; i < LRUCacheTest::kCacheSize; i++) {
+        plainTest.Insert(i, 100+i);
+        ASSERT_EQ(100+i, plainTest.Lookup(i));
+    }
+    for (int i = 0; i < 3 * LRUCacheTest::kCacheSize; i++) {
+        plainTest.Insert(10000+i, i);
+    }
+    ASSERT_EQ(-1, plainTest.Lookup(0));
+}
+
+TEST(LRUCache, AdmissionFilterSkipsPinnedVictim) {
+    LRUCacheOptions options;
+    options.capacity = 3;
+    options.num_shard_bits = 0;
+    options.admission_filter = true;
+    LRUCache* cache = LRUCache::New(options);
+
+    // The oldest entry is hot but held, so eviction would pass over it
+    // to the cold one after it.
+    LRUCache::Handle* hot = cache->Insert("hot", NULL, 1, &NoopDeleter);
+    for (int i = 0; i < 10; i++) {
+        cache->Release(cache->Lookup("hot"));
+    }
+    cache->Release(cache->Insert("cold", NULL, 1, &NoopDeleter));
+    cache->Release(cache->Insert("other", NULL, 1, &NoopDeleter));
+    for (int i = 0; i < 3; i++) {
+        cache->Release(cache->Lookup("other"));
+    }
+
+    // Seen a few times, the new key beats the cold entry, not the hot one.
+    for (int i = 0; i < 3; i++) {
+        ASSERT_TRUE(cache->Lookup("new") == NULL);
+    }
+    cache->Release(cache->Insert("new", NULL, 1, &NoopDeleter));
+    LRUCache::Handle* h = cache->Lookup("new");
+    ASSERT_TRUE(h != NULL);
+    cache->Release(h);
+    ASSERT_TRUE(cache->Lookup("cold") == NULL);
+    LRUCacheStats stats;
+    cache->GetStats(&stats);
+    ASSERT_EQ(0, int(stats.rejections));
+    cache->Release(hot);
+    cache->Delete();
+}
+
+TEST(LRUCache, NumaReplicas) {
+    LRUCacheOptions options;
+    options.capacity = 1000;
+    options.num_shard_bits = 2;
+    options.numa_replicas = true;
+    LRUCache* cache = LRUCache::New(options);
+    ASSERT_EQ(1000, int(cache->GetCapacity()));
+
+    // Threads find what they inserted, whichever node they run on.
+    std::vector<std::thread> threads;
+    std::atomic<int> found(0);
+    for (int t = 0; t < 4; t++) {
+        threads.push_back(std::thread([cache, t, &found] {
+            for (int i = t * 100; i < (t + 1) * 100; i++) {
+                const std::string k = EncodeKey(i);
+                cache->Release(cache->Insert(k.data(), k.size(), EncodeValue(i), 1, &NoopDeleter));
+                LRUCache::Handle* h = cache->Lookup(k.data(), k.size());
+                if (h != NULL && DecodeValue(cache->Value(h)) == i) {
+                    found++;
+                }
+                if (h != NULL) {
+                    cache->Release(h);
+                }
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+    ASSERT_EQ(400, found.load());
+
+    // Erase() reaches every replica.
+    for (int i = 0; i < 400; i++) {
+        cache->Erase(EncodeKey(i).c_str());
+    }
+    for (int i = 0; i < 400; i++) {
+        const std::string k = EncodeKey(i);
+        ASSERT_TRUE(cache->Lookup(k.data(), k.size()) == NULL);
+    }
+
+    // Loads finish in the replica they started in.
+    started_loads.clear();
+    done_handles.clear();
+    cache->LookupOrComputeAsync("load", 4, &StartLoad, &LoadDone, NULL, &NoopDeleter);
+    ASSERT_EQ(1, int(started_loads.size()));
+    cache->FinishLoad(started_loads[0], true, EncodeValue(7), 1);
+    ASSERT_EQ(1, int(done_handles.size()));
+    ASSERT_EQ(7, DecodeValue(cache->Value(done_handles[0])));
+    cache->Release(done_handles[0]);
+
+    LRUCacheStats stats;
+    cache->GetStats(&stats);
+    ASSERT_EQ(401, int(stats.inserts));
+    ASSERT_EQ(400, int(stats.hits));
+    ASSERT_EQ(400, int(stats.erases));
+    ASSERT_EQ(1, int(stats.usage));
+    cache->SetCapacity(500);
+    ASSERT_EQ(500, int(cache->GetCapacity()));
+    cache->Delete();
+}
+
+#ifdef __linux__
+// Run "fn" on a thread bound to "cpu", as far as the platform allows.
+template <class F>
+static void RunOnCpu(int cpu, F fn) {
+    std::thread t([cpu, &fn] {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+        fn();
+    });
+    t.join();
+}
+
+TEST(LRUCache, NumaReplicasOverwrite) {
+    LRUCacheOptions options;
+    options.capacity = 1000;
+    options.num_shard_bits = 2;
+    options.numa_replicas = true;
+    LRUCache* cache = LRUCache::New(options);
+    const int cpus = std::min(int(std::thread::hardware_concurrency()), 64);
+
+    // A value inserted on any CPU replaces the key for every CPU, whose
+    // replica may be another node's.
+    for (int writer = 0; writer < cpus; writer++) {
+        RunOnCpu(writer, [cache, writer] {
+            cache->Release(cache->Insert("key", EncodeValue(writer), 1, &NoopDeleter));
+        });
+        for (int reader = 0; reader < cpus; reader++) {
+            int value = -1;
+            RunOnCpu(reader, [cache, &value] {
+                LRUCache::Handle* h = cache->Lookup("key");
+                if (h != NULL) {
+                    value = DecodeValue(cache->Value(h));
+                    cache->Release(h);
+                }
+            });
+            ASSERT_TRUE_MSG(value == -1 || value == writer, "cpu %d read %d after cpu %d wrote", reader,
+                            value, writer);
+        }
+    }
+
+    // The replicas share the capacity rather than each having all of it.
+    for (int cpu = 0; cpu < cpus; cpu++) {
+        RunOnCpu(cpu, [cache, cpu] {
+            for (int i = 0; i < 2000; i++) {
+                const std::string k = EncodeKey(cpu * 2000 + i);
+                cache->Release(cache->Insert(k.data(), k.size(), NULL, 1, &NoopDeleter));
+            }
+        });
+    }
+    LRUCacheStats stats;
+    cache->GetStats(&stats);
+    ASSERT_TRUE_MSG(stats.usage <= 1000 + 4 * 4, "usage %d", int(stats.usage));
+    cache->Delete();
+}
+#endif
@@ -0,0 +1,267 @@
+// Copyright 2016 <chaishushan{AT}gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// The parts of a cache shard that LRUCache and TypedLRUCache share: the
+// hash a shard keys its entries by, and ShardPolicy, the recency lists of
+// a shard and the LRUCachePolicy decisions made on them.
+
+#pragma once
+
+#ifndef LRU_CACHE_SHARD_POLICY_H_
+#define LRU_CACHE_SHARD_POLICY_H_
+
+#include "cache.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+// The hash of a key kept by the shards: the high bits pick the shard,
+// the low bits index its table, so that the two never share bits in a
+// table of fewer than 2^40 slots.  Remixed so that a caller's hash with
+// weak bits in either half, such as std::hash of an integer, still
+// spreads over both.
+inline uint64_t ShardHash(uint64_t h) {
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 32);
+}
+
+// The recency lists of a shard and what its policy does with them: where
+// hits and new entries go, which entry eviction takes next, and how
+// entries held by clients leave the lists and come back.  A shard derives
+// from ShardPolicy<Shard, Entry, Link> and calls it with its mutex held.
+//
+// "Link" holds the "next" and "prev" pointers, of type Link*, and is the
+// type of the list heads; it may be a base of "Entry", so that heads need
+// not be whole entries.  "Entry" also has:
+//
+//   size_t charge;
+//   std::atomic<bool> referenced;  // Hit without promotion since last sweep
+//   bool in_protected;             // In, or pinned from, the protected segment
+//   bool low_priority;             // Inserted with kLowPriority and not hit since
+//   void SetReferenced();
+//
+// "Shard" provides:
+//
+//   LRUCachePolicy policy() const;
+//   size_t ProtectedCapacity() const;
+//   size_t Size() const;           // Entries in its index
+//   bool Overfull() const;
+//   bool MarkInUse(Entry* e);      // Flag e as held, if a client holds it
+//   void ClearInUse(Entry* e);     // e is back to the shard's own reference
+//   void EvictEntry(Entry* e);     // Remove e from the index and the lists
+//
+// and may hide the hooks below that do nothing by default.
+template <class Shard, class Entry, class Link = Entry>
+class ShardPolicy {
+protected:
+    ShardPolicy() : protected_usage_(0) {
+        // Make empty circular linked lists
+        lru_.next = &lru_;
+        lru_.prev = &lru_;
+        in_use_.next = &in_use_;
+        in_use_.prev = &in_use_;
+        protected_.next = &protected_;
+        protected_.prev = &protected_;
+    }
+
+    // Called on "e" when it is made the newest entry of a list.
+    void Stamp(Entry* /*e*/) { }
+
+    // Called on "e" when it is made as old as "oldest", the entry it
+    // displaces as the next eviction candidate.
+    void Restamp(Entry* /*e*/, const Entry* /*oldest*/) { }
+
+    // Called when eviction gives "e" a second chance for a hit.
+    void OnSecondChance(Entry* /*e*/) { }
+
+    static void LRU_Remove(Link* e) {
+        e->next->prev = e->prev;
+        e->prev->next = e->next;
+    }
+
+    // Make "e" newest entry by inserting just before *list
+    void LRU_Append(Link* list, Entry* e) {
+        shard()->Stamp(e);
+        e->next = list;
+        e->prev = list->prev;
+        e->prev->next = e;
+        e->next->prev = e;
+    }
+
+    // Make "e" the next eviction candidate, as old as the one it displaces.
+    void LRU_AppendOldest(Entry* e) {
+        Link* oldest = lru_.next;
+        LRU_Append(oldest, e);
+        if (oldest != &lru_) {
+            shard()->Restamp(e, static_cast<Entry*>(oldest));
+        }
+    }
+
+    // The entry eviction would start with: the oldest probation entry,
+    // else the oldest protected one.  NULL if both lists are empty.
+    Entry* Oldest() {
+        Link* old = (lru_.next != &lru_) ? lru_.next : protected_.next;
+        return old == &protected_ ? NULL : static_cast<Entry*>(old);
+    }
+
+    // Make the unlinked probation entry "e" the newest protected entry, and
+    // demote the oldest protected entries back to probation while the
+    // segment holds more than its share.
+    void Promote(Entry* e) {
+        LRU_Append(&protected_, e);
+        e->in_protected = true;
+        protected_usage_ += e->charge;
+
+        const size_t limit = shard()->ProtectedCapacity();
+        size_t second_chances = shard()->Size();
+        while (protected_usage_ > limit && protected_.next != e) {
+            Entry* old = static_cast<Entry*>(protected_.next);
+            LRU_Remove(old);
+            if (old->referenced.load(std::memory_order_relaxed) && second_chances > 0) {
+                // Hit by a lock-free lookup since it was promoted.
+                old->referenced.store(false, std::memory_order_relaxed);
+                second_chances--;
+                LRU_Append(e, old);
+                continue;
+            }
+            old->in_protected = false;
+            protected_usage_ -= old->charge;
+            LRU_Append(&lru_, old);
+        }
+    }
+
+    // Move "e", which MarkInUse() has just flagged, to in_use_.  A
+    // protected entry leaves the segment's usage but keeps in_protected,
+    // so that Unpin() puts it back.
+    void Pin(Entry* e) {
+        LRU_Remove(e);
+        if (e->in_protected) {
+            protected_usage_ -= e->charge;
+        }
+        LRU_Append(&in_use_, e);
+    }
+
+    // Make "e", which has just dropped to the shard's own reference, an
+    // eviction candidate again: the newest of its segment, or the oldest
+    // entry if it was inserted with kLowPriority and not hit since.
+    void Unpin(Entry* e) {
+        shard()->ClearInUse(e);
+        LRU_Remove(e);
+        if (e->in_protected) {
+            Promote(e);
+        } else if (e->low_priority) {
+            LRU_AppendOldest(e);
+        } else {
+            LRU_Append(&lru_, e);
+        }
+    }
+
+    // Record a hit on "e", which is "in_use" if it is on in_use_.
+    void Hit(Entry* e, bool in_use) {
+        if (in_use) {
+            // Placed when Unpin() makes it evictable again.
+            if (shard()->policy() == kSegmentedLRUPolicy && !e->low_priority) {
+                e->in_protected = true;
+            }
+            e->low_priority = false;
+        } else if (shard()->policy() == kClockPolicy) {
+            e->SetReferenced();
+        } else if (shard()->policy() == kSegmentedLRUPolicy && !e->in_protected && !e->low_priority) {
+            LRU_Remove(e);
+            Promote(e);
+        } else {
+            // A kLowPriority entry's first hit only makes it a normal one.
+            e->low_priority = false;
+            LRU_Remove(e);
+            LRU_Append(e->in_protected ? &protected_ : &lru_, e);
+        }
+    }
+
+    // Make "e", just inserted with kLowPriority and still cached, the
+    // next eviction candidate.
+    void MakeLowPriority(Entry* e, bool in_use) {
+        e->low_priority = true;
+        if (!in_use) {
+            LRU_Remove(e);
+            LRU_AppendOldest(e);
+        }
+    }
+
+    // Take "e", which is leaving the cache, off the lists.
+    void Unlink(Entry* e, bool in_use) {
+        LRU_Remove(e);
+        if (!in_use && e->in_protected) {
+            protected_usage_ -= e->charge;
+        }
+        e->in_protected = false;
+    }
+
+    // Evict unpinned entries while the shard is Overfull().
+    //
+    // Entries hit without promotion (CLOCK, or lock-free lookups) get a
+    // second chance at the tail, at most once per entry per sweep.  Moving
+    // the oldest entry to the tail is the list form of advancing the clock
+    // hand past it.  Under kSegmentedLRUPolicy the second chance is a
+    // promotion, and victims come from probation first.  Entries still
+    // referenced by clients are moved to in_use_ instead: evicting them
+    // would free nothing, and no later sweep walks over them again.
+    // At most "limit" entries are visited, whether they are evicted, given
+    // a second chance or moved to in_use_; returns how many were.
+    uint32_t EvictLocked(uint32_t limit = UINT32_MAX) {
+        size_t second_chances = shard()->Size();
+        uint32_t visited = 0;
+        for (; visited < limit && shard()->Overfull(); visited++) {
+            Entry* old = Oldest();
+            if (old == NULL) {
+                break;
+            }
+            if (shard()->MarkInUse(old)) {
+                Pin(old);
+                continue;
+            }
+            if (!old->in_protected && old->referenced.load(std::memory_order_relaxed) && second_chances > 0) {
+                old->referenced.store(false, std::memory_order_relaxed);
+                second_chances--;
+                shard()->OnSecondChance(old);
+                LRU_Remove(old);
+                // As in Hit(), a kLowPriority entry's first hit only makes
+                // it a normal one.
+                if (shard()->policy() == kSegmentedLRUPolicy && !old->low_priority) {
+                    Promote(old);
+                } else {
+                    old->low_priority = false;
+                    LRU_Append(&lru_, old);
+                }
+                continue;
+            }
+            shard()->EvictEntry(old);
+        }
+        return visited;
+    }
+
+    // Dummy head of LRU list.
+    // lru.prev is newest entry, lru.next is oldest entry.
+    // Under kSegmentedLRUPolicy this is the probation segment.
+    Link lru_;
+
+    // Dummy head of in-use list.
+    // Entries were found referenced by clients when eviction reached
+    // them.  They move back when their last client reference is released.
+    Link in_use_;
+
+    // Dummy head of the protected segment (kSegmentedLRUPolicy only):
+    // entries hit at least once since they entered probation.
+    Link protected_;
+    size_t protected_usage_;
+
+private:
+    Shard* shard() {
+        return static_cast<Shard*>(this);
+    }
+};
+
+#endif  // LRU_CACHE_SHARD_POLICY_H_
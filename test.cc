@@ -13,14 +13,22 @@
 
 #include <string>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
 
 static std::vector<std::string> args;
 static std::string flag_list_regexp = "";
 static std::string flag_test_regexp = ".*";
 static std::string flag_test_bench_regexp = "";
 static std::string flag_test_bench_benchtime_second = "1";
+static std::vector<int> flag_test_cpu(1, 1);
+static bool flag_test_benchlatency = false;
 
-static struct { int N; double benchtime, timer_start, timer_duration; bool timer_on; } bench;
+static struct { int N, threads; double benchtime, timer_start, timer_duration; bool timer_on, parallel; } bench;
+static struct { double value; const char* unit; } metrics[8];
+static int nmetrics = 0;
 static struct { void (*fn)(void); const char *name, *type; } tests[10000];
 static int ntests = 0;
 
@@ -173,12 +181,120 @@ static int roundUp(int n) {
 	return base*10;
 }
 
+// Wall-clock time, so that multi-threaded benchmarks are timed correctly.
 static double timeNowSec() {
-	return 1.0 * clock() / CLOCKS_PER_SEC;
+	using namespace std::chrono;
+	return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear latency histogram: 16 linear buckets per power of two, so
+// every recorded value is kept to within 1/16 of its magnitude.
+class LatencyHistogram {
+public:
+	enum { kSubBits = 4, kSub = 1 << kSubBits, kBuckets = (64 - kSubBits + 1) * kSub };
+
+	LatencyHistogram() { Clear(); }
+
+	void Clear() {
+		memset(counts_, 0, sizeof(counts_));
+		total_ = max_ = 0;
+	}
+	void Add(uint64_t v) {
+		counts_[bucketOf(v)]++;
+		total_++;
+		if(v > max_) max_ = v;
+	}
+	void Merge(const LatencyHistogram& other) {
+		for(int i = 0; i < kBuckets; ++i) counts_[i] += other.counts_[i];
+		total_ += other.total_;
+		if(other.max_ > max_) max_ = other.max_;
+	}
+
+	uint64_t Total() const { return total_; }
+	uint64_t Max() const { return max_; }
+
+	// The largest value that falls in the bucket holding the p-th
+	// fraction of the samples.
+	uint64_t Percentile(double p) const {
+		uint64_t rank = uint64_t(ceil(p * total_));
+		if(rank == 0) rank = 1;
+		uint64_t seen = 0;
+		for(int i = 0; i < kBuckets; ++i) {
+			seen += counts_[i];
+			if(seen >= rank) return std::min(bucketMax(i), max_);
+		}
+		return max_;
+	}
+
+private:
+	static int highestBit(uint64_t v) {
+		int n = 0;
+		while(v >>= 1) n++;
+		return n;
+	}
+	static int bucketOf(uint64_t v) {
+		if(v < kSub) return int(v);
+		const int msb = highestBit(v);
+		return (msb - kSubBits + 1) * kSub + int((v >> (msb - kSubBits)) & (kSub - 1));
+	}
+	static uint64_t bucketMax(int i) {
+		if(i < kSub) return uint64_t(i);
+		const int shift = i / kSub - 1;
+		const uint64_t lo = uint64_t(kSub + i % kSub) << shift;
+		return lo + ((uint64_t(1) << shift) - 1);
+	}
+
+	uint64_t counts_[kBuckets];
+	uint64_t total_, max_;
+};
+
+// Each recording thread fills its own histogram; they are merged when the
+// results are printed.  A thread's histogram is replaced once the
+// generation moves on, i.e. for every benchmark run.
+static std::mutex latency_mu;
+static std::vector<LatencyHistogram*> latency_hists;
+static std::atomic<int> latency_gen(0);
+
+static LatencyHistogram* localLatencyHistogram() {
+	static thread_local struct { int gen; LatencyHistogram* h; } local = { -1, NULL };
+	const int gen = latency_gen.load(std::memory_order_relaxed);
+	if(local.gen != gen) {
+		local.h = new LatencyHistogram;
+		local.gen = gen;
+		std::lock_guard<std::mutex> l(latency_mu);
+		latency_hists.push_back(local.h);
+	}
+	return local.h;
+}
+
+static void latencyReset() {
+	std::lock_guard<std::mutex> l(latency_mu);
+	for(size_t i = 0; i < latency_hists.size(); ++i) delete latency_hists[i];
+	latency_hists.clear();
+	latency_gen++;
+}
+
+static void latencyPrint() {
+	LatencyHistogram all;
+	{
+		std::lock_guard<std::mutex> l(latency_mu);
+		for(size_t i = 0; i < latency_hists.size(); ++i) all.Merge(*latency_hists[i]);
+	}
+	if(all.Total() == 0) return;
+	printf(" [p50 %llu p90 %llu p99 %llu p999 %llu max %llu ns]",
+		(unsigned long long)all.Percentile(0.50),
+		(unsigned long long)all.Percentile(0.90),
+		(unsigned long long)all.Percentile(0.99),
+		(unsigned long long)all.Percentile(0.999),
+		(unsigned long long)all.Max()
+	);
 }
 
 static void benchRunN(int id, int n) {
 	bench.N = n;
+	bench.parallel = false;
+	nmetrics = 0;
+	if(flag_test_benchlatency) latencyReset();
 	BenchResetTimer();
 	BenchStartTimer();
 	tests[id].fn();
@@ -200,18 +316,40 @@ static void benchRun(int id) {
 	}
 
 	double nsop = 1e9*bench.timer_duration/bench.N;
+	if(bench.parallel) {
+		BenchReportMetric(bench.N/bench.timer_duration, "ops/s");
+		BenchReportMetric(nsop*bench.threads, "ns/op/thread");
+	}
+
+	std::string name = tests[id].name;
+	if(bench.parallel && bench.threads > 1) {
+		char buf[16];
+		sprintf(buf, "-%d", bench.threads);
+		name += buf;
+	}
 	if(nsop < 10) {
-		printf("[bench] %s %d %.2f ns/op\n", tests[id].name, bench.N, float(nsop));
+		printf("[bench] %s %d %.2f ns/op", name.c_str(), bench.N, float(nsop));
 	} else if(nsop < 100) {
-		printf("[bench] %s %d %.1f ns/op\n", tests[id].name, bench.N, float(nsop));
+		printf("[bench] %s %d %.1f ns/op", name.c_str(), bench.N, float(nsop));
 	} else {
-		printf("[bench] %s %d %d ns/op\n", tests[id].name, bench.N, int(nsop));
+		printf("[bench] %s %d %d ns/op", name.c_str(), bench.N, int(nsop));
+	}
+	for(int i = 0; i < nmetrics; ++i) {
+		printf(" %.4g %s", metrics[i].value, metrics[i].unit);
 	}
+	if(flag_test_benchlatency) {
+		latencyPrint();
+		latencyReset();
+	}
+	printf("\n");
 }
 
 int BenchN() {
 	return bench.N;
 }
+int BenchThreads() {
+	return bench.threads > 0? bench.threads: 1;
+}
 void BenchResetTimer() {
 	bench.timer_start = timeNowSec();
 	bench.timer_duration = 0.0;
@@ -228,6 +366,61 @@ void BenchStopTimer() {
 		bench.timer_on = false;
 	}
 }
+void BenchParallel(void (*fn)(int thread, int n, void* arg), void* arg) {
+	const int threads = BenchThreads();
+	std::atomic<int> ready(0);
+	std::atomic<bool> start(false);
+	std::vector<std::thread> workers;
+
+	// Thread startup stays off the clock; the timer covers the span from
+	// releasing the threads to the last one finishing.
+	const bool timer_on = bench.timer_on;
+	BenchStopTimer();
+	for(int i = 0; i < threads; ++i) {
+		const int n = bench.N/threads + (i < bench.N%threads? 1: 0);
+		workers.push_back(std::thread([&ready, &start, fn, i, n, arg]() {
+			ready++;
+			while(!start.load(std::memory_order_acquire)) {
+				std::this_thread::yield();
+			}
+			fn(i, n, arg);
+		}));
+	}
+	while(ready.load() < threads) {
+		std::this_thread::yield();
+	}
+	BenchStartTimer();
+	start.store(true, std::memory_order_release);
+	for(int i = 0; i < threads; ++i) {
+		workers[i].join();
+	}
+	BenchStopTimer();
+	if(timer_on) BenchStartTimer();
+	bench.parallel = true;
+}
+bool BenchLatencyEnabled() {
+	return flag_test_benchlatency;
+}
+uint64_t BenchNanoTime() {
+	using namespace std::chrono;
+	return uint64_t(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+}
+void BenchRecordLatency(uint64_t ns) {
+	localLatencyHistogram()->Add(ns);
+}
+void BenchReportMetric(double value, const char* unit) {
+	for(int i = 0; i < nmetrics; ++i) {
+		if(strcmp(metrics[i].unit, unit) == 0) {
+			metrics[i].value = value;
+			return;
+		}
+	}
+	if(nmetrics < int(sizeof(metrics)/sizeof(metrics[0]))) {
+		metrics[nmetrics].value = value;
+		metrics[nmetrics].unit = unit;
+		nmetrics++;
+	}
+}
 
 static void usage(int argc, char* argv[]) {
 	printf("C++ Mini UnitTest and Benchmark Library.\n");
@@ -239,6 +432,8 @@ static void usage(int argc, char* argv[]) {
 	printf("  [-test=.*]\n");
 	printf("  [-test.bench=]\n");
 	printf("  [-test.benchtime=1second]\n");
+	printf("  [-test.cpu=1,2,4]\n");
+	printf("  [-test.benchlatency]\n");
 	printf("  [-help]\n");
 	printf("  [-h]\n");
 	printf("\n");
@@ -287,6 +482,21 @@ int TestMain(int argc, char* argv[]) {
 			continue;
 		}
 
+		if(argv[i] == std::string("-test.benchlatency")) {
+			flag_test_benchlatency = true;
+			continue;
+		}
+		if(strHasPrefix(argv[i], "-test.cpu=")) {
+			flag_test_cpu.clear();
+			for(const char* p = argv[i]+sizeof("-test.cpu=")-1; *p != '\0'; ) {
+				int n = atoi(p);
+				if(n > 0) flag_test_cpu.push_back(n);
+				while(*p != '\0' && *p++ != ',') {}
+			}
+			if(flag_test_cpu.empty()) flag_test_cpu.push_back(1);
+			continue;
+		}
+
 		// ingore user defined flag
 	}
 
@@ -356,7 +566,13 @@ int TestMain(int argc, char* argv[]) {
 		for(int id = 0; id < ntests; ++id) {
 			if(std::string(tests[id].type) == "bench") {
 				if(match(flag_test_bench_regexp.c_str(), tests[id].name) != 0) {
-					benchRun(id);
+					for(size_t i = 0; i < flag_test_cpu.size(); ++i) {
+						bench.threads = flag_test_cpu[i];
+						benchRun(id);
+						// Only BenchParallel() uses the thread count;
+						// other benchmarks would repeat the same run.
+						if(!bench.parallel) break;
+					}
 				}
 			}
 		}
@@ -103,6 +103,52 @@ If a benchmark needs some expensive setup before running, the timer may be reset
 	}
 
 
+A benchmark may report extra results, printed after ns/op. Only the
+values reported by the final run are shown:
+
+	BENCH(Name, case3) {
+		int hits = 0;
+		for(int i = 0; i < BenchN(); ++i) {
+			hits += Lookup(i);
+		}
+		BenchReportMetric(100.0*hits/BenchN(), "hit%");
+	}
+
+	[bench] Name.case3 1000000 112 ns/op 93.5 hit%
+
+
+To measure how code scales across threads, run the loop with
+`BenchParallel`. It splits the `BenchN()` iterations between
+`BenchThreads()` threads, set by `-test.cpu=1,2,4` (default 1), and
+reports aggregate throughput and the time per op seen by each thread.
+Only such benchmarks are rerun for each `-test.cpu` value and named with
+its `-N` suffix; the others run once:
+
+	static void lookup(int thread, int n, void* arg) {
+		for(int i = 0; i < n; ++i) {
+			Lookup(i);
+		}
+	}
+	BENCH(Name, parallel) {
+		BenchParallel(lookup, NULL);
+	}
+
+	[bench] Name.parallel-4 5000000 30.1 ns/op 3.32e+07 ops/s 120 ns/op/thread
+
+The benchmark timer measures wall-clock time.
+
+The mean hides outliers. With `-test.benchlatency`, benchmarks that time
+their ops one by one also print latency percentiles:
+
+	for(int i = 0; i < BenchN(); ++i) {
+		uint64_t start = BenchLatencyEnabled()? BenchNanoTime(): 0;
+		big.Len();
+		if(BenchLatencyEnabled()) BenchRecordLatency(BenchNanoTime() - start);
+	}
+
+	[bench] Name.case1 2000000 89.6 ns/op [p50 80 p90 95 p99 310 p999 1200 max 40959 ns]
+
+
 ## Init and Exit
 
 We can use `INIT` define a init func, and use `EXIT` define a exit func:
@@ -124,6 +170,8 @@ The init funcs run before the tests, the exit funcs run after the tests.
 	  [-test=.*]
 	  [-test.bench=]
 	  [-test.benchtime=1second]
+	  [-test.cpu=1,2,4]
+	  [-test.benchlatency]
 	  [-help]
 	  [-h]
 
@@ -134,6 +182,8 @@ Please report bugs to <chaishushan@gmail.com>.
 Thanks!
 */
 
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 
@@ -179,9 +229,15 @@ void TestAssertStrEQ(const char* a, const char* b, const char* fname, int lineno
 void TestAssertNear(float a, float b, float abs_error, const char* fname, int lineno, const char* fmt, ...);
 
 int  BenchN();
+int  BenchThreads();
+void BenchParallel(void (*fn)(int thread, int n, void* arg), void* arg);
 void BenchResetTimer();
 void BenchStartTimer();
 void BenchStopTimer();
+void BenchReportMetric(double value, const char* unit);
+bool BenchLatencyEnabled();
+uint64_t BenchNanoTime();
+void BenchRecordLatency(uint64_t ns);
 
 int  TestMain(int argc, char* argv[]);
 
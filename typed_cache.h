@@ -0,0 +1,381 @@
+// Copyright 2016 <chaishushan{AT}gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// TypedLRUCache is a header-only counterpart of LRUCache for keys and
+// values of fixed C++ types:
+//
+//   TypedLRUCache<uint64_t, BlockInfo> cache(1 << 20);
+//   TypedLRUCache<uint64_t, BlockInfo>::Handle* h = cache.Lookup(id);
+//   if (h != NULL) {
+//       Use(cache.Value(h));
+//       cache.Release(h);
+//   }
+//
+// It shards and evicts the way LRUCache does, through the same
+// ShardPolicy, with the policy fixed at compile time: entries held
+// through handles are not evicted, and kLowPriority inserts are the next
+// to go.  But keys are hashed and compared inline through "Hash" and
+// operator==, and values are stored in the entry and destroyed by
+// their destructor.  So no call on the hot path is virtual or through a
+// function pointer.  Values are destroyed after the shard mutex has been
+// released, so destructors may be slow.
+
+#pragma once
+
+#ifndef LRU_CACHE_TYPED_CACHE_H_
+#define LRU_CACHE_TYPED_CACHE_H_
+
+#include "cache.h"
+#include "shard_policy.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+template <
+    class K, class V, class Hash = std::hash<K>,
+    LRUCachePolicy Policy = kLRUPolicy
+>
+class TypedLRUCache {
+public:
+    // Opaque handle to an entry stored in the cache.
+    struct Handle { };
+
+    // "protected_ratio" is only used by kSegmentedLRUPolicy.  A negative
+    // num_shard_bits picks a default as LRUCacheOptions does.
+    explicit TypedLRUCache(size_t capacity, int num_shard_bits = -1, double protected_ratio = 0.8)
+        : num_shard_bits_(ShardBits(num_shard_bits)), shards_(size_t(1) << num_shard_bits_) {
+        const size_t per_shard = (capacity + (shards_.size() - 1)) / shards_.size();
+        for (size_t s = 0; s < shards_.size(); s++) {
+            shards_[s].capacity = per_shard;
+            shards_[s].protected_capacity = static_cast<size_t>(per_shard * protected_ratio);
+        }
+    }
+
+    // Destroys all entries.
+    // REQUIRES: no handles are outstanding.
+    ~TypedLRUCache() {
+        for (size_t s = 0; s < shards_.size(); s++) {
+            shards_[s].Clear();
+        }
+    }
+
+    // Insert a copy of key->value with the given charge, replacing any
+    // existing mapping.  Returns a handle the caller must Release().
+    // "priority" is as for LRUCache::Insert().
+    Handle* Insert(const K& key, const V& value, size_t charge = 1,
+                   LRUCache::Priority priority = LRUCache::kNormalPriority) {
+        return Put(key, charge, priority, value);
+    }
+
+    // Like Insert(), but constructs the value in place from "args".
+    template <class... Args>
+    Handle* Emplace(const K& key, size_t charge, Args&&... args) {
+        return Put(key, charge, LRUCache::kNormalPriority, std::forward<Args>(args)...);
+    }
+
+    // Returns NULL if there is no mapping for "key".
+    Handle* Lookup(const K& key) {
+        const uint64_t hash = HashOf(key);
+        return Wrap(shards_[Shard(hash)].Lookup(key, hash));
+    }
+
+    // REQUIRES: handle must not have been released yet.
+    void Release(Handle* handle) {
+        Node* e = Unwrap(handle);
+        shards_[Shard(e->hash)].Release(e);
+    }
+
+    // The value of a handle, valid until the handle is released.
+    V& Value(Handle* handle) {
+        return Unwrap(handle)->value;
+    }
+    const K& Key(Handle* handle) {
+        return Unwrap(handle)->key;
+    }
+
+    // Remove any mapping for "key".  The entry lives on while handles to
+    // it are outstanding.
+    void Erase(const K& key) {
+        const uint64_t hash = HashOf(key);
+        shards_[Shard(hash)].Erase(key, hash);
+    }
+
+    // The total charge of live entries.
+    size_t TotalCharge() {
+        size_t total = 0;
+        for (size_t s = 0; s < shards_.size(); s++) {
+            std::lock_guard<std::mutex> l(shards_[s].mutex);
+            total += shards_[s].usage;
+        }
+        return total;
+    }
+
+private:
+    // Recency list links.  List heads are bare Links, so K and V need
+    // not be default-constructible.
+    struct Link {
+        Link* next;
+        Link* prev;
+    };
+
+    struct Node : Link {
+        Node* next_hash;    // Also chains entries waiting to be destroyed
+        size_t charge;
+        uint64_t hash;
+        uint32_t refs;      // Guarded by the shard mutex
+        bool in_cache;
+        bool in_protected;
+        bool in_use;        // On the in_use list: held by a client
+        bool low_priority;  // Inserted with kLowPriority and not hit since
+        std::atomic<bool> referenced;   // kClockPolicy: hit since the last sweep
+        K key;
+        V value;
+
+        template <class... Args>
+        Node(const K& k, uint64_t h, size_t c, Args&&... args)
+            : next_hash(NULL), charge(c), hash(h), refs(2),
+              in_cache(true), in_protected(false), in_use(false), low_priority(false), referenced(false),
+              key(k), value(std::forward<Args>(args)...) { }
+
+        void SetReferenced() {
+            referenced.store(true, std::memory_order_relaxed);
+        }
+    };
+
+    // The table and accounting of a shard, with the policy logic of
+    // LRUCacheImpl from ShardPolicy.  Policy is a constant, so that unused
+    // branches disappear.  Padded to cache lines as the shards of LRUCache
+    // are, so that neighbouring mutexes do not share one.
+    struct alignas(64) Shard_ : ShardPolicy<Shard_, Node, Link> {
+        typedef ShardPolicy<Shard_, Node, Link> Base;
+        using Base::lru_;
+        using Base::in_use_;
+        using Base::protected_;
+        using Base::LRU_Append;
+        using Base::Unpin;
+        using Base::Hit;
+        using Base::MakeLowPriority;
+        using Base::Unlink;
+        using Base::EvictLocked;
+
+        std::mutex mutex;
+        size_t capacity;
+        size_t protected_capacity;
+        size_t usage;
+        size_t elems;
+        std::vector<Node*> table;
+        Node* dead_;        // Entries to destroy once the mutex is released
+
+        Shard_() : capacity(0), protected_capacity(0), usage(0), elems(0), table(4, NULL), dead_(NULL) { }
+
+        // ShardPolicy's hooks.
+        static LRUCachePolicy policy() { return Policy; }
+        size_t ProtectedCapacity() const { return protected_capacity; }
+        size_t Size() const { return elems; }
+        bool Overfull() const { return usage > capacity; }
+        bool MarkInUse(Node* e) {
+            if (e->refs > 1) {
+                e->in_use = true;
+                return true;
+            }
+            return false;
+        }
+        void ClearInUse(Node* e) { e->in_use = false; }
+        void EvictEntry(Node* e) {
+            *Find(e->key, e->hash) = e->next_hash;
+            FinishErase(e);
+        }
+
+        Node** Find(const K& key, uint64_t hash) {
+            Node** ptr = &table[hash & (table.size() - 1)];
+            while (*ptr != NULL && ((*ptr)->hash != hash || !((*ptr)->key == key))) {
+                ptr = &(*ptr)->next_hash;
+            }
+            return ptr;
+        }
+
+        void Rehash(size_t size) {
+            std::vector<Node*> resized(size, NULL);
+            for (size_t i = 0; i < table.size(); i++) {
+                for (Node* e = table[i]; e != NULL; ) {
+                    Node* next = e->next_hash;
+                    Node** head = &resized[e->hash & (resized.size() - 1)];
+                    e->next_hash = *head;
+                    *head = e;
+                    e = next;
+                }
+            }
+            table.swap(resized);
+        }
+
+        // REQUIRES: mutex held.  Queues e on dead_ if that was its last
+        // reference.
+        void Unref(Node* e) {
+            assert(e->refs > 0);
+            if (--e->refs == 0) {
+                usage -= e->charge;
+                e->next_hash = dead_;
+                dead_ = e;
+            } else if (e->refs == 1 && e->in_use) {
+                Unpin(e);
+                EvictLocked();
+            }
+        }
+
+        // "e" has been unlinked from the table.
+        void FinishErase(Node* e) {
+            Unlink(e, e->in_use);
+            e->in_use = false;
+            e->in_cache = false;
+            elems--;
+            // Same hysteresis as LRUCache's tables: shrink well below the
+            // growth threshold.
+            if (table.size() > 4 && elems < table.size() / 4) {
+                Rehash(table.size() / 2);
+            }
+            Unref(e);
+        }
+
+        // REQUIRES: mutex held.
+        Node* TakeDead() {
+            Node* dead = dead_;
+            dead_ = NULL;
+            return dead;
+        }
+
+        static void Destroy(Node* dead) {
+            while (dead != NULL) {
+                Node* next = dead->next_hash;
+                delete dead;
+                dead = next;
+            }
+        }
+
+        Node* Insert(Node* e, LRUCache::Priority priority) {
+            Node* dead;
+            {
+                std::lock_guard<std::mutex> l(mutex);
+                LRU_Append(&lru_, e);
+                usage += e->charge;
+
+                Node** ptr = Find(e->key, e->hash);
+                Node* old = *ptr;
+                e->next_hash = (old == NULL) ? NULL : old->next_hash;
+                *ptr = e;
+                elems++;
+                if (old != NULL) {
+                    FinishErase(old);
+                } else if (elems > table.size()) {
+                    Rehash(table.size() * 2);
+                }
+                EvictLocked();
+
+                // Low priority entries become the next eviction candidates.
+                if (priority == LRUCache::kLowPriority && e->in_cache) {
+                    MakeLowPriority(e, e->in_use);
+                }
+                dead = TakeDead();
+            }
+            Destroy(dead);
+            return e;
+        }
+
+        Node* Lookup(const K& key, uint64_t hash) {
+            std::lock_guard<std::mutex> l(mutex);
+            Node* e = *Find(key, hash);
+            if (e != NULL) {
+                e->refs++;
+                Hit(e, e->in_use);
+            }
+            return e;
+        }
+
+        void Release(Node* e) {
+            Node* dead;
+            {
+                std::lock_guard<std::mutex> l(mutex);
+                Unref(e);
+                dead = TakeDead();
+            }
+            Destroy(dead);
+        }
+
+        void Erase(const K& key, uint64_t hash) {
+            Node* dead;
+            {
+                std::lock_guard<std::mutex> l(mutex);
+                Node** ptr = Find(key, hash);
+                Node* e = *ptr;
+                if (e != NULL) {
+                    *ptr = e->next_hash;
+                    FinishErase(e);
+                }
+                dead = TakeDead();
+            }
+            Destroy(dead);
+        }
+
+        void Clear() {
+            assert(in_use_.next == &in_use_);  // Error if caller has an unreleased handle
+            Link* lists[] = { &lru_, &protected_ };
+            for (size_t i = 0; i < 2; i++) {
+                for (Link* l = lists[i]->next; l != lists[i]; ) {
+                    Node* e = static_cast<Node*>(l);
+                    l = l->next;
+                    assert(e->refs == 1);  // Error if caller has an unreleased handle
+                    Unref(e);
+                }
+            }
+            Destroy(TakeDead());
+        }
+    };
+
+    static int ShardBits(int bits) {
+        LRUCacheOptions options;
+        options.num_shard_bits = bits;
+        return options.ShardBits();
+    }
+
+    template <class... Args>
+    Handle* Put(const K& key, size_t charge, LRUCache::Priority priority, Args&&... args) {
+        const uint64_t hash = HashOf(key);
+        Node* e = new Node(key, hash, charge, std::forward<Args>(args)...);
+        return Wrap(shards_[Shard(hash)].Insert(e, priority));
+    }
+
+    // The caller's hash, which may be the identity for integers, remixed
+    // as LRUCache remixes its callers' hashes: the high half picks the
+    // shard and the low half the bucket.
+    static uint64_t HashOf(const K& key) {
+        return ShardHash(static_cast<uint64_t>(Hash()(key)));
+    }
+
+    // The top num_shard_bits_ bits of the hash, as in LRUCache.
+    uint32_t Shard(uint64_t hash) const {
+        return static_cast<uint32_t>(((hash >> 32) << num_shard_bits_) >> 32);
+    }
+
+    static Handle* Wrap(Node* e) {
+        return reinterpret_cast<Handle*>(e);
+    }
+    static Node* Unwrap(Handle* h) {
+        return reinterpret_cast<Node*>(h);
+    }
+
+    const int num_shard_bits_;
+    std::vector<Shard_> shards_;
+
+    // No copying allowed
+    TypedLRUCache(const TypedLRUCache&);
+    void operator=(const TypedLRUCache&);
+};
+
+#endif  // LRU_CACHE_TYPED_CACHE_H_
@@ -0,0 +1,224 @@
+// Copyright 2016 <chaishushan{AT}gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "test.h"
+#include "typed_cache.h"
+
+#include <stdint.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+// Counts live instances, so tests can check values are destroyed.
+static int live_values = 0;
+
+struct CountedValue {
+    int v;
+
+    explicit CountedValue(int x): v(x) { live_values++; }
+    CountedValue(const CountedValue& other): v(other.v) { live_values++; }
+    ~CountedValue() { live_values--; }
+};
+
+TEST(TypedLRUCache, HitAndMiss) {
+    TypedLRUCache<uint64_t, int> cache(1000, 0);
+    ASSERT_TRUE(cache.Lookup(100) == NULL);
+
+    cache.Release(cache.Insert(100, 101));
+    TypedLRUCache<uint64_t, int>::Handle* h = cache.Lookup(100);
+    ASSERT_TRUE(h != NULL);
+    ASSERT_EQ(101, cache.Value(h));
+    ASSERT_TRUE(cache.Key(h) == 100);
+    cache.Release(h);
+
+    cache.Release(cache.Insert(100, 102));
+    h = cache.Lookup(100);
+    ASSERT_EQ(102, cache.Value(h));
+    cache.Release(h);
+    ASSERT_TRUE(cache.Lookup(200) == NULL);
+
+    cache.Erase(100);
+    ASSERT_TRUE(cache.Lookup(100) == NULL);
+    ASSERT_EQ(0, int(cache.TotalCharge()));
+}
+
+TEST(TypedLRUCache, ValuesAreDestroyed) {
+    {
+        TypedLRUCache<int, CountedValue> cache(3, 0);
+        cache.Release(cache.Emplace(1, 1, 10));
+        cache.Release(cache.Insert(2, CountedValue(20)));
+        ASSERT_EQ(2, live_values);
+
+        // A pinned entry outlives its replacement and eviction.
+        TypedLRUCache<int, CountedValue>::Handle* h = cache.Lookup(1);
+        cache.Release(cache.Emplace(1, 1, 11));
+        ASSERT_EQ(3, live_values);
+        ASSERT_EQ(10, cache.Value(h).v);
+        cache.Release(h);
+        ASSERT_EQ(2, live_values);
+
+        cache.Release(cache.Emplace(3, 1, 30));
+        cache.Release(cache.Emplace(4, 1, 40));
+        ASSERT_EQ(3, live_values);
+    }
+    ASSERT_EQ(0, live_values);
+}
+
+TEST(TypedLRUCache, StringKeys) {
+    TypedLRUCache<std::string, std::string> cache(100, 2);
+    for (int i = 0; i < 50; i++) {
+        cache.Release(cache.Insert(std::to_string(i), std::to_string(i * 2)));
+    }
+    for (int i = 0; i < 50; i++) {
+        TypedLRUCache<std::string, std::string>::Handle* h = cache.Lookup(std::to_string(i));
+        ASSERT_TRUE(h != NULL);
+        ASSERT_TRUE(cache.Value(h) == std::to_string(i * 2));
+        cache.Release(h);
+    }
+}
+
+// Checks the eviction order of a one-shard cache of capacity 4 after
+// inserting 1..4, hitting 1 and 2, then inserting 5 and 6.
+template <LRUCachePolicy Policy>
+static std::vector<int> Survivors() {
+    TypedLRUCache<int, int, std::hash<int>, Policy> cache(4, 0, 0.5);
+    for (int k = 1; k <= 4; k++) {
+        cache.Release(cache.Insert(k, k));
+    }
+    for (int k = 1; k <= 2; k++) {
+        cache.Release(cache.Lookup(k));
+    }
+    cache.Release(cache.Insert(5, 5));
+    cache.Release(cache.Insert(6, 6));
+
+    std::vector<int> survivors;
+    for (int k = 1; k <= 6; k++) {
+        typename TypedLRUCache<int, int, std::hash<int>, Policy>::Handle* h = cache.Lookup(k);
+        if (h != NULL) {
+            survivors.push_back(k);
+            cache.Release(h);
+        }
+    }
+    return survivors;
+}
+
+TEST(TypedLRUCache, CompileTimePolicy) {
+    // Every policy keeps the recently hit keys and evicts 3 and 4.
+    const int want[] = { 1, 2, 5, 6 };
+    ASSERT_TRUE(Survivors<kLRUPolicy>() == std::vector<int>(want, want + 4));
+    ASSERT_TRUE(Survivors<kClockPolicy>() == std::vector<int>(want, want + 4));
+    ASSERT_TRUE(Survivors<kSegmentedLRUPolicy>() == std::vector<int>(want, want + 4));
+}
+
+TEST(TypedLRUCache, HeavyEntries) {
+    TypedLRUCache<int, int> cache(1000, 0);
+    cache.Release(cache.Insert(1, 1, 600));
+    cache.Release(cache.Insert(2, 2, 600));
+    ASSERT_TRUE(cache.Lookup(1) == NULL);
+    ASSERT_EQ(600, int(cache.TotalCharge()));
+}
+
+TEST(TypedLRUCache, PinnedEntriesAreNotEvicted) {
+    TypedLRUCache<int, int> cache(2, 0);
+    TypedLRUCache<int, int>::Handle* h = cache.Insert(1, 10);
+    cache.Release(cache.Insert(2, 20));
+    cache.Release(cache.Insert(3, 30));
+    ASSERT_TRUE(cache.Lookup(2) == NULL);
+    TypedLRUCache<int, int>::Handle* again = cache.Lookup(1);
+    ASSERT_TRUE(again != NULL);
+    ASSERT_EQ(10, cache.Value(again));
+    cache.Release(again);
+    cache.Release(h);
+
+    // Once released it is an eviction candidate again, as the newest
+    // entry.
+    cache.Release(cache.Insert(4, 40));
+    ASSERT_TRUE(cache.Lookup(3) == NULL);
+    cache.Release(cache.Insert(5, 50));
+    ASSERT_TRUE(cache.Lookup(1) == NULL);
+    ASSERT_EQ(2, int(cache.TotalCharge()));
+}
+
+TEST(TypedLRUCache, LowPriority) {
+    TypedLRUCache<int, int> cache(3, 0);
+    cache.Release(cache.Insert(1, 1));
+    cache.Release(cache.Insert(2, 2));
+    cache.Release(cache.Insert(3, 3, 1, LRUCache::kLowPriority));
+    cache.Release(cache.Insert(4, 4));
+    ASSERT_TRUE(cache.Lookup(3) == NULL);
+
+    // A hit makes a low-priority entry a normal one.
+    cache.Release(cache.Insert(5, 5, 1, LRUCache::kLowPriority));
+    cache.Release(cache.Lookup(5));
+    cache.Release(cache.Insert(6, 6));
+    TypedLRUCache<int, int>::Handle* h = cache.Lookup(5);
+    ASSERT_TRUE(h != NULL);
+    cache.Release(h);
+}
+
+TEST(TypedLRUCache, GrowAndShrink) {
+    TypedLRUCache<int, int> cache(100000, 0);
+    for (int round = 0; round < 3; round++) {
+        const int n = 20000 >> round;
+        for (int i = 0; i < n; i++) {
+            cache.Release(cache.Insert(i, i));
+        }
+        for (int i = 0; i < n; i++) {
+            if (i % 3 == 0) {
+                cache.Erase(i);
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            TypedLRUCache<int, int>::Handle* h = cache.Lookup(i);
+            ASSERT_EQ(i % 3 != 0, h != NULL);
+            if (h != NULL) {
+                ASSERT_EQ(i, cache.Value(h));
+                cache.Release(h);
+            }
+            cache.Erase(i);
+        }
+        ASSERT_EQ(0, int(cache.TotalCharge()));
+    }
+}
+
+TEST(TypedLRUCache, StridedKeysSpread) {
+    // std::hash of an integer is the identity, so these keys share their
+    // low 16 bits and have zeros in the high ones.  The remix still spreads
+    // them over all 64 shards, so at half the capacity none is evicted.
+    TypedLRUCache<uint64_t, int> cache(64 * 100, 6);
+    for (uint64_t i = 0; i < 64 * 50; i++) {
+        cache.Release(cache.Insert(i << 16, int(i)));
+    }
+    for (uint64_t i = 0; i < 64 * 50; i++) {
+        TypedLRUCache<uint64_t, int>::Handle* h = cache.Lookup(i << 16);
+        ASSERT_TRUE(h != NULL);
+        ASSERT_EQ(int(i), cache.Value(h));
+        cache.Release(h);
+    }
+}
+
+TEST(TypedLRUCache, Concurrent) {
+    TypedLRUCache<uint64_t, uint64_t> cache(512, 3);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.push_back(std::thread([&cache, t]() {
+            for (uint64_t i = 0; i < 20000; i++) {
+                const uint64_t k = (i * 7 + t) % 1024;
+                TypedLRUCache<uint64_t, uint64_t>::Handle* h = cache.Lookup(k);
+                if (h == NULL) {
+                    h = cache.Insert(k, k * 3);
+                }
+                if (cache.Value(h) != k * 3) {
+                    abort();
+                }
+                cache.Release(h);
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+    ASSERT_TRUE(cache.TotalCharge() <= 512 + 8);
+}